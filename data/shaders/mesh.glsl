@@ -162,6 +162,7 @@ mediump vec3 getNormal()
 #ifdef VERTEX_SHADER
 
 /************************************************************************/
+#ifndef PACKED_VERTICES
 attribute highp   vec3 a_pos;
 attribute mediump vec3 a_normal;
 attribute mediump vec3 a_tangent;
@@ -170,17 +171,66 @@ attribute lowp    vec4 a_color;
 attribute mediump vec2 a_occlusion_uv;
 attribute mediump vec2 a_bump_uv;   // bump tex base coordinates [0,255]
 attribute mediump vec2 a_uv;        // uv coordinates [0,1]
+#else
+attribute highp   vec4 a_pos;       // xyz: pos, w: face * 4 + corner.
+attribute lowp    vec4 a_color;
+attribute highp   vec4 a_packed;    // shadow mask, borders mask, gradient.
+#endif
 
 // Must match the value in goxel.h
 #define VOXEL_TEXTURE_SIZE 8.0
 
+#ifdef PACKED_VERTICES
+/*
+ * Function: face_vectors
+ * Get the normal and tangent of a cube face, must match block_def.h.
+ */
+void face_vectors(highp float f, out mediump vec3 n, out mediump vec3 t)
+{
+    if      (f < 0.5) { n = vec3( 0, -1,  0); t = vec3(+1,  0,  0); }
+    else if (f < 1.5) { n = vec3( 0, +1,  0); t = vec3(-1,  0,  0); }
+    else if (f < 2.5) { n = vec3( 0,  0, -1); t = vec3( 0, +1,  0); }
+    else if (f < 3.5) { n = vec3( 0,  0, +1); t = vec3( 0, +1,  0); }
+    else if (f < 4.5) { n = vec3(+1,  0,  0); t = vec3( 0, +1,  0); }
+    else              { n = vec3(-1,  0,  0); t = vec3( 0,  0, +1); }
+}
+#endif
+
 void main()
 {
-    vec4 pos = u_model * vec4(a_pos * u_pos_scale, 1.0);
+#ifndef PACKED_VERTICES
+    highp   vec3 a_pos3 = a_pos;
+    mediump vec3 a_normal3 = a_normal;
+    mediump vec3 a_tangent3 = a_tangent;
+    mediump vec3 a_gradient3 = a_gradient;
+    mediump vec2 a_occlusion_uv2 = a_occlusion_uv;
+    mediump vec2 a_bump_uv2 = a_bump_uv;
+    mediump vec2 a_uv2 = a_uv;
+#else
+    // Reconstruct the full vertex attributes (see mesh_to_vertices.c).
+    highp   vec3 a_pos3 = a_pos.xyz;
+    highp   float face = floor(a_pos.w / 4.0);
+    highp   float corner = a_pos.w - face * 4.0;
+    mediump vec3 a_normal3, a_tangent3;
+    face_vectors(face, a_normal3, a_tangent3);
+    mediump vec2 a_uv2 = vec2(step(0.5, corner) - step(2.5, corner),
+                              step(1.5, corner));
+    highp   vec2 masks = a_packed.xy;
+    mediump vec2 a_occlusion_uv2 =
+        vec2(mod(masks.x, 16.0), floor(masks.x / 16.0)) * VOXEL_TEXTURE_SIZE +
+        a_uv2 * (VOXEL_TEXTURE_SIZE - 1.0);
+    mediump vec2 a_bump_uv2 =
+        vec2(mod(masks.y, 16.0), floor(masks.y / 16.0)) * 16.0;
+    highp   float g = a_packed.z + a_packed.w * 256.0;
+    mediump vec3 a_gradient3 = mod(floor(g / vec3(1.0, 32.0, 1024.0)), 32.0)
+                               - 16.0;
+#endif
+
+    vec4 pos = u_model * vec4(a_pos3 * u_pos_scale, 1.0);
     v_Position = vec3(pos.xyz) / pos.w;
 
     v_color = a_color.rgba * a_color.rgba; // srgb to linear (fast).
-    v_occlusion_uv = (a_occlusion_uv + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);
+    v_occlusion_uv = (a_occlusion_uv2 + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);
     gl_Position = u_proj * u_view * vec4(v_Position, 1.0);
     gl_Position.z += u_z_ofs;
 
@@ -189,17 +239,17 @@ void main()
 #endif
 
 #ifdef HAS_TANGENTS
-    mediump vec4 tangent = vec4(normalize(a_tangent), 1.0);
-    mediump vec3 normalW = normalize(a_normal);
+    mediump vec4 tangent = vec4(normalize(a_tangent3), 1.0);
+    mediump vec3 normalW = normalize(vec3(u_model * vec4(a_normal3, 0.0)));
     mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent.xyz, 0.0)));
     mediump vec3 bitangentW = cross(normalW, tangentW) * tangent.w;
     v_TBN = mat3(tangentW, bitangentW, normalW);
 #else
-    v_Normal = normalize(a_normal);
+    v_Normal = normalize(vec3(u_model * vec4(a_normal3, 0.0)));
 #endif
 
-    v_gradient = a_gradient;
-    v_UVCoord1 = (a_bump_uv + 0.5 + a_uv * 15.0) / 256.0;
+    v_gradient = vec3(u_model * vec4(a_gradient3, 0.0));
+    v_UVCoord1 = (a_bump_uv2 + 0.5 + a_uv2 * 15.0) / 256.0;
 
 #ifdef VERTEX_LIGHTNING
     mediump vec3 N = getNormal();
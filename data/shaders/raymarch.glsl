@@ -0,0 +1,142 @@
+/*
+ * Ray marching of a mesh voxels.
+ *
+ * We render the back faces of the mesh box, and for each fragment walk the
+ * voxels along the view ray until we hit a visible one.  The voxels are
+ * stored in slots of a 3D texture atlas, and u_table gives for each block
+ * of the box the position of its slot in the atlas (alpha is zero for
+ * empty blocks).
+ *
+ * All the computations are done in the box space, where each voxel has a
+ * size of one and the box origin is at zero.
+ */
+
+// Maximum number of voxels we walk for a single ray.
+#define MAX_STEPS 2048
+#define BLOCK_SIZE 16.0
+#define M_PI 3.14159265
+
+uniform highp mat4  u_model;
+uniform highp mat4  u_view;
+uniform highp mat4  u_proj;
+uniform highp vec3  u_size;         // Size of the box in voxels.
+uniform highp vec3  u_camera;       // Camera position in the box space.
+uniform highp vec3  u_dir;          // View direction for ortho projection.
+uniform lowp  float u_ortho;
+
+uniform highp sampler3D u_atlas;
+uniform highp sampler3D u_table;
+uniform highp vec3  u_atlas_size;   // Size of the atlas in slots.
+
+uniform lowp    vec3  u_l_dir;
+uniform lowp    float u_l_int;
+uniform lowp    float u_l_amb;
+uniform lowp    vec4  u_m_base_color;
+uniform lowp    float u_m_metallic;
+
+varying highp vec3 v_pos;
+
+#ifdef VERTEX_SHADER
+
+/************************************************************************/
+attribute highp vec3 a_pos;
+
+void main()
+{
+    v_pos = a_pos * u_size;
+    gl_Position = u_proj * u_view * u_model * vec4(v_pos, 1.0);
+}
+/************************************************************************/
+
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+/************************************************************************/
+
+// Return the value of the voxel at a given integer position of the box.
+vec4 get_voxel(highp vec3 p)
+{
+    highp vec3 b = floor(p / BLOCK_SIZE);
+    highp vec4 slot = texture3D(u_table, (b + 0.5) / ceil(u_size / BLOCK_SIZE));
+    if (slot.a < 0.5) return vec4(0.0);
+    slot.xyz = floor(slot.xyz * 255.0 + 0.5);
+    return texture3D(u_atlas, (slot.xyz * BLOCK_SIZE + p - b * BLOCK_SIZE +
+                               0.5) / (u_atlas_size * BLOCK_SIZE));
+}
+
+void main()
+{
+    highp vec3 ro, rd, inv, t0, t1, tmin, tmax, cell, stp, tnext, tdelta, n;
+    highp float t, tfar;
+    highp vec4 v, clip;
+    int i;
+
+    if (u_ortho > 0.5) {
+        rd = normalize(u_dir);
+        ro = v_pos - rd * length(u_size) * 2.0;
+    } else {
+        ro = u_camera;
+        rd = normalize(v_pos - u_camera);
+    }
+    // Avoid divisions by zero.
+    rd = mix(rd, vec3(1e-6), vec3(lessThan(abs(rd), vec3(1e-6))));
+    inv = 1.0 / rd;
+
+    // Intersection of the ray with the box.
+    t0 = -ro * inv;
+    t1 = (u_size - ro) * inv;
+    tmin = min(t0, t1);
+    tmax = max(t0, t1);
+    t = max(max(max(tmin.x, tmin.y), tmin.z), 0.0);
+    tfar = min(min(tmax.x, tmax.y), tmax.z);
+    if (t >= tfar) discard;
+
+    // Normal of the face we enter the box from.
+    stp = sign(rd);
+    n = -stp * vec3(greaterThanEqual(tmin, vec3(max(tmin.y, tmin.z),
+                                                max(tmin.x, tmin.z),
+                                                max(tmin.x, tmin.y))));
+
+    cell = clamp(floor(ro + rd * (t + 1e-4)), vec3(0.0), u_size - 1.0);
+    tdelta = abs(inv);
+    tnext = (cell + max(stp, 0.0) - ro) * inv;
+
+    for (i = 0; i < MAX_STEPS; i++) {
+        v = get_voxel(cell);
+        if (v.a > 0.5) break;
+        if (tnext.x < tnext.y && tnext.x < tnext.z) {
+            t = tnext.x;
+            cell.x += stp.x;
+            tnext.x += tdelta.x;
+            n = vec3(-stp.x, 0.0, 0.0);
+        } else if (tnext.y < tnext.z) {
+            t = tnext.y;
+            cell.y += stp.y;
+            tnext.y += tdelta.y;
+            n = vec3(0.0, -stp.y, 0.0);
+        } else {
+            t = tnext.z;
+            cell.z += stp.z;
+            tnext.z += tdelta.z;
+            n = vec3(0.0, 0.0, -stp.z);
+        }
+        if (t >= tfar) discard;
+    }
+    if (v.a <= 0.5) discard;
+
+    // Same diffuse and ambient light as the mesh shader.
+    n = normalize(vec3(u_model * vec4(n, 0.0)));
+    vec3 base_color = (u_m_base_color * v * v).rgb;
+    float NdotL = clamp(dot(n, normalize(u_l_dir)), 0.0, 1.0);
+    vec3 color = u_l_int * NdotL * base_color * 0.96 *
+                 (1.0 - u_m_metallic) / M_PI + u_l_amb * base_color;
+    gl_FragColor = vec4(sqrt(color), u_m_base_color.a);
+
+    clip = u_proj * u_view * u_model * vec4(ro + rd * t, 1.0);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+}
+
+/************************************************************************/
+
+#endif
@@ -1182,6 +1182,12 @@ bool intersect_bvh(const bvh_shape& shape, const ray3f& ray_, int& element,
   }
 #endif
 
+  // call the custom intersection if needed
+  if (shape.intersect_func) {
+    return shape.intersect_func(
+        shape.intersect_data, ray_, element, uv, distance, find_any);
+  }
+
   // check empty
   if (shape.nodes.empty()) return false;
 
@@ -170,6 +170,12 @@ struct bvh_shape {
   // nodes
   vector<bvh_node> nodes = {};
 
+  // custom intersection function, used instead of the nodes if set
+  // (the first node should still contain the shape bounds)
+  bool (*intersect_func)(const void* data, const ray3f& ray, int& element,
+      vec2f& uv, float& distance, bool find_any) = nullptr;
+  const void* intersect_data = nullptr;
+
 #if YOCTO_EMBREE
   // Embree opaque data
   void* embree_bvh       = nullptr;
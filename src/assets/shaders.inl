@@ -48,7 +48,7 @@
     "#endif\n"
     ""
 },
-{.path = "data/shaders/mesh.glsl", .size = 8877, .data =
+{.path = "data/shaders/mesh.glsl", .size = 11002, .data =
     "/* Goxel 3D voxels editor\n"
     " *\n"
     " * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>\n"
@@ -213,6 +213,7 @@
     "#ifdef VERTEX_SHADER\n"
     "\n"
     "/************************************************************************/\n"
+    "#ifndef PACKED_VERTICES\n"
     "attribute highp   vec3 a_pos;\n"
     "attribute mediump vec3 a_normal;\n"
     "attribute mediump vec3 a_tangent;\n"
@@ -221,17 +222,66 @@
     "attribute mediump vec2 a_occlusion_uv;\n"
     "attribute mediump vec2 a_bump_uv;   // bump tex base coordinates [0,255]\n"
     "attribute mediump vec2 a_uv;        // uv coordinates [0,1]\n"
+    "#else\n"
+    "attribute highp   vec4 a_pos;       // xyz: pos, w: face * 4 + corner.\n"
+    "attribute lowp    vec4 a_color;\n"
+    "attribute highp   vec4 a_packed;    // shadow mask, borders mask, gradient.\n"
+    "#endif\n"
     "\n"
     "// Must match the value in goxel.h\n"
     "#define VOXEL_TEXTURE_SIZE 8.0\n"
     "\n"
+    "#ifdef PACKED_VERTICES\n"
+    "/*\n"
+    " * Function: face_vectors\n"
+    " * Get the normal and tangent of a cube face, must match block_def.h.\n"
+    " */\n"
+    "void face_vectors(highp float f, out mediump vec3 n, out mediump vec3 t)\n"
+    "{\n"
+    "    if      (f < 0.5) { n = vec3( 0, -1,  0); t = vec3(+1,  0,  0); }\n"
+    "    else if (f < 1.5) { n = vec3( 0, +1,  0); t = vec3(-1,  0,  0); }\n"
+    "    else if (f < 2.5) { n = vec3( 0,  0, -1); t = vec3( 0, +1,  0); }\n"
+    "    else if (f < 3.5) { n = vec3( 0,  0, +1); t = vec3( 0, +1,  0); }\n"
+    "    else if (f < 4.5) { n = vec3(+1,  0,  0); t = vec3( 0, +1,  0); }\n"
+    "    else              { n = vec3(-1,  0,  0); t = vec3( 0,  0, +1); }\n"
+    "}\n"
+    "#endif\n"
+    "\n"
     "void main()\n"
     "{\n"
-    "    vec4 pos = u_model * vec4(a_pos * u_pos_scale, 1.0);\n"
+    "#ifndef PACKED_VERTICES\n"
+    "    highp   vec3 a_pos3 = a_pos;\n"
+    "    mediump vec3 a_normal3 = a_normal;\n"
+    "    mediump vec3 a_tangent3 = a_tangent;\n"
+    "    mediump vec3 a_gradient3 = a_gradient;\n"
+    "    mediump vec2 a_occlusion_uv2 = a_occlusion_uv;\n"
+    "    mediump vec2 a_bump_uv2 = a_bump_uv;\n"
+    "    mediump vec2 a_uv2 = a_uv;\n"
+    "#else\n"
+    "    // Reconstruct the full vertex attributes (see mesh_to_vertices.c).\n"
+    "    highp   vec3 a_pos3 = a_pos.xyz;\n"
+    "    highp   float face = floor(a_pos.w / 4.0);\n"
+    "    highp   float corner = a_pos.w - face * 4.0;\n"
+    "    mediump vec3 a_normal3, a_tangent3;\n"
+    "    face_vectors(face, a_normal3, a_tangent3);\n"
+    "    mediump vec2 a_uv2 = vec2(step(0.5, corner) - step(2.5, corner),\n"
+    "                              step(1.5, corner));\n"
+    "    highp   vec2 masks = a_packed.xy;\n"
+    "    mediump vec2 a_occlusion_uv2 =\n"
+    "        vec2(mod(masks.x, 16.0), floor(masks.x / 16.0)) * VOXEL_TEXTURE_SIZE +\n"
+    "        a_uv2 * (VOXEL_TEXTURE_SIZE - 1.0);\n"
+    "    mediump vec2 a_bump_uv2 =\n"
+    "        vec2(mod(masks.y, 16.0), floor(masks.y / 16.0)) * 16.0;\n"
+    "    highp   float g = a_packed.z + a_packed.w * 256.0;\n"
+    "    mediump vec3 a_gradient3 = mod(floor(g / vec3(1.0, 32.0, 1024.0)), 32.0)\n"
+    "                               - 16.0;\n"
+    "#endif\n"
+    "\n"
+    "    vec4 pos = u_model * vec4(a_pos3 * u_pos_scale, 1.0);\n"
     "    v_Position = vec3(pos.xyz) / pos.w;\n"
     "\n"
     "    v_color = a_color.rgba * a_color.rgba; // srgb to linear (fast).\n"
-    "    v_occlusion_uv = (a_occlusion_uv + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);\n"
+    "    v_occlusion_uv = (a_occlusion_uv2 + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);\n"
     "    gl_Position = u_proj * u_view * vec4(v_Position, 1.0);\n"
     "    gl_Position.z += u_z_ofs;\n"
     "\n"
@@ -240,17 +290,17 @@
     "#endif\n"
     "\n"
     "#ifdef HAS_TANGENTS\n"
-    "    mediump vec4 tangent = vec4(normalize(a_tangent), 1.0);\n"
-    "    mediump vec3 normalW = normalize(a_normal);\n"
+    "    mediump vec4 tangent = vec4(normalize(a_tangent3), 1.0);\n"
+    "    mediump vec3 normalW = normalize(vec3(u_model * vec4(a_normal3, 0.0)));\n"
     "    mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent.xyz, 0.0)));\n"
     "    mediump vec3 bitangentW = cross(normalW, tangentW) * tangent.w;\n"
     "    v_TBN = mat3(tangentW, bitangentW, normalW);\n"
     "#else\n"
-    "    v_Normal = normalize(a_normal);\n"
+    "    v_Normal = normalize(vec3(u_model * vec4(a_normal3, 0.0)));\n"
     "#endif\n"
     "\n"
-    "    v_gradient = a_gradient;\n"
-    "    v_UVCoord1 = (a_bump_uv + 0.5 + a_uv * 15.0) / 256.0;\n"
+    "    v_gradient = vec3(u_model * vec4(a_gradient3, 0.0));\n"
+    "    v_UVCoord1 = (a_bump_uv2 + 0.5 + a_uv2 * 15.0) / 256.0;\n"
     "\n"
     "#ifdef VERTEX_LIGHTNING\n"
     "    mediump vec3 N = getNormal();\n"
@@ -468,6 +518,151 @@
     "#endif\n"
     ""
 },
+{.path = "data/shaders/raymarch.glsl", .size = 4564, .data =
+    "/*\n"
+    " * Ray marching of a mesh voxels.\n"
+    " *\n"
+    " * We render the back faces of the mesh box, and for each fragment walk the\n"
+    " * voxels along the view ray until we hit a visible one.  The voxels are\n"
+    " * stored in slots of a 3D texture atlas, and u_table gives for each block\n"
+    " * of the box the position of its slot in the atlas (alpha is zero for\n"
+    " * empty blocks).\n"
+    " *\n"
+    " * All the computations are done in the box space, where each voxel has a\n"
+    " * size of one and the box origin is at zero.\n"
+    " */\n"
+    "\n"
+    "// Maximum number of voxels we walk for a single ray.\n"
+    "#define MAX_STEPS 2048\n"
+    "#define BLOCK_SIZE 16.0\n"
+    "#define M_PI 3.14159265\n"
+    "\n"
+    "uniform highp mat4  u_model;\n"
+    "uniform highp mat4  u_view;\n"
+    "uniform highp mat4  u_proj;\n"
+    "uniform highp vec3  u_size;         // Size of the box in voxels.\n"
+    "uniform highp vec3  u_camera;       // Camera position in the box space.\n"
+    "uniform highp vec3  u_dir;          // View direction for ortho projection.\n"
+    "uniform lowp  float u_ortho;\n"
+    "\n"
+    "uniform highp sampler3D u_atlas;\n"
+    "uniform highp sampler3D u_table;\n"
+    "uniform highp vec3  u_atlas_size;   // Size of the atlas in slots.\n"
+    "\n"
+    "uniform lowp    vec3  u_l_dir;\n"
+    "uniform lowp    float u_l_int;\n"
+    "uniform lowp    float u_l_amb;\n"
+    "uniform lowp    vec4  u_m_base_color;\n"
+    "uniform lowp    float u_m_metallic;\n"
+    "\n"
+    "varying highp vec3 v_pos;\n"
+    "\n"
+    "#ifdef VERTEX_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "attribute highp vec3 a_pos;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    v_pos = a_pos * u_size;\n"
+    "    gl_Position = u_proj * u_view * u_model * vec4(v_pos, 1.0);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FRAGMENT_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "\n"
+    "// Return the value of the voxel at a given integer position of the box.\n"
+    "vec4 get_voxel(highp vec3 p)\n"
+    "{\n"
+    "    highp vec3 b = floor(p / BLOCK_SIZE);\n"
+    "    highp vec4 slot = texture3D(u_table, (b + 0.5) / ceil(u_size / BLOCK_SIZE));\n"
+    "    if (slot.a < 0.5) return vec4(0.0);\n"
+    "    slot.xyz = floor(slot.xyz * 255.0 + 0.5);\n"
+    "    return texture3D(u_atlas, (slot.xyz * BLOCK_SIZE + p - b * BLOCK_SIZE +\n"
+    "                               0.5) / (u_atlas_size * BLOCK_SIZE));\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    highp vec3 ro, rd, inv, t0, t1, tmin, tmax, cell, stp, tnext, tdelta, n;\n"
+    "    highp float t, tfar;\n"
+    "    highp vec4 v, clip;\n"
+    "    int i;\n"
+    "\n"
+    "    if (u_ortho > 0.5) {\n"
+    "        rd = normalize(u_dir);\n"
+    "        ro = v_pos - rd * length(u_size) * 2.0;\n"
+    "    } else {\n"
+    "        ro = u_camera;\n"
+    "        rd = normalize(v_pos - u_camera);\n"
+    "    }\n"
+    "    // Avoid divisions by zero.\n"
+    "    rd = mix(rd, vec3(1e-6), vec3(lessThan(abs(rd), vec3(1e-6))));\n"
+    "    inv = 1.0 / rd;\n"
+    "\n"
+    "    // Intersection of the ray with the box.\n"
+    "    t0 = -ro * inv;\n"
+    "    t1 = (u_size - ro) * inv;\n"
+    "    tmin = min(t0, t1);\n"
+    "    tmax = max(t0, t1);\n"
+    "    t = max(max(max(tmin.x, tmin.y), tmin.z), 0.0);\n"
+    "    tfar = min(min(tmax.x, tmax.y), tmax.z);\n"
+    "    if (t >= tfar) discard;\n"
+    "\n"
+    "    // Normal of the face we enter the box from.\n"
+    "    stp = sign(rd);\n"
+    "    n = -stp * vec3(greaterThanEqual(tmin, vec3(max(tmin.y, tmin.z),\n"
+    "                                                max(tmin.x, tmin.z),\n"
+    "                                                max(tmin.x, tmin.y))));\n"
+    "\n"
+    "    cell = clamp(floor(ro + rd * (t + 1e-4)), vec3(0.0), u_size - 1.0);\n"
+    "    tdelta = abs(inv);\n"
+    "    tnext = (cell + max(stp, 0.0) - ro) * inv;\n"
+    "\n"
+    "    for (i = 0; i < MAX_STEPS; i++) {\n"
+    "        v = get_voxel(cell);\n"
+    "        if (v.a > 0.5) break;\n"
+    "        if (tnext.x < tnext.y && tnext.x < tnext.z) {\n"
+    "            t = tnext.x;\n"
+    "            cell.x += stp.x;\n"
+    "            tnext.x += tdelta.x;\n"
+    "            n = vec3(-stp.x, 0.0, 0.0);\n"
+    "        } else if (tnext.y < tnext.z) {\n"
+    "            t = tnext.y;\n"
+    "            cell.y += stp.y;\n"
+    "            tnext.y += tdelta.y;\n"
+    "            n = vec3(0.0, -stp.y, 0.0);\n"
+    "        } else {\n"
+    "            t = tnext.z;\n"
+    "            cell.z += stp.z;\n"
+    "            tnext.z += tdelta.z;\n"
+    "            n = vec3(0.0, 0.0, -stp.z);\n"
+    "        }\n"
+    "        if (t >= tfar) discard;\n"
+    "    }\n"
+    "    if (v.a <= 0.5) discard;\n"
+    "\n"
+    "    // Same diffuse and ambient light as the mesh shader.\n"
+    "    n = normalize(vec3(u_model * vec4(n, 0.0)));\n"
+    "    vec3 base_color = (u_m_base_color * v * v).rgb;\n"
+    "    float NdotL = clamp(dot(n, normalize(u_l_dir)), 0.0, 1.0);\n"
+    "    vec3 color = u_l_int * NdotL * base_color * 0.96 *\n"
+    "                 (1.0 - u_m_metallic) / M_PI + u_l_amb * base_color;\n"
+    "    gl_FragColor = vec4(sqrt(color), u_m_base_color.a);\n"
+    "\n"
+    "    clip = u_proj * u_view * u_model * vec4(ro + rd * t, 1.0);\n"
+    "    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;\n"
+    "}\n"
+    "\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    ""
+},
 {.path = "data/shaders/shadow_map.glsl", .size = 639, .data =
     "#ifdef VERTEX_SHADER\n"
     "\n"
@@ -0,0 +1,386 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Batch mode: run a script of commands on a list of files, without any
+ * GUI.  Run it with the --batch option.
+ *
+ * The script has one command per line, with the arguments separated by
+ * spaces (use double quotes for arguments containing spaces).  Empty lines
+ * and lines starting with '#' are ignored.  The commands are:
+ *
+ *   open PATH              - Replace the image with a file.
+ *   import PATH [FORMAT]   - Import a file into the image.
+ *   export PATH [FORMAT]   - Export the image.
+ *   color R G B [A]        - Set the paint color.
+ *   mode MODE              - Set the paint mode (over, sub, paint, max,
+ *                            intersect).
+ *   select X Y Z W H D     - Set the selection box.
+ *   crop                   - Crop all the layers to the selection, or to
+ *                            the image box if there is no selection.
+ *   ACTION                 - Execute any registered action by name, for
+ *                            example img_merge_visible_layers.
+ *
+ * The arguments can use the following variables, replaced with the value
+ * of the current input file:
+ *
+ *   {input} - The input file path.
+ *   {dir}   - The directory of the input file.
+ *   {name}  - The input file name without directory and extension.
+ *
+ * The script is run once for each input file, after the file has been
+ * opened.  If there is no input file, the script is run once on an empty
+ * image.
+ */
+
+#include "goxel.h"
+#include "file_format.h"
+
+#include <ctype.h>
+#include <errno.h>
+
+#ifndef WIN32
+#   include <sys/wait.h>
+#   include <unistd.h>
+#endif
+
+#define BATCH_MAX_ARGS 8
+
+typedef struct {
+    const char *input;  // Current input file, can be NULL.
+    const char *script; // Script path, for the errors.
+    int line;
+} batch_ctx_t;
+
+// Replace the {input}, {dir} and {name} variables in an argument.
+static char *expand_arg(const batch_ctx_t *ctx, const char *arg)
+{
+    char *ret = NULL, *tmp;
+    const char *input = ctx->input ?: "";
+    const char *base, *ext, *dir = input;
+    int dir_len, name_len;
+
+    base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    dir_len = base - input;
+    if (dir_len > 1) dir_len--; // Remove the trailing '/'.
+    if (dir_len == 0) {
+        dir = ".";
+        dir_len = 1;
+    }
+    ext = strrchr(base, '.');
+    name_len = ext ? ext - base : strlen(base);
+
+    ret = strdup("");
+    while (*arg) {
+        tmp = ret;
+        if (str_startswith(arg, "{input}")) {
+            asprintf(&ret, "%s%s", tmp, input);
+            arg += strlen("{input}");
+        } else if (str_startswith(arg, "{dir}")) {
+            asprintf(&ret, "%s%.*s", tmp, dir_len, dir);
+            arg += strlen("{dir}");
+        } else if (str_startswith(arg, "{name}")) {
+            asprintf(&ret, "%s%.*s", tmp, name_len, base);
+            arg += strlen("{name}");
+        } else {
+            asprintf(&ret, "%s%c", tmp, *arg);
+            arg++;
+        }
+        free(tmp);
+    }
+    return ret;
+}
+
+// Split a line into arguments.  Modify the line in place.
+static int split_line(char *line, char *argv[BATCH_MAX_ARGS])
+{
+    int argc = 0;
+    char *p = line;
+
+    while (true) {
+        while (*p && isspace(*p)) p++;
+        if (!*p || *p == '#') break;
+        if (argc >= BATCH_MAX_ARGS) return -1;
+        if (*p == '"') {
+            argv[argc++] = ++p;
+            p = strchr(p, '"');
+            if (!p) return -1;
+        } else {
+            argv[argc++] = p;
+            while (*p && !isspace(*p)) p++;
+        }
+        if (!*p) break;
+        *p++ = '\0';
+    }
+    return argc;
+}
+
+static void new_image(void)
+{
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    mat4_copy(mat4_zero, goxel.selection);
+}
+
+static int cmd_export(const char *path, const char *format)
+{
+    const file_format_t *f;
+    f = file_format_for_path(path, format, "w");
+    if (!f) {
+        LOG_E("Cannot export to %s: unknown format", path);
+        return -1;
+    }
+    if (    f->export_need_graphics && !goxel.graphics_initialized &&
+            !sys_create_gl_context()) {
+        LOG_E("Cannot create an OpenGL context for %s export", f->name);
+        return -1;
+    }
+    return goxel_export_to_file(path, format);
+}
+
+static int cmd_mode(const char *name)
+{
+    const struct {
+        const char *name;
+        int mode;
+    } MODES[] = {
+        {"over", MODE_OVER},
+        {"sub", MODE_SUB},
+        {"paint", MODE_PAINT},
+        {"max", MODE_MAX},
+        {"intersect", MODE_INTERSECT},
+    };
+    int i;
+    for (i = 0; i < ARRAY_SIZE(MODES); i++) {
+        if (strcmp(MODES[i].name, name) == 0) {
+            goxel.painter.mode = MODES[i].mode;
+            return 0;
+        }
+    }
+    LOG_E("Unknown mode: %s", name);
+    return -1;
+}
+
+static void cmd_crop(void)
+{
+    layer_t *layer;
+    const float (*box)[4][4] = &goxel.selection;
+
+    if (box_is_null(*box)) box = &goxel.image->box;
+    if (box_is_null(*box)) return;
+    image_update(goxel.image, true);
+    DL_FOREACH(goxel.image->layers, layer) {
+        if (layer->base_id || layer->shape) continue;
+        mesh_crop(layer->mesh, *box);
+    }
+    image_history_push(goxel.image);
+}
+
+static int run_command(const batch_ctx_t *ctx, int argc, char **argv)
+{
+    const char *cmd = argv[0];
+    const action_t *action;
+    int i, aabb[2][3];
+
+    #define CHECK_ARGS(min, max) do { \
+        if (argc - 1 < (min) || argc - 1 > (max)) { \
+            LOG_E("%s:%d: wrong number of arguments for %s", \
+                  ctx->script, ctx->line, cmd); \
+            return -1; \
+        } \
+    } while (0)
+
+    if (strcmp(cmd, "open") == 0) {
+        CHECK_ARGS(1, 1);
+        new_image();
+        return goxel_import_file(argv[1], NULL);
+    }
+    if (strcmp(cmd, "import") == 0) {
+        CHECK_ARGS(1, 2);
+        return goxel_import_file(argv[1], argc > 2 ? argv[2] : NULL);
+    }
+    if (strcmp(cmd, "export") == 0) {
+        CHECK_ARGS(1, 2);
+        return cmd_export(argv[1], argc > 2 ? argv[2] : NULL);
+    }
+    if (strcmp(cmd, "color") == 0) {
+        CHECK_ARGS(3, 4);
+        goxel.painter.color[3] = 255;
+        for (i = 0; i < argc - 1; i++)
+            goxel.painter.color[i] = clamp(atoi(argv[i + 1]), 0, 255);
+        return 0;
+    }
+    if (strcmp(cmd, "mode") == 0) {
+        CHECK_ARGS(1, 1);
+        return cmd_mode(argv[1]);
+    }
+    if (strcmp(cmd, "select") == 0) {
+        CHECK_ARGS(6, 6);
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = atoi(argv[i + 1]);
+            aabb[1][i] = aabb[0][i] + atoi(argv[i + 4]);
+        }
+        bbox_from_aabb(goxel.selection, aabb);
+        return 0;
+    }
+    if (strcmp(cmd, "crop") == 0) {
+        CHECK_ARGS(0, 0);
+        cmd_crop();
+        return 0;
+    }
+
+    #undef CHECK_ARGS
+
+    action = action_get_by_name(cmd);
+    if (!action) {
+        LOG_E("%s:%d: unknown command %s", ctx->script, ctx->line, cmd);
+        return -1;
+    }
+    return action_exec(action);
+}
+
+// Run the script on a single input file.
+static int run_script(const char *script, char *data, const char *input)
+{
+    batch_ctx_t ctx = {.input = input, .script = script};
+    char *line, *next, *argv[BATCH_MAX_ARGS];
+    int i, argc, ret = 0;
+
+    new_image();
+    if (input && goxel_import_file(input, NULL) != 0) {
+        LOG_E("Cannot open %s", input);
+        return -1;
+    }
+
+    for (line = data; line && ret == 0; line = next) {
+        ctx.line++;
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        argc = split_line(line, argv);
+        if (argc < 0) {
+            LOG_E("%s:%d: syntax error", script, ctx.line);
+            ret = -1;
+            break;
+        }
+        if (argc == 0) continue;
+        for (i = 0; i < argc; i++)
+            argv[i] = expand_arg(&ctx, argv[i]);
+        ret = run_command(&ctx, argc, argv);
+        if (ret) LOG_E("%s:%d: %s failed", script, ctx.line, argv[0]);
+        for (i = 0; i < argc; i++) free(argv[i]);
+    }
+    return ret ? -1 : 0;
+}
+
+// Run the script on all the inputs with index equal to job modulo nb_jobs.
+static int run_job(const char *script, const char *data,
+                   const char **inputs, int nb_inputs, int job, int nb_jobs)
+{
+    char *buf;
+    int i, ret = 0;
+
+    for (i = job; i < max(nb_inputs, 1); i += nb_jobs) {
+        // The commands parsing modifies the script data.
+        buf = strdup(data);
+        if (run_script(script, buf, nb_inputs ? inputs[i] : NULL) != 0)
+            ret = -1;
+        free(buf);
+    }
+    return ret;
+}
+
+static char *read_script(const char *path)
+{
+    char *data;
+    size_t size = 0, len = 0;
+    int n;
+
+    if (strcmp(path, "-") != 0)
+        return read_file(path, NULL);
+    data = malloc(1024);
+    size = 1024;
+    while ((n = fread(data + len, 1, size - len - 1, stdin)) > 0) {
+        len += n;
+        if (len + 1 >= size) {
+            size *= 2;
+            data = realloc(data, size);
+        }
+    }
+    data[len] = '\0';
+    return data;
+}
+
+/*
+ * Function: batch_run
+ * Run a batch script on a list of files.
+ *
+ * With several jobs, we fork a worker process per job, since goxel global
+ * state doesn't allow to process several images at the same time in a
+ * single process.  The inputs are spread over the workers.
+ */
+int batch_run(const char *script, const char **inputs, int nb_inputs,
+              int nb_jobs)
+{
+    char *data;
+    int ret = 0;
+#ifndef WIN32
+    pid_t pid;
+    int i, status;
+#endif
+
+    data = read_script(script);
+    if (!data) {
+        LOG_E("Cannot read script %s", script);
+        return -1;
+    }
+    nb_jobs = clamp(nb_jobs, 1, max(nb_inputs, 1));
+
+#ifdef WIN32
+    if (nb_jobs > 1) LOG_W("Multiple jobs not supported on Windows");
+    nb_jobs = 1;
+#endif
+
+    if (nb_jobs == 1) {
+        ret = run_job(script, data, inputs, nb_inputs, 0, 1);
+        free(data);
+        return ret;
+    }
+
+#ifndef WIN32
+    fflush(stdout);
+    for (i = 0; i < nb_jobs; i++) {
+        pid = fork();
+        if (pid < 0) {
+            LOG_E("Cannot fork: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (pid == 0) {
+            ret = run_job(script, data, inputs, nb_inputs, i, nb_jobs);
+            fflush(stdout);
+            _exit(ret ? 1 : 0);
+        }
+    }
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ret = -1;
+    }
+#endif
+    free(data);
+    return ret;
+}
@@ -0,0 +1,259 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Some simple benchmarks of the slow parts of goxel.  Run them with
+ * the --bench option.
+ */
+
+#include "goxel.h"
+
+// Fill a block with a pattern function.
+static void fill_block(mesh_t *mesh, bool (*pattern)(int x, int y, int z))
+{
+    int x, y, z;
+    uint8_t v[4] = {255, 0, 0, 0};
+    mesh_iterator_t iter = mesh_get_accessor(mesh);
+
+    for (z = 0; z < BLOCK_SIZE; z++)
+    for (y = 0; y < BLOCK_SIZE; y++)
+    for (x = 0; x < BLOCK_SIZE; x++) {
+        v[1] = x * 16;
+        v[2] = y * 16;
+        v[3] = pattern(x, y, z) ? 255 : 0;
+        mesh_set_at(mesh, &iter, (int[]){x, y, z}, v);
+    }
+}
+
+static bool pattern_full(int x, int y, int z)
+{
+    return true;
+}
+
+static bool pattern_checkerboard(int x, int y, int z)
+{
+    return (x + y + z) % 2;
+}
+
+static bool pattern_noise(int x, int y, int z)
+{
+    return rand() % 2;
+}
+
+/*
+ * Generate the vertices of a single block with all the render modes, and
+ * check that we never output more than MESH_BLOCK_MAX_VERTICES.  Also
+ * log the size of the vertex buffer we would upload to the GPU.
+ */
+static void bench_block_vertices(const char *name,
+                                 bool (*pattern)(int x, int y, int z))
+{
+    const int effects[] = {0, EFFECT_MARCHING_CUBES};
+    const char *effects_names[] = {"cubes", "mc flat"};
+    const int indexed_effects[] = {EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH,
+                                   EFFECT_SURFACE_NETS};
+    const char *indexed_effects_names[] = {"mc smooth", "sn"};
+    const int nb_iter = 16;
+    mesh_t *mesh;
+    voxel_vertex_t *verts;
+    voxel_vertex_packed_t *packed;
+    uint16_t *indices;
+    int i, e, nb = 0, size, subdivide, nb_indices = 0;
+    double t;
+
+    mesh = mesh_new();
+    fill_block(mesh, pattern);
+    verts = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*verts));
+    packed = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*packed));
+    indices = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*indices));
+    for (e = 0; e < ARRAY_SIZE(effects); e++) {
+        t = sys_get_time();
+        for (i = 0; i < nb_iter; i++) {
+            nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0}, effects[e],
+                                        verts, &size, &subdivide);
+        }
+        t = (sys_get_time() - t) / nb_iter;
+        CHECK(nb * size <= MESH_BLOCK_MAX_VERTICES);
+        LOG_I("%-12s %-10s %6d faces %8.2f ms %6d KB", name, effects_names[e],
+              nb, t * 1000, (int)(nb * size * sizeof(*verts) / 1024));
+    }
+
+    t = sys_get_time();
+    for (i = 0; i < nb_iter; i++)
+        nb = mesh_generate_vertices_packed(mesh, (int[]){0, 0, 0}, packed);
+    t = (sys_get_time() - t) / nb_iter;
+    LOG_I("%-12s %-10s %6d faces %8.2f ms %6d KB", name, "packed",
+          nb, t * 1000, (int)(nb * 4 * sizeof(*packed) / 1024));
+
+    for (e = 0; e < ARRAY_SIZE(indexed_effects); e++) {
+        t = sys_get_time();
+        for (i = 0; i < nb_iter; i++) {
+            nb = mesh_generate_indexed_vertices(
+                    mesh, (int[]){0, 0, 0}, indexed_effects[e],
+                    verts, indices, &nb_indices, &subdivide);
+        }
+        t = (sys_get_time() - t) / nb_iter;
+        CHECK(nb_indices <= MESH_BLOCK_MAX_VERTICES);
+        LOG_I("%-12s %-10s %6d faces %8.2f ms %6d KB", name,
+              indexed_effects_names[e], nb_indices / 3, t * 1000,
+              (int)((nb * sizeof(*verts) +
+                     nb_indices * sizeof(*indices)) / 1024));
+    }
+    free(indices);
+    free(packed);
+    free(verts);
+    mesh_delete(mesh);
+}
+
+// Fill a mesh with a size x size random terrain.
+static void fill_terrain(mesh_t *mesh, int size)
+{
+    int x, y, z, h;
+    uint8_t v[4] = {128, 128, 128, 255};
+    mesh_iterator_t iter;
+
+    mesh_clear(mesh);
+    iter = mesh_get_accessor(mesh);
+    for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++) {
+        h = 16 + 12 * sin(x / 9.0) * cos(y / 13.0) + rand() % 3;
+        for (z = 0; z < h; z++) {
+            v[0] = x;
+            v[1] = y;
+            mesh_set_at(mesh, &iter, (int[]){x, y, z}, v);
+        }
+    }
+}
+
+/*
+ * Compare the GPU memory used by the cubes vertices of a large terrain, and
+ * the time to upload them, with the full and the packed vertex formats.
+ */
+static void bench_scene_vertices(void)
+{
+    const int size = 512;
+    mesh_t *mesh = mesh_new();
+    mesh_iterator_t iter;
+    voxel_vertex_t *verts;
+    voxel_vertex_packed_t *packed;
+    int p[3], i, nb, n = 0, nb_blocks = 0, vsize, subdivide, fmt;
+    size_t bytes;
+    void **datas;
+    int *sizes;
+    GLuint *buffers;
+    double t;
+
+    fill_terrain(mesh, size);
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, p)) nb_blocks++;
+    verts = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*verts));
+    packed = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*packed));
+    datas = calloc(nb_blocks, sizeof(*datas));
+    sizes = calloc(nb_blocks, sizeof(*sizes));
+    buffers = calloc(nb_blocks, sizeof(*buffers));
+
+    for (fmt = 0; fmt < 2; fmt++) {
+        // First generate all the vertices, so that we only time the upload.
+        n = 0;
+        bytes = 0;
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, p)) {
+            if (fmt == 0) {
+                nb = mesh_generate_vertices(mesh, p, 0, verts, &vsize,
+                                            &subdivide);
+                sizes[n] = nb * vsize * sizeof(*verts);
+                datas[n] = malloc(sizes[n]);
+                memcpy(datas[n], verts, sizes[n]);
+            } else {
+                nb = mesh_generate_vertices_packed(mesh, p, packed);
+                sizes[n] = nb * 4 * sizeof(*packed);
+                datas[n] = malloc(sizes[n]);
+                memcpy(datas[n], packed, sizes[n]);
+            }
+            bytes += sizes[n];
+            n++;
+        }
+        GL(glGenBuffers(n, buffers));
+        GL(glFinish());
+        t = sys_get_time();
+        for (i = 0; i < n; i++) {
+            GL(glBindBuffer(GL_ARRAY_BUFFER, buffers[i]));
+            GL(glBufferData(GL_ARRAY_BUFFER, sizes[i], datas[i],
+                            GL_STATIC_DRAW));
+        }
+        GL(glFinish());
+        t = sys_get_time() - t;
+        GL(glDeleteBuffers(n, buffers));
+        for (i = 0; i < n; i++) free(datas[i]);
+        LOG_I("terrain %dx%d %-10s %5d blocks %8.1f MB %8.2f ms upload",
+              size, size, fmt ? "packed" : "cubes", n,
+              bytes / (1024.0 * 1024.0), t * 1000);
+    }
+    free(buffers);
+    free(sizes);
+    free(datas);
+    free(packed);
+    free(verts);
+    mesh_delete(mesh);
+}
+
+/*
+ * Measure the path tracer rays intersection speed on a large terrain, with
+ * the voxel grids and with the triangles bvh.
+ */
+static void bench_pathtracer_rays(void)
+{
+    const int size = 256, nb_rays = 1 << 20;
+    int nb_hits, aabb[2][3];
+    float box[4][4];
+    camera_t *camera;
+    pathtracer_t pt = goxel.pathtracer;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+    double speed;
+
+    fill_terrain(mesh, size);
+    mesh_get_bbox(mesh, aabb, true);
+    bbox_from_aabb(box, aabb);
+    if (!goxel.image->active_camera)
+        goxel.image->active_camera = image_add_camera(goxel.image, NULL);
+    camera = goxel.image->active_camera;
+    camera->aspect = 1;
+    camera_fit_box(camera, box);
+    camera_turntable(camera, 0, -0.6);
+    camera_update(camera);
+
+    pt.w = pt.h = 512;
+    pt.p = NULL;
+    speed = pathtracer_bench_rays(&pt, nb_rays, true, &nb_hits);
+    LOG_I("pathtracer %-10s %8.2f Mrays/s (%d%% hits)", "voxels",
+          speed / 1e6, nb_hits * 100 / nb_rays);
+    speed = pathtracer_bench_rays(&pt, nb_rays, false, &nb_hits);
+    LOG_I("pathtracer %-10s %8.2f Mrays/s (%d%% hits)", "bvh",
+          speed / 1e6, nb_hits * 100 / nb_rays);
+    mesh_clear(mesh);
+}
+
+void bench_run(void)
+{
+    srand(0);
+    bench_block_vertices("full", pattern_full);
+    bench_block_vertices("checkerboard", pattern_checkerboard);
+    bench_block_vertices("noise", pattern_noise);
+    bench_scene_vertices();
+    bench_pathtracer_rays();
+}
@@ -142,6 +142,7 @@ int box_edit(int snap, int mode, float transf[4][4], bool *first)
 
     if (snap == SNAP_LAYER_OUT) {
         curs->snap_mask = SNAP_LAYER_OUT;
+        image_update(goxel.image, true);
         mesh_get_box(goxel.image->active_layer->mesh, true, box);
         // Fix problem with shape layer box.
         if (goxel.image->active_layer->shape)
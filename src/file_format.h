@@ -30,6 +30,7 @@ struct file_format
     void            (*export_gui)(void);
     int             (*export_func)(const image_t *img, const char *path);
     int             (*import_func)(image_t *img, const char *path);
+    bool            export_need_graphics; // Export uses the OpenGL renderer.
 };
 
 void file_format_register(file_format_t *format);
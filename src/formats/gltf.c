@@ -126,34 +126,41 @@ static void make_attribute(gltf_t *g, json_t *buffer_view, json_t *attributes,
     json_object_push_int(attributes, name, json_index(accessor));
 }
 
-static void make_quad_indices(gltf_t *g, json_t *primitive, int nb, int size)
+static void make_indices(gltf_t *g, json_t *primitive,
+                         const uint16_t *data, int nb)
 {
     json_t *buffer, *buffer_view, *accessor;
-    uint16_t *data;
-    int i;
 
-    data = calloc(nb * 6, sizeof(*data));
-    for (i = 0; i < nb * 6; i++)
-        data[i] = (i / 6) * 4 + ((int[]){0, 1, 2, 2, 3, 0})[i % 6];
     buffer = json_array_push(g->buffers, json_object_new(0));
-    json_object_push_int(buffer, "byteLength", nb * 6 * sizeof(*data));
+    json_object_push_int(buffer, "byteLength", nb * sizeof(*data));
     json_object_push(buffer, "uri",
-            json_data_new(data, nb * 6 * sizeof(*data), NULL));
-    free(data);
+            json_data_new(data, nb * sizeof(*data), NULL));
     buffer_view = json_array_push(g->buffer_views, json_object_new(0));
     json_object_push_int(buffer_view, "buffer", json_index(buffer));
-    json_object_push_int(buffer_view, "byteLength", nb * 6 * sizeof(*data));
+    json_object_push_int(buffer_view, "byteLength", nb * sizeof(*data));
     json_object_push_int(buffer_view, "target", 34963);
 
     accessor = json_array_push(g->accessors, json_object_new(0));
     json_object_push_int(accessor, "bufferView", json_index(buffer_view));
     json_object_push_int(accessor, "componentType", GLTF_UNSIGNED_SHORT);
-    json_object_push_int(accessor, "count", nb * 6);
+    json_object_push_int(accessor, "count", nb);
     json_object_push_string(accessor, "type", "SCALAR");
 
     json_object_push_int(primitive, "indices", json_index(accessor));
 }
 
+static void make_quad_indices(gltf_t *g, json_t *primitive, int nb, int size)
+{
+    uint16_t *data;
+    int i;
+
+    data = calloc(nb * 6, sizeof(*data));
+    for (i = 0; i < nb * 6; i++)
+        data[i] = (i / 6) * 4 + ((int[]){0, 1, 2, 2, 3, 0})[i % 6];
+    make_indices(g, primitive, data, nb * 6);
+    free(data);
+}
+
 static void fill_buffer(const gltf_t *g, gltf_vertex_t *bverts,
                         const voxel_vertex_t *verts, int nb, int subdivide,
                         bool vertex_color)
@@ -227,28 +234,38 @@ static void save_layer(gltf_t *g, json_t *root_node_children,
     json_t *gmesh, *buffer, *primitives, *primitive, *attributes, *node,
            *buffer_view;
     mesh_iterator_t iter;
-    int nb_elems, bpos[3], size = 0, subdivide;
+    int nb_elems, nb_verts, nb_indices = 0, bpos[3], size = 0, subdivide;
     voxel_vertex_t *verts;
-    const int N = BLOCK_SIZE;
     gltf_vertex_t *gverts;
+    uint16_t *indices = NULL;
     int buf_size;
     float pos_min[3], pos_max[3];
     mesh_t *mesh = layer->mesh;
+    const int effects = goxel.rend.settings.effects;
+    const bool indexed = mesh_use_indexed_vertices(effects);
 
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    gverts = calloc(N * N * N * 6 * 4, sizeof(*gverts));
+    verts = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*verts));
+    gverts = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*gverts));
+    if (indexed)
+        indices = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*indices));
 
     iter = mesh_get_iterator(mesh,
             MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
     while (mesh_iter(&iter, bpos)) {
-        nb_elems = mesh_generate_vertices(mesh, bpos,
-                                    goxel.rend.settings.effects, verts,
-                                    &size, &subdivide);
+        if (indexed) {
+            nb_verts = mesh_generate_indexed_vertices(mesh, bpos, effects,
+                                    verts, indices, &nb_indices, &subdivide);
+            nb_elems = nb_indices / 3;
+        } else {
+            nb_elems = mesh_generate_vertices(mesh, bpos, effects, verts,
+                                              &size, &subdivide);
+            nb_verts = nb_elems * size;
+        }
         if (!nb_elems) continue;
-        fill_buffer(g, gverts, verts, nb_elems * size, subdivide,
+        fill_buffer(g, gverts, verts, nb_verts, subdivide,
                     options->vertex_color);
-        get_pos_min_max(gverts, nb_elems * size, pos_min, pos_max);
-        buf_size = nb_elems * size * sizeof(*gverts);
+        get_pos_min_max(gverts, nb_verts, pos_min, pos_max);
+        buf_size = nb_verts * sizeof(*gverts);
 
         buffer = json_array_push(g->buffers, json_object_new(0));
         json_object_push_int(buffer, "byteLength", buf_size);
@@ -261,7 +278,9 @@ static void save_layer(gltf_t *g, json_t *root_node_children,
         json_object_push_int(primitive, "material",
                              get_material_idx(img, layer->material));
 
-        if (size == 4)
+        if (indexed)
+            make_indices(g, primitive, indices, nb_indices);
+        else if (size == 4)
             make_quad_indices(g, primitive, nb_elems, size);
 
         buffer_view = json_array_push(g->buffer_views, json_object_new(0));
@@ -272,22 +291,22 @@ static void save_layer(gltf_t *g, json_t *root_node_children,
 
         make_attribute(g, buffer_view, attributes,
                        "POSITION", GLTF_FLOAT, "VEC3", false,
-                       nb_elems * size, offsetof(gltf_vertex_t, pos),
+                       nb_verts, offsetof(gltf_vertex_t, pos),
                        pos_min, pos_max);
         make_attribute(g, buffer_view, attributes,
                        "NORMAL", GLTF_FLOAT, "VEC3", false,
-                       nb_elems * size, offsetof(gltf_vertex_t, normal),
+                       nb_verts, offsetof(gltf_vertex_t, normal),
                        NULL, NULL);
 
         if (options->vertex_color) {
             make_attribute(g, buffer_view, attributes,
                            "COLOR_0", GLTF_UNSIGNED_BYTE, "VEC4", true,
-                           nb_elems * size, offsetof(gltf_vertex_t, color),
+                           nb_verts, offsetof(gltf_vertex_t, color),
                            NULL, NULL);
         } else {
             make_attribute(g, buffer_view, attributes,
                            "TEXCOORD_0", GLTF_FLOAT, "VEC2", false,
-                           nb_elems * size, offsetof(gltf_vertex_t, texcoord),
+                           nb_verts, offsetof(gltf_vertex_t, texcoord),
                            NULL, NULL);
         }
 
@@ -298,6 +317,7 @@ static void save_layer(gltf_t *g, json_t *root_node_children,
     }
     free(verts);
     free(gverts);
+    free(indices);
 }
 
 static void create_palette_texture(gltf_t *g, const image_t *img)
@@ -19,6 +19,7 @@
 
 #include "goxel.h"
 #include <errno.h>
+#include <pthread.h>
 
 #define VERSION 2 // Current version of the file format.
 
@@ -86,6 +87,33 @@ typedef struct {
     int             index;
 } block_hash_t;
 
+#define PREVIEW_SIZE 128
+
+// Preview image rendered on the CPU.
+typedef struct {
+    mesh_t          *mesh;
+    float           inv_mat[4][4];  // Clip space to mesh space.
+    float           light_dir[3];
+    float           ambient;
+    uint8_t         *buf;           // RGBA, twice the preview size.
+} preview_t;
+
+// Save running in a background thread, see save_to_file_async.
+static struct {
+    pthread_t       thread;
+    bool            running;
+    bool            threaded;
+    bool            done;           // Set by the thread once finished.
+    bool            ok;             // Set by the thread if the write worked.
+    const image_t   *target;        // The image we save.
+    uint32_t        key;            // Key of the image when we saved it.
+    image_t         *img;           // Snapshot of the saved image.
+    char            *path;
+    FILE            *out;
+    renderer_t      rend;           // Copy of the light settings.
+    preview_t       preview;
+} g_save;
+
 #define CHUNK_BUFF_SIZE (1 << 20) // 1 MiB max buffer size!
 
 // XXX: should be something in goxel.h
@@ -252,27 +280,109 @@ static const material_t *get_material(const image_t *img, int idx)
     return NULL;
 }
 
-void save_to_file(const image_t *img, const char *path)
+// Compute the position of a pixel of the preview in mesh space.
+static void preview_unproject(const preview_t *p, float x, float y, float z,
+                              float out[3])
+{
+    const int size = PREVIEW_SIZE * 2;
+    float v[4] = {2 * x / size - 1, 1 - 2 * y / size, z, 1};
+    mat4_mul_vec4(p->inv_mat, v, v);
+    vec3_mul(v, 1.0 / v[3], out);
+}
+
+static void preview_render(preview_t *p)
+{
+    const int size = PREVIEW_SIZE * 2;
+    int x, y, i, pos[3], normal[3], bbox[2][3];
+    float o[3], d[3], light;
+    uint8_t v[4], *out;
+    mesh_accessor_t accessor = mesh_get_accessor(p->mesh);
+
+    if (!p->mesh || !mesh_get_bbox(p->mesh, bbox, false)) return;
+    for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++) {
+        preview_unproject(p, x + 0.5, y + 0.5, -1, o);
+        preview_unproject(p, x + 0.5, y + 0.5, +1, d);
+        vec3_sub(d, o, d);
+        vec3_normalize(d, d);
+        if (!mesh_raycast_in_bbox(p->mesh, bbox, o, d, pos, normal))
+            continue;
+        mesh_get_at(p->mesh, &accessor, pos, v);
+        light = p->ambient + (1 - p->ambient) *
+                max(0, normal[0] * p->light_dir[0] +
+                       normal[1] * p->light_dir[1] +
+                       normal[2] * p->light_dir[2]);
+        out = &p->buf[(y * size + x) * 4];
+        for (i = 0; i < 3; i++) out[i] = min(255, v[i] * light);
+        out[3] = 255;
+    }
+}
+
+/*
+ * Prepare the rendering of the image preview.
+ *
+ * We use a simple voxel ray cast on the CPU, so that saving doesn't need
+ * an OpenGL context and can run in a background thread.  We keep a copy
+ * of the layers mesh, so the image can change during the rendering.
+ */
+static void preview_init(preview_t *p, const image_t *img)
+{
+    camera_t *camera = img->active_camera ?: img->cameras;
+    renderer_t rend = goxel.rend;
+    float mat[4][4];
+
+    memset(p, 0, sizeof(*p));
+    p->buf = calloc(PREVIEW_SIZE * PREVIEW_SIZE * 4, 4);
+    if (!camera) return;
+    p->mesh = mesh_copy(goxel_get_layers_mesh(img));
+    camera->aspect = 1;
+    camera_update(camera);
+    mat4_mul(camera->proj_mat, camera->view_mat, mat);
+    mat4_invert(mat, p->inv_mat);
+    mat4_copy(camera->view_mat, rend.view_mat);
+    render_get_light_dir(&rend, p->light_dir);
+    p->ambient = goxel.rend.settings.ambient;
+}
+
+// Render the preview and return it as a png image.
+static uint8_t *preview_get_png(preview_t *p, int *size)
+{
+    uint8_t *img, *png;
+    preview_render(p);
+    img = calloc(PREVIEW_SIZE * PREVIEW_SIZE, 4);
+    img_downsample(p->buf, PREVIEW_SIZE * 2, PREVIEW_SIZE * 2, 4, img);
+    png = img_write_to_mem(img, PREVIEW_SIZE, PREVIEW_SIZE, 4, size);
+    free(img);
+    return png;
+}
+
+// Release the preview.  Must be called from the main thread, since the
+// mesh copy shares its blocks with the image.
+static void preview_release(preview_t *p)
+{
+    mesh_delete(p->mesh);
+    free(p->buf);
+}
+
+/*
+ * Write an image into a gox file.
+ *
+ * This only reads the image and the renderer settings passed as argument,
+ * so that it can run in a background thread on a snapshot of the image.
+ */
+static void save_write(const image_t *img, const renderer_t *rend,
+                       preview_t *preview, FILE *out)
 {
-    // XXX: remove all empty blocks before saving.
-    LOG_I("Save to %s", path);
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
     layer_t *layer;
     chunk_t c;
     int nb_blocks, index, size, bpos[3], material_idx;
     uint64_t uid;
-    FILE *out;
-    uint8_t *png, *preview;
+    uint8_t *png;
     camera_t *camera;
     material_t *material;
     mesh_iterator_t iter;
 
-    img = img ?: goxel.image;
-    out = fopen(path, "wb");
-    if (!out) {
-        LOG_E("Cannot save to %s: %s", path, strerror(errno));
-        return;
-    }
     fwrite("GOX ", 4, 1, out);
     write_int32(out, VERSION);
 
@@ -282,14 +392,13 @@ void save_to_file(const image_t *img, const char *path)
         chunk_write_dict_value(&c, out, "box", &img->box, sizeof(img->box));
     chunk_write_finish(&c, out);
 
-    preview = calloc(128 * 128, 4);
-    goxel_render_to_buf(preview, 128, 128, 4);
-    png = img_write_to_mem(preview, 128, 128, 4, &size);
+    // The preview has to come before the blocks for gox_iter_infos.
+    png = preview_get_png(preview, &size);
     chunk_write_all(out, "PREV", (char*)png, size);
-    free(preview);
     free(png);
 
-    // Add all the blocks data into the hash table.
+    // Write all the blocks chunks, in the order of their index, and add
+    // them into the hash table so that we write each block only once.
     index = 0;
     DL_FOREACH(img->layers, layer) {
         iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
@@ -303,16 +412,12 @@ void save_to_file(const image_t *img, const char *path)
             data->uid = uid;
             data->index = index++;
             HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
+            png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
+            chunk_write_all(out, "BL16", (char*)png, size);
+            free(png);
         }
     }
 
-    // Write all the blocks chunks.
-    HASH_ITER(hh, blocks_table, data, data_tmp) {
-        png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
-        chunk_write_all(out, "BL16", (char*)png, size);
-        free(png);
-    }
-
     // Write all the materials.
     DL_FOREACH(img->materials, material) {
         chunk_write_start(&c, out, "MATE");
@@ -406,28 +511,115 @@ void save_to_file(const image_t *img, const char *path)
 
     // Write the light settings.
     chunk_write_start(&c, out, "LIGH");
-    chunk_write_dict_value(&c, out, "pitch", &goxel.rend.light.pitch,
-                           sizeof(goxel.rend.light.pitch));
-    chunk_write_dict_value(&c, out, "yaw", &goxel.rend.light.yaw,
-                           sizeof(goxel.rend.light.yaw));
-    chunk_write_dict_value(&c, out, "intensity", &goxel.rend.light.intensity,
-                           sizeof(goxel.rend.light.intensity));
-    chunk_write_dict_value(&c, out, "fixed", &goxel.rend.light.fixed,
-                           sizeof(goxel.rend.light.fixed));
-    chunk_write_dict_value(&c, out, "ambient", &goxel.rend.settings.ambient,
-                           sizeof(goxel.rend.settings.ambient));
-    chunk_write_dict_value(&c, out, "shadow", &goxel.rend.settings.shadow,
-                           sizeof(goxel.rend.settings.shadow));
+    chunk_write_dict_value(&c, out, "pitch", &rend->light.pitch,
+                           sizeof(rend->light.pitch));
+    chunk_write_dict_value(&c, out, "yaw", &rend->light.yaw,
+                           sizeof(rend->light.yaw));
+    chunk_write_dict_value(&c, out, "intensity", &rend->light.intensity,
+                           sizeof(rend->light.intensity));
+    chunk_write_dict_value(&c, out, "fixed", &rend->light.fixed,
+                           sizeof(rend->light.fixed));
+    chunk_write_dict_value(&c, out, "ambient", &rend->settings.ambient,
+                           sizeof(rend->settings.ambient));
+    chunk_write_dict_value(&c, out, "shadow", &rend->settings.shadow,
+                           sizeof(rend->settings.shadow));
     chunk_write_finish(&c, out);
 
     HASH_ITER(hh, blocks_table, data, data_tmp) {
         HASH_DEL(blocks_table, data);
         free(data);
     }
+}
+
+void save_to_file(const image_t *img, const char *path)
+{
+    FILE *out;
+    preview_t preview;
 
+    // XXX: remove all empty blocks before saving.
+    LOG_I("Save to %s", path);
+    PROFILER_SCOPE("save_to_file");
+    img = img ?: goxel.image;
+    out = fopen(path, "wb");
+    if (!out) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return;
+    }
+    preview_init(&preview, img);
+    save_write(img, &goxel.rend, &preview, out);
+    preview_release(&preview);
     fclose(out);
 }
 
+static void *save_thread(void *user)
+{
+    save_write(g_save.img, &g_save.rend, &g_save.preview, g_save.out);
+    g_save.ok = !ferror(g_save.out);
+    g_save.ok = (fclose(g_save.out) == 0) && g_save.ok;
+    __atomic_store_n(&g_save.done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void save_to_file_async(const image_t *img, const char *path)
+{
+    FILE *out;
+    layer_t *layer;
+
+    save_to_file_poll(true);
+    LOG_I("Save to %s", path);
+    out = fopen(path, "wb");
+    if (!out) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return;
+    }
+    // The snapshot shares the voxels data with the image, so it can be
+    // modified while we save.  The meshes get their own blocks, since the
+    // writes into the image modify the blocks ids of all its copies.
+    g_save.img = image_copy(img);
+    DL_FOREACH(g_save.img->layers, layer) {
+        if (layer->mesh) mesh_unshare(layer->mesh);
+    }
+    g_save.target = img;
+    g_save.key = image_get_key(img);
+    g_save.path = strdup(path);
+    g_save.out = out;
+    g_save.rend = goxel.rend;
+    g_save.done = false;
+    g_save.ok = false;
+    g_save.running = true;
+    preview_init(&g_save.preview, g_save.img);
+    if (g_save.preview.mesh) mesh_unshare(g_save.preview.mesh);
+    g_save.threaded =
+        pthread_create(&g_save.thread, NULL, save_thread, NULL) == 0;
+    if (!g_save.threaded) save_thread(NULL);
+}
+
+bool save_to_file_poll(bool wait)
+{
+    if (!g_save.running) return false;
+    if (!wait && !__atomic_load_n(&g_save.done, __ATOMIC_ACQUIRE))
+        return true;
+    if (g_save.threaded) pthread_join(g_save.thread, NULL);
+    // The snapshot has to be deleted from the main thread, since the
+    // blocks reference counts are not atomic.
+    preview_release(&g_save.preview);
+    image_delete(g_save.img);
+    if (!g_save.ok) {
+        LOG_E("Cannot save to %s", g_save.path);
+    } else {
+        // Only mark the image as saved if it is still the one we saved.
+        if (    goxel.image == g_save.target && goxel.image->path &&
+                strcmp(goxel.image->path, g_save.path) == 0)
+            goxel.image->saved_key = g_save.key;
+        sys_on_saved(g_save.path);
+    }
+    free(g_save.path);
+    g_save.img = NULL;
+    g_save.path = NULL;
+    g_save.running = false;
+    return false;
+}
+
 // Iter info of a gox file, without actually reading it.
 // For the moment only returns the image preview if available.
 int gox_iter_infos(const char *path,
@@ -513,6 +705,7 @@ int load_from_file(const char *path)
     int aabb[2][3];
     camera_t *camera, *camera_tmp;
     material_t *mat, *mat_tmp;
+    PROFILER_SCOPE("load_from_file");
 
     in = fopen(path, "rb");
     if (!in) return -1;
@@ -726,10 +919,8 @@ static void a_save_as(void)
     if (path != goxel.image->path) {
         free(goxel.image->path);
         goxel.image->path = strdup(path);
-        goxel.image->saved_key = image_get_key(goxel.image);
     }
-    save_to_file(goxel.image, goxel.image->path);
-    sys_on_saved(path);
+    save_to_file_async(goxel.image, goxel.image->path);
 }
 
 ACTION_REGISTER(save_as,
@@ -745,10 +936,8 @@ static void a_save(void)
     if (path != goxel.image->path) {
         free(goxel.image->path);
         goxel.image->path = strdup(path);
-        goxel.image->saved_key = image_get_key(goxel.image);
     }
-    save_to_file(goxel.image, goxel.image->path);
-    sys_on_saved(path);
+    save_to_file_async(goxel.image, goxel.image->path);
 }
 
 ACTION_REGISTER(save,
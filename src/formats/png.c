@@ -23,14 +23,14 @@
 static int png_export(const image_t *img, const char *path, int w, int h)
 {
     uint8_t *buf;
-    int bpp = img->export_transparent_background ? 4 : 3;
+    int ret, bpp = img->export_transparent_background ? 4 : 3;
     if (!path) return -1;
     LOG_I("Exporting to file %s", path);
     buf = calloc(w * h, bpp);
     goxel_render_to_buf(buf, w, h, bpp);
-    img_write(buf, w, h, bpp, path);
+    ret = img_write(buf, w, h, bpp, path);
     free(buf);
-    return 0;
+    return ret;
 }
 
 static void export_gui(void) {
@@ -72,4 +72,5 @@ FILE_FORMAT_REGISTER(png,
     .ext = "png\0*.png\0",
     .export_gui = export_gui,
     .export_func = export_as_png,
+    .export_need_graphics = true,
 )
@@ -23,7 +23,7 @@ static int export_as_png_slices(const image_t *image, const char *path)
 {
     float box[4][4];
     const mesh_t *mesh;
-    int x, y, z, w, h, d, pos[3], start_pos[3];
+    int x, y, z, w, h, d, pos[3], start_pos[3], ret;
     uint8_t c[4];
     uint8_t *img;
     mesh_iterator_t iter = {0};
@@ -50,9 +50,9 @@ static int export_as_png_slices(const image_t *image, const char *path)
         img[(y * w * d + z * w + x) * 4 + 2] = c[2];
         img[(y * w * d + z * w + x) * 4 + 3] = c[3];
     }
-    img_write(img, w * d, h, 4, path);
+    ret = img_write(img, w * d, h, 4, path);
     free(img);
-    return 0;
+    return ret;
 }
 
 FILE_FORMAT_REGISTER(png_slices,
@@ -78,7 +78,6 @@ static int export(const mesh_t *mesh, const char *path, bool ply)
     int nb_elems, i, j, bpos[3];
     float mat[4][4];
     FILE *out;
-    const int N = BLOCK_SIZE;
     int size = 0, subdivide;
     UT_array *lines_f, *lines_v, *lines_vn;
     line_t line, face, *line_ptr = NULL;
@@ -87,7 +86,7 @@ static int export(const mesh_t *mesh, const char *path, bool ply)
     utarray_new(lines_f, &line_icd);
     utarray_new(lines_v, &line_icd);
     utarray_new(lines_vn, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    verts = calloc(MESH_BLOCK_MAX_VERTICES, sizeof(*verts));
     face = (line_t){};
     iter = mesh_get_iterator(mesh,
             MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
@@ -50,24 +50,6 @@ texture_t *texture_new_image(const char *path, int flags)
     return tex;
 }
 
-static void unpack_pos_data(uint32_t v, int pos[3], int *face,
-                            int *cube_id)
-{
-    assert(BLOCK_SIZE == 16);
-    int x, y, z, f, i;
-    x = v >> 28;
-    y = (v >> 24) & 0x0f;
-    z = (v >> 20) & 0x0f;
-    f = (v >> 16) & 0x0f;
-    i = v & 0xffff;
-    assert(f < 6);
-    pos[0] = x;
-    pos[1] = y;
-    pos[2] = z;
-    *face = f;
-    *cube_id = i;
-}
-
 // Conveniance function to add a char in the inputs.
 void inputs_insert_char(inputs_t *inputs, uint32_t c)
 {
@@ -150,55 +132,18 @@ static bool goxel_unproject_on_box(
 }
 
 static bool goxel_unproject_on_mesh(
-        const float view[4], const float pos[2], const mesh_t *mesh,
+        const float viewport[4], const float pos[2], const mesh_t *mesh,
         float out[3], float normal[3])
 {
-    int view_size[2] = {view[2], view[3]};
-    // XXX: No need to render the fbo if it is not dirty.
-    if (goxel.pick_fbo && (goxel.pick_fbo->w != view_size[0] ||
-                           goxel.pick_fbo->h != view_size[1])) {
-        texture_delete(goxel.pick_fbo);
-        goxel.pick_fbo = NULL;
-    }
-
-    if (!goxel.pick_fbo) {
-        goxel.pick_fbo = texture_new_buffer(
-                view_size[0], view_size[1], TF_DEPTH);
-    }
+    float wpos[3] = {pos[0], pos[1], 0};
+    float opos[3], onorm[3];
+    int voxel_pos[3], n[3];
+    camera_t *cam = get_camera();
 
-    renderer_t rend = {.settings = goxel.rend.settings};
-    mat4_copy(goxel.rend.view_mat, rend.view_mat);
-    mat4_copy(goxel.rend.proj_mat, rend.proj_mat);
-
-    uint32_t pixel;
-    int voxel_pos[3];
-    int face, block_id, block_pos[3];
-    int x, y;
-    float rect[4] = {0, 0, view_size[0], view_size[1]};
-    uint8_t clear_color[4] = {0, 0, 0, 0};
-
-    rend.settings.shadow = 0;
-    rend.fbo = goxel.pick_fbo->framebuffer;
-    rend.scale = 1;
-    render_mesh(&rend, mesh, NULL, EFFECT_RENDER_POS);
-    render_submit(&rend, rect, clear_color);
-
-    x = round(pos[0] - view[0]);
-    y = round(pos[1] - view[1]);
-    GL(glViewport(0, 0, goxel.pick_fbo->w, goxel.pick_fbo->h));
-    if (x < 0 || x >= view_size[0] ||
-        y < 0 || y >= view_size[1]) return false;
-    GL(glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &pixel));
-
-    unpack_pos_data(pixel, voxel_pos, &face, &block_id);
-    if (!block_id) return false;
-    render_get_block_pos(&rend, mesh, block_id, block_pos);
-    out[0] = block_pos[0] + voxel_pos[0] + 0.5;
-    out[1] = block_pos[1] + voxel_pos[1] + 0.5;
-    out[2] = block_pos[2] + voxel_pos[2] + 0.5;
-    normal[0] = FACES_NORMALS[face][0];
-    normal[1] = FACES_NORMALS[face][1];
-    normal[2] = FACES_NORMALS[face][2];
+    camera_get_ray(cam, wpos, viewport, opos, onorm);
+    if (!mesh_raycast(mesh, opos, onorm, voxel_pos, n)) return false;
+    vec3_set(normal, n[0], n[1], n[2]);
+    vec3_set(out, voxel_pos[0] + 0.5, voxel_pos[1] + 0.5, voxel_pos[2] + 0.5);
     vec3_iaddk(out, normal, 0.5);
     return true;
 }
@@ -240,6 +185,7 @@ int goxel_unproject(const float viewport[4],
                                        goxel.selection, false,
                                        p, n, NULL);
         if ((1 << i) == SNAP_LAYER_OUT) {
+            image_update(goxel.image, true);
             mesh_get_box(goxel.image->active_layer->mesh, true, box);
             r = goxel_unproject_on_box(viewport, pos, box, false,
                                        p, n, NULL);
@@ -375,6 +321,8 @@ void goxel_reset(void)
 
     goxel.pathtracer = (pathtracer_t) {
         .num_samples = 512,
+        .noise_threshold = 0.05,
+        .denoise = true,
         .world = {
             .type = PT_WORLD_UNIFORM,
             .energy = 1,
@@ -394,6 +342,7 @@ void goxel_reset(void)
 void goxel_release(void)
 {
     pathtracer_stop(&goxel.pathtracer);
+    save_to_file_poll(true);
     gui_release();
 }
 
@@ -417,8 +366,6 @@ void goxel_release_graphics(void)
     model3d_release_graphics();
     gui_release_graphics();
     shaders_release_all();
-    texture_delete(goxel.pick_fbo);
-    goxel.pick_fbo = NULL;
     goxel.graphics_initialized = false;
 }
 
@@ -438,6 +385,9 @@ int goxel_iter(inputs_t *inputs)
     float pitch;
     camera_t *camera = get_camera();
 
+    profiler_frame_begin();
+    PROFILER_SCOPE("goxel_iter");
+
     if (!goxel.graphics_initialized)
         goxel_create_graphics();
 
@@ -469,6 +419,7 @@ int goxel_iter(inputs_t *inputs)
     }
 
     sound_iter();
+    save_to_file_poll(false);
     update_window_title();
 
     goxel.frame_count++;
@@ -677,10 +628,56 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
     }
 }
 
+// Time we keep rendering after the last change, to let the gui animations
+// and tooltips update.
+#define REDRAW_DELAY 1.0
+
+bool goxel_need_redraw(const inputs_t *inputs)
+{
+    static inputs_t last_inputs = {};
+    static uint32_t last_key = 0;
+    static double last_change_time = 0;
+    double time = sys_get_time();
+    uint32_t key, camera_key, gui_key;
+
+    if (goxel.continuous_redraw) return true;
+    if (goxel.pathtracer.status == PT_RUNNING) return true;
+
+    key = image_get_key(goxel.image);
+    key = XXH32(&goxel.rend.settings, sizeof(goxel.rend.settings), key);
+    key = XXH32(&goxel.rend.light, sizeof(goxel.rend.light), key);
+    key = XXH32(&goxel.pathtracer.status, sizeof(goxel.pathtracer.status),
+                key);
+    camera_key = camera_get_key(get_camera());
+    key = XXH32(&camera_key, sizeof(camera_key), key);
+    // The gui and tools state.
+    key = XXH32(&goxel.gui, sizeof(goxel.gui), key);
+    key = XXH32(&goxel.tool, sizeof(goxel.tool), key);
+    key = XXH32(&goxel.tool_radius, sizeof(goxel.tool_radius), key);
+    key = XXH32(&goxel.painter, sizeof(goxel.painter), key);
+    key = XXH32(&goxel.snap_mask, sizeof(goxel.snap_mask), key);
+    key = XXH32(&goxel.view_effects, sizeof(goxel.view_effects), key);
+    key = XXH32(&goxel.selection, sizeof(goxel.selection), key);
+    if (goxel.help_text)
+        key = XXH32(goxel.help_text, strlen(goxel.help_text), key);
+    if (goxel.hint_text)
+        key = XXH32(goxel.hint_text, strlen(goxel.hint_text), key);
+    gui_key = gui_get_key();
+    key = XXH32(&gui_key, sizeof(gui_key), key);
+    if (    key != last_key ||
+            memcmp(inputs, &last_inputs, sizeof(*inputs)) != 0) {
+        last_key = key;
+        last_inputs = *inputs;
+        last_change_time = time;
+    }
+    return time - last_change_time < REDRAW_DELAY;
+}
+
 KEEPALIVE
 void goxel_render(void)
 {
     uint8_t color[4];
+    PROFILER_SCOPE("goxel_render");
     theme_get_color(THEME_GROUP_BASE, THEME_COLOR_BACKGROUND, false, color);
     GL(glViewport(0, 0, goxel.screen_size[0] * goxel.screen_scale,
                         goxel.screen_size[1] * goxel.screen_scale));
@@ -717,18 +714,24 @@ static void render_pathtrace_view(const float viewport[4])
 {
     pathtracer_t *pt = &goxel.pathtracer;
     float a, mat[4][4];
-    // Recreate the buffer if needed.
+    // Recreate the buffer if needed.  The workers write into it, so we
+    // have to stop them first.
     if (    !pt->buf ||
             pt->w != goxel.image->export_width ||
             pt->h != goxel.image->export_height) {
+        pathtracer_stop(pt);
         free(pt->buf);
         pt->w = goxel.image->export_width;
         pt->h = goxel.image->export_height;
         pt->buf = calloc(pt->w * pt->h, 4);
         texture_delete(pt->texture);
         pt->texture = texture_new_surface(pt->w, pt->h, 0);
+        texture_set_data(pt->texture, pt->buf, pt->w, pt->h, 4);
     }
     pathtracer_iter(pt, viewport);
+    // Only upload the part of the buffer that changed.
+    if (pt->dirty[2] && pt->dirty[3])
+        texture_set_sub_data(pt->texture, pt->buf, pt->w, 4, pt->dirty);
 
     // Render the buffer.
     mat4_set_identity(mat);
@@ -736,7 +739,6 @@ static void render_pathtrace_view(const float viewport[4])
     mat4_iscale(mat, viewport[2], viewport[3], 1);
     mat4_itranslate(mat, 0.5, 0.5, 0);
     mat4_iscale(mat, min(a, 1.f), min(1.f / a, 1.f), 1);
-    texture_set_data(pt->texture, pt->buf, pt->w, pt->h, 4);
     render_img(&goxel.rend, pt->texture, mat,
                EFFECT_NO_SHADING | EFFECT_PROJ_SCREEN | EFFECT_ANTIALIASING);
     render_submit(&goxel.rend, viewport, goxel.back_color);
@@ -830,7 +832,11 @@ void goxel_render_view(const float viewport[4], bool render_mode)
     effects |= goxel.view_effects;
 
     for (layer = goxel_get_render_layers(true); layer; layer = layer->next) {
-        if (layer->visible && layer->mesh)
+        if (!layer->visible || !layer->mesh) continue;
+        if (layer->base_id)
+            render_mesh_instance(rend, layer->mesh, layer->mat,
+                                 layer->material, effects);
+        else
             render_mesh(rend, layer->mesh, layer->material, effects);
     }
 
@@ -887,14 +893,12 @@ void goxel_render_view(const float viewport[4], bool render_mode)
     render_submit(&goxel.rend, viewport, goxel.back_color);
 }
 
-void image_update(image_t *img);
-
 const mesh_t *goxel_get_layers_mesh(const image_t *img)
 {
     uint32_t key = 0, k;
     layer_t *layer;
 
-    image_update((image_t*)img);
+    image_update((image_t*)img, true);
     DL_FOREACH(img->layers, layer) {
         if (!layer->visible) continue;
         if (!layer->mesh) continue;
@@ -926,7 +930,7 @@ const mesh_t *goxel_get_render_mesh(const image_t *img)
     k = mesh_get_key(goxel.tool_mesh);
     key = XXH32(&k, sizeof(k), key);
     if (key != goxel.render_mesh_hash) {
-        image_update(goxel.image);
+        image_update(goxel.image, true);
         goxel.render_mesh_hash = key;
         if (!goxel.render_mesh_) goxel.render_mesh_ = mesh_new();
         mesh_clear(goxel.render_mesh_);
@@ -944,7 +948,8 @@ const mesh_t *goxel_get_render_mesh(const image_t *img)
 const layer_t *goxel_get_render_layers(bool with_tool_preview)
 {
     uint32_t hash, k;
-    layer_t *l, *layer, *tmp;
+    layer_t *l, *layer, *tmp, *base;
+    const mesh_t *mesh;
 
     hash = image_get_key(goxel.image);
     if (with_tool_preview && goxel.tool_mesh) {
@@ -954,7 +959,7 @@ const layer_t *goxel_get_render_layers(bool with_tool_preview)
 
     if (hash != goxel.render_layers_hash) {
         goxel.render_layers_hash = hash;
-        image_update(goxel.image);
+        image_update(goxel.image, false);
 
         DL_FOREACH_SAFE(goxel.render_layers, layer, tmp) {
             DL_DELETE(goxel.render_layers, layer);
@@ -965,13 +970,29 @@ const layer_t *goxel_get_render_layers(bool with_tool_preview)
             if (!l->visible) continue;
             if (!l->mesh) continue;
             layer = layer_copy(l);
+            // Clone layers are rendered as instances of their base mesh.
+            // mesh_move maps the voxels origins, so we move the matrix to
+            // the voxels centers to get the same result.
+            mesh = l->mesh;
+            base = image_get_layer(goxel.image, l->base_id);
+            if (base) {
+                mesh = base->mesh;
+                mesh_set(layer->mesh, mesh);
+                mat4_set_identity(layer->mat);
+                mat4_itranslate(layer->mat, +0.5, +0.5, +0.5);
+                mat4_imul(layer->mat, l->mat);
+                mat4_itranslate(layer->mat, -0.5, -0.5, -0.5);
+            } else {
+                layer->base_id = 0;
+            }
             if (    with_tool_preview && goxel.tool_mesh &&
-                    l->mesh == goxel.image->active_layer->mesh)
+                    mesh == goxel.image->active_layer->mesh)
             {
                 mesh_set(layer->mesh, goxel.tool_mesh);
             }
 
-            if (    goxel.render_layers &&
+            if (    goxel.render_layers && !layer->base_id &&
+                    !goxel.render_layers->prev->base_id &&
                     goxel.render_layers->prev->material == layer->material)
             {
                 mesh_merge(goxel.render_layers->prev->mesh, layer->mesh,
@@ -995,6 +1016,11 @@ void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp)
     float rect[4] = {0, 0, w * 2, h * 2};
     uint8_t *tmp_buf;
 
+    // We can get called before the first frame, for example when
+    // exporting from the command line.
+    if (!goxel.graphics_initialized)
+        goxel_create_graphics();
+
     camera->aspect = (float)w / h;
     camera_update(camera);
 
@@ -1061,6 +1087,7 @@ int goxel_import_file(const char *path, const char *format)
 {
     const file_format_t *f;
     int err;
+    PROFILER_SCOPE("goxel_import_file");
 
     if (str_endswith(path, ".gox")) {
         return load_from_file(path);
@@ -1077,6 +1104,8 @@ int goxel_export_to_file(const char *path, const char *format)
     const file_format_t *f;
     char name[128];
     int err;
+    PROFILER_SCOPE("goxel_export_to_file");
+
     f = file_format_for_path(path, format, "w");
     if (!f) return -1;
     if (!path) {
@@ -1084,6 +1113,7 @@ int goxel_export_to_file(const char *path, const char *format)
         path = sys_get_save_path(f->ext, name);
         if (!path) return -1;
     }
+    image_update(goxel.image, true);
     err = f->export_func(goxel.image, path);
     if (err) return err;
     sys_on_saved(path);
@@ -1144,6 +1174,7 @@ static void copy_action(void)
     painter_t painter;
     mesh_delete(goxel.clipboard.mesh);
     mat4_copy(goxel.selection, goxel.clipboard.box);
+    image_update(goxel.image, true);
     goxel.clipboard.mesh = mesh_copy(goxel.image->active_layer->mesh);
     if (!box_is_null(goxel.selection)) {
         painter = (painter_t) {
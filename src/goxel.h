@@ -61,6 +61,7 @@
 #include "utils/gl.h"
 #include "utils/img.h"
 #include "utils/plane.h"
+#include "utils/profiler.h"
 #include "utils/sound.h"
 #include "utils/texture.h"
 #include "utils/vec.h"
@@ -490,7 +491,6 @@ typedef struct goxel
     uint8_t    image_box_color[4];
     bool       hide_box;
 
-    texture_t  *pick_fbo;
     painter_t  painter;
     renderer_t rend;
 
@@ -522,6 +522,7 @@ typedef struct goxel
     double     frame_time;  // Clock time at beginning of the frame (sec)
     double     fps;         // Average fps.
     bool       quit;        // Set to true to quit the application.
+    bool       continuous_redraw; // Render new frames even when idle.
 
     int        view_effects; // EFFECT_WIREFRAME | EFFECT_GRID | EFFECT_EDGES
 
@@ -558,6 +559,20 @@ void goxel_reset(void);
 int goxel_iter(inputs_t *inputs);
 void goxel_render(void);
 
+/*
+ * Function: goxel_need_redraw
+ * Check if we need to render a new frame.
+ *
+ * Return false if the inputs, the image, the camera, the render settings,
+ * the gui and tools state and the path tracer state didn't change for
+ * some time, so that the application can wait for new events instead of
+ * rendering the same frame again.  We keep rendering a short time after
+ * the last change to let the gui animations finish.
+ *
+ * Always returns true if goxel.continuous_redraw is set.
+ */
+bool goxel_need_redraw(const inputs_t *inputs);
+
 /*
  * Function: goxel_create_graphics
  * Called after the graphics context has been created.
@@ -600,6 +615,10 @@ const mesh_t *goxel_get_render_mesh(const image_t *img);
  *
  * It also can replace the current layer mesh with the tool preview.
  *
+ * The clone layers are not merged: they keep their base_id attribute, and
+ * their mesh is the one of their base layer, to be rendered with the
+ * layer matrix (see <render_mesh_instance>).
+ *
  * This is the function that should be used the get the actual list of layers
  * to be rendered.
  */
@@ -617,6 +636,28 @@ int goxel_export_to_file(const char *path, const char *format);
 void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp);
 
 void save_to_file(const image_t *img, const char *path);
+
+/*
+ * Function: save_to_file_async
+ * Save an image to a gox file from a background thread.
+ *
+ * We save a snapshot of the image, so it can still be edited during the
+ * save.  <save_to_file_poll> finishes the save once the thread is done,
+ * and marks the image as saved if the write succeeded.
+ */
+void save_to_file_async(const image_t *img, const char *path);
+
+/*
+ * Function: save_to_file_poll
+ * Finish the background save started by <save_to_file_async> if it is done.
+ *
+ * Parameters:
+ *   wait - If set, block until the save is done.
+ *
+ * Return:
+ *   True if a save is still running.
+ */
+bool save_to_file_poll(bool wait);
 int load_from_file(const char *path);
 
 // Iter info of a gox file, without actually reading it.
@@ -655,5 +696,32 @@ void settings_save(void);
  * Run all the unit tests */
 void tests_run(void);
 
+/* Function: tests_run_render
+ * Run the unit tests that render offscreen with some OpenGL features the
+ * context might not have.  Only called by 'goxel --test'. */
+void tests_run_render(void);
+
+/* Function: bench_run
+ * Run all the benchmarks and log the results */
+void bench_run(void);
+
+/* Function: batch_run
+ * Run a script of commands on a list of files, without any GUI.
+ *
+ * See batch.c for the list of supported commands.
+ *
+ * Parameters:
+ *   script     - Path to the script file, or "-" to read it from stdin.
+ *   inputs     - Files on which we run the script.
+ *   nb_inputs  - Number of input files.  If zero, the script is run once
+ *                on an empty image.
+ *   nb_jobs    - Number of files to process in parallel.
+ *
+ * Return:
+ *   Zero if the script succeeded on all the files.
+ */
+int batch_run(const char *script, const char **inputs, int nb_inputs,
+              int nb_jobs);
+
 
 #endif // GOXEL_H
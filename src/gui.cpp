@@ -22,6 +22,7 @@
 
 extern "C" {
 #include "goxel.h"
+#include "xxhash.h"
 
 void gui_app(void);
 void gui_render_panel(void);
@@ -1517,6 +1518,22 @@ void gui_request_panel_width(float width)
     goxel.gui.panel_width = width;
 }
 
+uint32_t gui_get_key(void)
+{
+    uint32_t key = 0;
+    if (!gui) return 0;
+    ImGuiContext& g = *GImGui;
+    key = XXH32(&gui->popup_count, sizeof(gui->popup_count), key);
+    key = XXH32(&gui->capture_mouse, sizeof(gui->capture_mouse), key);
+    key = XXH32(&gui->is_scrolling, sizeof(gui->is_scrolling), key);
+    key = XXH32(&g.HoveredWindow, sizeof(g.HoveredWindow), key);
+    key = XXH32(&g.HoveredId, sizeof(g.HoveredId), key);
+    key = XXH32(&g.ActiveId, sizeof(g.ActiveId), key);
+    key = XXH32(&g.NavWindow, sizeof(g.NavWindow), key);
+    key = XXH32(&g.OpenPopupStack.Size, sizeof(g.OpenPopupStack.Size), key);
+    return key;
+}
+
 bool gui_layer_item(int i, int icon, bool *visible, bool *edit,
                     char *name, int len)
 {
@@ -1592,6 +1609,37 @@ bool gui_is_key_down(int key)
     return ImGui::IsKeyDown(key);
 }
 
+void gui_flame_graph(int nb, const char **labels, const float (*bars)[3],
+                     float duration)
+{
+    int i, depth = 0;
+    float w = ImGui::GetContentRegionAvail().x;
+    float h = ImGui::GetFontSize() + 4;
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+    ImVec2 pos = ImGui::GetCursorScreenPos();
+    ImVec2 a, b;
+    uint32_t color;
+
+    if (duration <= 0) return;
+    for (i = 0; i < nb; i++) depth = max(depth, (int)bars[i][2] + 1);
+    ImGui::Dummy(ImVec2(w, max(depth, 1) * h));
+
+    for (i = 0; i < nb; i++) {
+        a = pos + ImVec2(bars[i][0] / duration * w, bars[i][2] * h);
+        b = a + ImVec2(max(bars[i][1] / duration * w, 1.0f), h - 1);
+        // Same color for all the bars with the same label.
+        color = 0xFF000000 | (XXH32(labels[i], strlen(labels[i]), 0) &
+                              0x007F7F7F) | 0x00404040;
+        draw_list->AddRectFilled(a, b, color);
+        draw_list->PushClipRect(a, b, true);
+        draw_list->AddText(a + ImVec2(2, 2), 0xFFFFFFFF, labels[i]);
+        draw_list->PopClipRect();
+        if (ImGui::IsMouseHoveringRect(a, b)) {
+            ImGui::SetTooltip("%s: %.3f ms", labels[i], bars[i][1] * 1000);
+        }
+    }
+}
+
 bool gui_palette_entry(const uint8_t color[4], uint8_t target[4])
 {
     bool ret;
@@ -43,6 +43,13 @@ void gui_render(void);
 
 void gui_request_panel_width(float width);
 
+/*
+ * Function: gui_get_key
+ * Return a value that changes when the state of the gui changes, like the
+ * hovered or active widget and the opened popups.
+ */
+uint32_t gui_get_key(void);
+
 bool gui_panel_header(const char *label);
 
 void gui_canvas(float x, float y, float w, float h,
@@ -123,6 +130,19 @@ bool gui_layer_item(int i, int icon, bool *visible, bool *edit,
 bool gui_is_key_down(int key);
 bool gui_palette_entry(const uint8_t color[4], uint8_t target[4]);
 
+/*
+ * Function: gui_flame_graph
+ * Render a flame graph of nested timed scopes.
+ *
+ * Parameters:
+ *   nb         - Number of bars.
+ *   labels     - Label of each bar.
+ *   bars       - Start time, duration and depth of each bar.
+ *   duration   - Total duration of the graph.
+ */
+void gui_flame_graph(int nb, const char **labels, const float (*bars)[3],
+                     float duration);
+
 bool gui_need_full_version(void);
 
 
@@ -18,6 +18,37 @@
 
 #include "goxel.h"
 
+static void profiler_panel(void)
+{
+    static profiler_event_t events[1024];
+    const char *labels[ARRAY_SIZE(events)];
+    float bars[ARRAY_SIZE(events)][3];
+    bool enabled = profiler_is_enabled();
+    double duration;
+    const char *path;
+    int i, nb;
+
+    if (gui_checkbox("Record", &enabled, "Record the frames timings"))
+        profiler_set_enabled(enabled);
+    if (!enabled) return;
+
+    nb = profiler_get_last_frame(events, ARRAY_SIZE(events), &duration);
+    for (i = 0; i < nb; i++) {
+        labels[i] = events[i].name;
+        bars[i][0] = events[i].start;
+        bars[i][1] = max(events[i].duration, 0);
+        bars[i][2] = events[i].depth;
+    }
+    gui_text("Frame: %.2f ms", duration * 1000);
+    if (nb) gui_flame_graph(nb, labels, bars, duration);
+
+    if (gui_button("Save trace", -1, 0)) {
+        path = sys_get_save_path("json\0*.json\0", "trace.json");
+        if (path && profiler_write_trace(path) != 0)
+            LOG_E("Cannot write trace to %s", path);
+    }
+}
+
 void gui_debug_panel(void)
 {
     mesh_global_stats_t stats;
@@ -32,6 +63,12 @@ void gui_debug_panel(void)
         gui_checkbox_flag("Show wireframe", &goxel.view_effects,
                           EFFECT_WIREFRAME, NULL);
     }
+    gui_checkbox_flag("Compact vertices", &goxel.rend.settings.effects,
+                      EFFECT_PACKED_VERTICES,
+                      "Use a smaller vertex format for the cubes rendering");
+    gui_checkbox_flag("Level of detail", &goxel.rend.settings.effects,
+                      EFFECT_LOD,
+                      "Render the distant blocks at a lower resolution");
 
     if (gui_button("Clear undo history", -1, 0)) {
         image_history_resize(goxel.image, 0);
@@ -43,5 +80,8 @@ void gui_debug_panel(void)
         goxel.request_test_graphic_release = true;
     }
 
+    if (gui_collapsing_header("Profiler", false))
+        profiler_panel();
+
 }
 
@@ -47,6 +47,10 @@ void gui_render_panel(void)
     gui_group_end();
 
     gui_input_int("Samples", &pt->num_samples, 1, 10000);
+    gui_input_float("Noise", &pt->noise_threshold, 0.001, 0, 1, "%.3f");
+    gui_checkbox("Noise heatmap", &pt->show_noise,
+                 "Show the remaining noise of the render");
+    gui_checkbox("Denoise", &pt->denoise, NULL);
 
     if (pt->status == PT_STOPPED && gui_button("Start", 1, 0))
         pt->status = PT_RUNNING;
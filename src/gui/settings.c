@@ -59,6 +59,9 @@ int gui_settings_popup(void *data)
 
     free(names);
 
+    gui_checkbox("Continuous redraw", &goxel.continuous_redraw,
+                 "Render new frames even when nothing changed");
+
     // For the moment I disable the theme editor!
 #if 0
     int group;
@@ -114,6 +117,9 @@ static int settings_ini_handler(void *user, const char *section,
         if (strcmp(name, "theme") == 0) {
             theme_set(value);
         }
+        if (strcmp(name, "continuous_redraw") == 0) {
+            goxel.continuous_redraw = atoi(value);
+        }
     }
     if (strcmp(section, "shortcuts") == 0) {
         if ((a = action_get_by_name(name))) {
@@ -153,6 +159,7 @@ void settings_save(void)
     }
     fprintf(file, "[ui]\n");
     fprintf(file, "theme=%s\n", theme_get()->name);
+    fprintf(file, "continuous_redraw=%d\n", goxel.continuous_redraw);
 
     fprintf(file, "[shortcuts]\n");
     actions_iter(shortcut_save_callback, file);
@@ -57,8 +57,20 @@ void gui_view_panel(void)
             &goxel.rend.settings.effects, EFFECT_BORDERS, NULL);
     gui_checkbox_flag("See back",
             &goxel.rend.settings.effects, EFFECT_SEE_BACK, NULL);
-    gui_checkbox_flag("Marching Cubes",
-                &goxel.rend.settings.effects, EFFECT_MARCHING_CUBES, NULL);
+    // Marching cubes and surface nets are exclusive.
+    if (gui_checkbox_flag("Marching Cubes",
+                &goxel.rend.settings.effects, EFFECT_MARCHING_CUBES, NULL))
+        goxel.rend.settings.effects &= ~EFFECT_SURFACE_NETS;
+    if (gui_checkbox_flag("Surface Nets",
+                &goxel.rend.settings.effects, EFFECT_SURFACE_NETS, NULL))
+        goxel.rend.settings.effects &= ~(EFFECT_MARCHING_CUBES |
+                                         EFFECT_MC_SMOOTH);
+    if (!DEFINED(GLES2)) {
+        gui_checkbox_flag("Ray marching", &goxel.rend.settings.effects,
+                          EFFECT_RAYMARCH,
+                          "Render the voxels directly on the GPU, without "
+                          "generating the blocks vertices");
+    }
 
     if (goxel.rend.settings.effects & EFFECT_MARCHING_CUBES) {
         gui_checkbox_flag("Smooth Colors", &goxel.rend.settings.effects,
@@ -103,7 +103,7 @@ static void make_uniq_name(
     }
 }
 
-static layer_t *img_get_layer(const image_t *img, int id)
+layer_t *image_get_layer(const image_t *img, int id)
 {
     layer_t *layer;
     if (id == 0) return NULL;
@@ -143,16 +143,16 @@ static layer_t *layer_clone(layer_t *other)
     return layer;
 }
 
-// Make sure the layer mesh is up to date.
-void image_update(image_t *img)
+void image_update(image_t *img, bool clones)
 {
     painter_t painter = {};
     uint32_t key;
     layer_t *layer, *base;
 
     DL_FOREACH(img->layers, layer) {
-        base = img_get_layer(img, layer->base_id);
-        if (base && layer->base_mesh_key != mesh_get_key(base->mesh)) {
+        base = image_get_layer(img, layer->base_id);
+        if (    clones && base &&
+                layer->base_mesh_key != mesh_get_key(base->mesh)) {
             mesh_set(layer->mesh, base->mesh);
             mesh_move(layer->mesh, layer->mat);
             layer->base_mesh_key = mesh_get_key(base->mesh);
@@ -245,6 +245,14 @@ static image_t *image_snap(image_t *other)
     return img;
 }
 
+image_t *image_copy(const image_t *other)
+{
+    image_t *img = image_snap((image_t*)other);
+    // The path is only shared with the history snapshots.
+    img->path = NULL;
+    return img;
+}
+
 
 void image_delete(image_t *img)
 {
@@ -327,6 +335,7 @@ void image_delete_layer(image_t *img, layer_t *layer)
     layer_t *other;
     assert(img);
     assert(layer);
+    image_update(img, true);
     DL_DELETE(img->layers, layer);
     if (layer == img->active_layer) img->active_layer = NULL;
 
@@ -398,6 +407,7 @@ void image_unclone_layer(image_t *img, layer_t *layer)
 {
     assert(img);
     assert(layer);
+    image_update(img, true);
     layer->base_id = 0;
     layer->shape = NULL;
 }
@@ -406,6 +416,7 @@ void image_merge_visible_layers(image_t *img)
 {
     layer_t *layer, *other, *last = NULL;
     assert(img);
+    image_update(img, true);
     DL_FOREACH(img->layers, layer) {
         if (!layer->visible) continue;
         image_unclone_layer(img, layer);
@@ -542,6 +553,7 @@ static void debug_print_history(image_t *img) {}
 
 void image_history_push(image_t *img)
 {
+    PROFILER_SCOPE("image_history_push");
     image_t *snap = image_snap(img);
     image_t *hist;
 
@@ -799,7 +811,7 @@ ACTION_REGISTER(img_unclone_layer,
 static void a_img_select_parent_layer(void)
 {
     image_t *image = goxel.image;
-    image->active_layer = img_get_layer(image, image->active_layer->base_id);
+    image->active_layer = image_get_layer(image, image->active_layer->base_id);
 }
 
 
@@ -57,9 +57,24 @@ struct image {
 
 image_t *image_new(void);
 void image_delete(image_t *img);
+
+/*
+ * Function: image_copy
+ * Create a copy of an image, without its history.
+ *
+ * The layers meshes share their blocks with the original image until one
+ * of them gets modified.
+ */
+image_t *image_copy(const image_t *img);
 layer_t *image_add_layer(image_t *img, layer_t *layer);
 void image_delete_layer(image_t *img, layer_t *layer);
 layer_t *image_duplicate_layer(image_t *img, layer_t *layer);
+
+/*
+ * Function: image_get_layer
+ * Return the layer with a given id, or NULL if id is zero.
+ */
+layer_t *image_get_layer(const image_t *img, int id);
 void image_merge_visible_layers(image_t *img);
 
 void image_history_push(image_t *img);
@@ -69,6 +84,20 @@ void image_history_resize(image_t *img, int size);
 
 bool image_layer_can_edit(const image_t *img, const layer_t *layer);
 
+/*
+ * Function: image_update
+ * Make sure the layers meshes are up to date.
+ *
+ * The clone layers are rendered as instances of their base layer, so we
+ * only compute their voxels when an operation needs them, like a merge,
+ * an export or the picking.
+ *
+ * Parameters:
+ *   img    - An image.
+ *   clones - If set, also update the voxels of the clone layers.
+ */
+void image_update(image_t *img, bool clones);
+
 material_t *image_add_material(image_t *img, material_t *mat);
 void image_delete_material(image_t *img, material_t *mat);
 
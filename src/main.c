@@ -17,6 +17,7 @@
  */
 
 #include "goxel.h"
+#include "file_format.h"
 #include <getopt.h>
 
 #ifdef GLES2
@@ -24,9 +25,15 @@
 #endif
 #include <GLFW/glfw3.h>
 
+#ifdef HAVE_EGL
+#   include <EGL/egl.h>
+#   include <EGL/eglext.h>
+#endif
+
 static inputs_t     *g_inputs = NULL;
 static GLFWwindow   *g_window = NULL;
 static float        g_scale = 1;
+static bool         g_force_redraw = true;
 
 static void on_glfw_error(int code, const char *msg)
 {
@@ -44,6 +51,12 @@ void on_char(GLFWwindow *win, unsigned int c)
     inputs_insert_char(g_inputs, c);
 }
 
+// Called when the window content got damaged, for example after a resize.
+static void on_refresh(GLFWwindow *win)
+{
+    g_force_redraw = true;
+}
+
 void on_drop(GLFWwindow* win, int count, const char** paths)
 {
     int i;
@@ -56,10 +69,35 @@ typedef struct
     char *input;
     char *export;
     float scale;
+    bool bench;
+    bool test;
+    char *batch;
+    int jobs;
+    char *render;
+    char *camera;
+    int size[2];
+    int samples;
+    int part[2];
+    char *merge;
+    bool no_denoise;
+    float noise_threshold;
+    const char **inputs; // All the positional arguments, for batch mode.
+    int nb_inputs;
 } args_t;
 
 #define OPT_HELP 1
 #define OPT_VERSION 2
+#define OPT_BENCH 3
+#define OPT_BATCH 4
+#define OPT_RENDER 5
+#define OPT_CAMERA 6
+#define OPT_SIZE 7
+#define OPT_SAMPLES 8
+#define OPT_PART 9
+#define OPT_MERGE 10
+#define OPT_TEST 11
+#define OPT_NO_DENOISE 12
+#define OPT_NOISE_THRESHOLD 13
 
 typedef struct {
     const char *name;
@@ -73,6 +111,28 @@ static const gox_option_t OPTIONS[] = {
     {"export", 'e', required_argument, "FILENAME",
         .help="Export the image to a file"},
     {"scale", 's', required_argument, "FLOAT", .help="Set UI scale"},
+    {"bench", OPT_BENCH, .help="Run the benchmarks and exit"},
+    {"test", OPT_TEST, .help="Run the unit tests without any window and exit"},
+    {"batch", OPT_BATCH, required_argument, "SCRIPT",
+        .help="Run a script on all the inputs and exit ('-' for stdin)"},
+    {"jobs", 'j', required_argument, "INT",
+        .help="Number of inputs processed in parallel in batch mode"},
+    {"render", OPT_RENDER, required_argument, "FILENAME",
+        .help="Path trace the input to a png or hdr file and exit"},
+    {"camera", OPT_CAMERA, required_argument, "NAME",
+        .help="Name of the camera used for the render"},
+    {"size", OPT_SIZE, required_argument, "WxH",
+        .help="Size of the render (default 1024x1024)"},
+    {"samples", OPT_SAMPLES, required_argument, "INT",
+        .help="Number of samples per pixel of the render"},
+    {"part", OPT_PART, required_argument, "I/N",
+        .help="Only render the samples of part I out of N"},
+    {"merge", OPT_MERGE, required_argument, "FILENAME",
+        .help="Merge the rendered parts inputs into an image and exit"},
+    {"no-denoise", OPT_NO_DENOISE,
+        .help="Don't filter the noise of the rendered image"},
+    {"noise-threshold", OPT_NOISE_THRESHOLD, required_argument, "FLOAT",
+        .help="Adaptive sampling noise threshold (default 0: off)"},
     {"help", OPT_HELP, .help="Give this help list"},
     {"version", OPT_VERSION, .help="Print program version"},
     {}
@@ -83,7 +143,7 @@ static void print_help(void)
     const gox_option_t *opt;
     char buf[128];
 
-    printf("Usage: goxel [OPTION...] [INPUT]\n");
+    printf("Usage: goxel [OPTION...] [INPUT...]\n");
     printf("A 3D voxels editor\n");
     printf("\n");
 
@@ -120,7 +180,7 @@ static void parse_options(int argc, char **argv, args_t *args)
     }
 
     while (true) {
-        c = getopt_long(argc, argv, "e:s:", long_options, &option_index);
+        c = getopt_long(argc, argv, "e:s:j:", long_options, &option_index);
         if (c == -1) break;
         switch (c) {
         case 'e':
@@ -135,12 +195,64 @@ static void parse_options(int argc, char **argv, args_t *args)
         case OPT_VERSION:
             printf("Goxel " GOXEL_VERSION_STR "\n");
             exit(0);
+        case OPT_BENCH:
+            args->bench = true;
+            break;
+        case OPT_TEST:
+            args->test = true;
+            break;
+        case OPT_BATCH:
+            args->batch = optarg;
+            break;
+        case 'j':
+            args->jobs = atoi(optarg);
+            break;
+        case OPT_RENDER:
+            args->render = optarg;
+            break;
+        case OPT_CAMERA:
+            args->camera = optarg;
+            break;
+        case OPT_SIZE:
+            if (    sscanf(optarg, "%dx%d", &args->size[0],
+                           &args->size[1]) != 2 ||
+                    args->size[0] <= 0 || args->size[1] <= 0) {
+                fprintf(stderr, "Invalid size: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_SAMPLES:
+            args->samples = atoi(optarg);
+            break;
+        case OPT_PART:
+            if (    sscanf(optarg, "%d/%d", &args->part[0],
+                           &args->part[1]) != 2 ||
+                    args->part[0] < 0 || args->part[0] >= args->part[1]) {
+                fprintf(stderr, "Invalid part: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_MERGE:
+            args->merge = optarg;
+            break;
+        case OPT_NO_DENOISE:
+            args->no_denoise = true;
+            break;
+        case OPT_NOISE_THRESHOLD:
+            args->noise_threshold = atof(optarg);
+            if (args->noise_threshold < 0) {
+                fprintf(stderr, "Invalid noise threshold: %s\n", optarg);
+                exit(-1);
+            }
+            break;
         case '?':
             exit(-1);
         }
     }
     if (optind < argc) {
         args->input = argv[optind];
+        args->inputs = (const char **)argv + optind;
+        args->nb_inputs = argc - optind;
     }
 }
 
@@ -185,8 +297,6 @@ static void loop_function(void)
     g_inputs->window_size[1] = win_size[1];
     g_inputs->scale = scale;
 
-    GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
-
     for (i = GLFW_KEY_SPACE; i <= GLFW_KEY_LAST; i++) {
         g_inputs->keys[i] = glfwGetKey(g_window, i) == GLFW_PRESS;
     }
@@ -199,6 +309,20 @@ static void loop_function(void)
     g_inputs->touches[0].down[2] =
         glfwGetMouseButton(g_window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
 
+    // If nothing changed, keep the previous frame and sleep until we get
+    // new events.  The timeout is there in case some state changes
+    // without any input (like an import from the drop callback).
+    #if !defined(__EMSCRIPTEN__) && \
+        (GLFW_VERSION_MAJOR > 3 || \
+         (GLFW_VERSION_MAJOR == 3 && GLFW_VERSION_MINOR >= 2))
+    if (!g_force_redraw && !goxel_need_redraw(g_inputs)) {
+        glfwWaitEventsTimeout(0.5);
+        return;
+    }
+    #endif
+    g_force_redraw = false;
+
+    GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
     goxel_iter(g_inputs);
     goxel_render();
 
@@ -265,6 +389,279 @@ static void set_window_title(void *user, const char *title)
     glfwSetWindowTitle(g_window, title);
 }
 
+#ifdef HAVE_EGL
+
+static EGLDisplay g_egl_display = EGL_NO_DISPLAY;
+
+/*
+ * Create an OpenGL context without any window or display server.
+ *
+ * We use the mesa surfaceless platform if available, so that this works
+ * on servers without X.  We don't need any surface since the renderer
+ * only draws into its own framebuffers.
+ */
+static bool create_egl_context(void)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLConfig config = NULL;
+    EGLContext context;
+    EGLint nb_configs = 0;
+    const EGLint config_attrs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                       EGL_DEFAULT_DISPLAY, NULL);
+    }
+#endif
+    (void)get_platform_display;
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        LOG_W("Cannot initialize EGL display");
+        return false;
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) goto error;
+    // Some drivers don't expose any config for the surfaceless platform,
+    // in that case we rely on EGL_KHR_no_config_context.
+    eglChooseConfig(display, config_attrs, &config, 1, &nb_configs);
+    if (nb_configs == 0) config = NULL;
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT) goto error;
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        eglDestroyContext(display, context);
+        goto error;
+    }
+    LOG_I("Headless OpenGL: %s", glGetString(GL_RENDERER));
+    g_egl_display = display;
+    return true;
+
+error:
+    LOG_W("Cannot create EGL context (%x)", eglGetError());
+    eglTerminate(display);
+    return false;
+}
+
+#endif
+
+/*
+ * Create an OpenGL context for rendering without showing anything on
+ * screen.  If EGL is not available we fallback to an hidden window.
+ */
+static bool create_headless_context(void)
+{
+#ifdef HAVE_EGL
+    if (create_egl_context()) return true;
+#endif
+    glfwSetErrorCallback(on_glfw_error);
+    if (!glfwInit()) return false;
+    glfwWindowHint(GLFW_VISIBLE, false);
+    g_window = glfwCreateWindow(64, 64, "Goxel", NULL, NULL);
+    if (!g_window) return false;
+    glfwMakeContextCurrent(g_window);
+#ifdef WIN32
+    glewInit();
+#endif
+    return true;
+}
+
+static void release_headless_context(void)
+{
+#ifdef HAVE_EGL
+    if (g_egl_display != EGL_NO_DISPLAY) {
+        eglMakeCurrent(g_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       EGL_NO_CONTEXT);
+        eglTerminate(g_egl_display);
+        g_egl_display = EGL_NO_DISPLAY;
+    }
+#endif
+    if (g_window) glfwTerminate();
+}
+
+static bool on_create_gl_context(void *user)
+{
+    return create_headless_context();
+}
+
+/*
+ * Run a batch script without opening any window.  The OpenGL context
+ * only gets created if one of the commands needs it.
+ */
+static int headless_batch(const args_t *args)
+{
+    int ret;
+    sys_callbacks.create_gl_context = on_create_gl_context;
+    goxel_init();
+    ret = batch_run(args->batch, args->inputs, args->nb_inputs,
+                    args->jobs ?: 1);
+    goxel_release();
+    release_headless_context();
+    return ret;
+}
+
+/*
+ * Import the input file and export it without opening any window.
+ *
+ * We only create an OpenGL context if the export format needs the
+ * renderer (for example png), so that converting between voxel formats
+ * works on machines without any graphics.
+ */
+static int headless_export(const args_t *args)
+{
+    const file_format_t *format;
+    bool need_graphics;
+    int ret;
+
+    if (!args->input) {
+        LOG_E("trying to export an empty image");
+        return -1;
+    }
+    format = file_format_for_path(args->export, NULL, "w");
+    if (!format) {
+        LOG_E("Cannot export to %s: unknown format", args->export);
+        return -1;
+    }
+    need_graphics = format->export_need_graphics;
+    if (need_graphics && !create_headless_context()) {
+        LOG_E("Cannot create an OpenGL context");
+        return -1;
+    }
+
+    goxel_init();
+    goxel_import_file(args->input, NULL);
+    ret = goxel_export_to_file(args->export, NULL);
+    goxel_release();
+    if (need_graphics) release_headless_context();
+    return ret;
+}
+
+/*
+ * Path trace the input file with one of its cameras, without opening any
+ * window.  The path tracer runs on the cpu only, so we don't need any
+ * OpenGL context.
+ */
+static int headless_render(const args_t *args)
+{
+    pathtracer_t *pt;
+    camera_t *camera = NULL;
+    int ret = -1, aabb[2][3];
+    float box[4][4];
+    bool created = false;
+
+    if (!args->input) {
+        LOG_E("trying to render an empty image");
+        return -1;
+    }
+    // The parts must trace all their samples to be merged.
+    if (args->part[1] && args->noise_threshold) {
+        LOG_E("--noise-threshold cannot be used with --part");
+        return -1;
+    }
+    goxel_init();
+    // Remove the default camera, so that we only keep the ones of the file.
+    while (goxel.image->cameras)
+        image_delete_camera(goxel.image, goxel.image->cameras);
+    if (goxel_import_file(args->input, NULL) != 0) {
+        LOG_E("Cannot open %s", args->input);
+        goto end;
+    }
+    if (args->camera) {
+        DL_FOREACH(goxel.image->cameras, camera) {
+            if (strcmp(camera->name, args->camera) == 0) break;
+        }
+        if (!camera) {
+            LOG_E("No camera named %s", args->camera);
+            goto end;
+        }
+        goxel.image->active_camera = camera;
+    }
+    if (!goxel.image->active_camera) {
+        goxel.image->active_camera = image_add_camera(goxel.image, NULL);
+        created = true;
+    }
+    camera = goxel.image->active_camera;
+    // A new camera looks at the whole image.
+    if (created) {
+        mesh_get_bbox(goxel_get_layers_mesh(goxel.image), aabb, true);
+        bbox_from_aabb(box, aabb);
+        camera_fit_box(camera, box);
+    }
+
+    pt = &goxel.pathtracer;
+    pt->w = args->size[0] ?: 1024;
+    pt->h = args->size[1] ?: 1024;
+    if (args->samples > 0) pt->num_samples = args->samples;
+    pt->denoise = !args->no_denoise;
+    pt->noise_threshold = args->noise_threshold;
+    pt->part[0] = args->part[0];
+    pt->part[1] = args->part[1];
+    pt->buf = calloc(pt->w * pt->h, 4);
+    camera->aspect = (float)pt->w / pt->h;
+    camera_update(camera);
+
+    ret = pathtracer_render(pt, args->render);
+    pathtracer_stop(pt);
+    free(pt->buf);
+    pt->buf = NULL;
+end:
+    goxel_release();
+    return ret;
+}
+
+/*
+ * Run the unit tests without opening any window, so that we can also test
+ * the renderer on servers, for example with mesa llvmpipe.  The tests exit
+ * the program with an error code if they fail.
+ */
+static int headless_tests(void)
+{
+    if (!create_headless_context()) {
+        LOG_E("Cannot create an OpenGL context");
+        return -1;
+    }
+    goxel_init();
+    tests_run();
+    tests_run_render();
+    goxel_release();
+    release_headless_context();
+    LOG_I("All tests passed");
+    return 0;
+}
+
+/*
+ * Merge the parts of a render split with --part into the final image.
+ *
+ * For example, to split a render over two processes:
+ *
+ *   goxel in.gox --render=a.part --part=0/2
+ *   goxel in.gox --render=b.part --part=1/2
+ *   goxel --merge=out.png a.part b.part
+ */
+static int headless_merge(const args_t *args)
+{
+    int ret;
+
+    if (!args->nb_inputs) {
+        LOG_E("No parts to merge");
+        return -1;
+    }
+    goxel_init();
+    goxel.pathtracer.denoise = !args->no_denoise;
+    ret = pathtracer_merge(&goxel.pathtracer, args->inputs, args->nb_inputs,
+                           args->merge);
+    free(goxel.pathtracer.buf);
+    goxel.pathtracer.buf = NULL;
+    goxel_release();
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     args_t args = {.scale = 1};
@@ -281,6 +678,17 @@ int main(int argc, char **argv)
 
     g_scale = args.scale;
 
+    if (args.test)
+        return headless_tests() ? 1 : 0;
+    if (args.merge && !args.bench)
+        return headless_merge(&args) ? 1 : 0;
+    if (args.render && !args.bench)
+        return headless_render(&args) ? 1 : 0;
+    if (args.batch && !args.bench)
+        return headless_batch(&args) ? 1 : 0;
+    if (args.export && !args.bench)
+        return headless_export(&args);
+
     glfwSetErrorCallback(on_glfw_error);
     glfwInit();
     glfwWindowHint(GLFW_SAMPLES, 4);
@@ -298,6 +706,7 @@ int main(int argc, char **argv)
         glfwSetScrollCallback(window, on_scroll);
     glfwSetDropCallback(window, on_drop);
     glfwSetCharCallback(window, on_char);
+    glfwSetWindowRefreshCallback(window, on_refresh);
     glfwSetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS, false);
     set_window_icon(window);
 
@@ -311,18 +720,14 @@ int main(int argc, char **argv)
         goxel_reset();
     }
 
+    if (args.bench) {
+        bench_run();
+        goto end;
+    }
+
     if (args.input)
         goxel_import_file(args.input, NULL);
 
-    if (args.export) {
-        if (!args.input) {
-            LOG_E("trying to export an empty image");
-            ret = -1;
-        } else {
-            ret = goxel_export_to_file(args.export, NULL);
-        }
-        goto end;
-    }
     start_main_loop(loop_function);
 end:
     glfwTerminate();
@@ -25,6 +25,9 @@
 
 static const int N = BLOCK_SIZE;
 
+// Size of the voxels cube we read around a block: from -1 to N + 1.
+#define D (BLOCK_SIZE + 3)
+
 // Marching cube data.
 static const int MC_EDGE_TABLE[256];
 static const int8_t MC_TRI_TABLE[256][16];
@@ -86,7 +89,7 @@ static void mc_interp_pos(const mc_vert_t *vert, float out[3], bool rounded)
     }
 }
 
-static void compute_triangle_normal(const mc_vert_t t[3], float out[3])
+static void compute_triangle_cross(const mc_vert_t t[3], float out[3])
 {
     int i;
     float u[3] = {t[1].pos[0] - t[0].pos[0], t[1].pos[1] - t[0].pos[1], t[1].pos[2] - t[0].pos[2]};
@@ -95,6 +98,11 @@ static void compute_triangle_normal(const mc_vert_t t[3], float out[3])
                   u[2] * v[0] - u[0] * v[2],
                   u[0] * v[1] - u[1] * v[0]};
     for (i = 0; i < 3; i++) out[i] = n[i];
+}
+
+static void compute_triangle_normal(const mc_vert_t t[3], float out[3])
+{
+    compute_triangle_cross(t, out);
     vec3_normalize(out, out);
 }
 
@@ -248,48 +256,35 @@ static int split_triangles(int nb, const mc_vert_t (*tri)[3],
     return ret;
 }
 
-int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
-                              int effects, voxel_vertex_t *out,
-                              int *size, int *subdivide)
+// Read the voxels from -1 to N + 1 around a block.
+static void read_data(const mesh_t *mesh, const int block_pos[3],
+                      uint8_t *data)
 {
-    int i, vi, x, y, z, v, vx, vy, vz, nb_tri, nb_tri_tot = 0;
-    uint8_t tmp[4];
-    uint8_t *data;
-
-    int densities[8];
-    int p[3], s[3];
-    int rect[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
-                      {INT_MIN, INT_MIN, INT_MIN}};
-
-    mc_vert_t tri[30][3];
-    float n[3];
-    const bool flat = !(effects & EFFECT_MC_SMOOTH);
-
-    *size = 3;      // Triangles.
-    *subdivide = MC_VOXEL_SUB_POS;
-
-    // To speed things up we first get the voxel cube around the block.
-    data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
-    p[0] = block_pos[0] - 1;
-    p[1] = block_pos[1] - 1;
-    p[2] = block_pos[2] - 1;
-    s[0] = N + 2;
-    s[1] = N + 2;
-    s[2] = N + 2;
-    mesh_read(mesh, p, s, data);
+    const int pos[3] = {block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1};
+    const int size[3] = {D, D, D};
+    mesh_read(mesh, pos, size, data);
+}
 
 #define get_at(d, x, y, z, out) do { \
     memcpy(out, &data[( \
                 (x + 1) + \
-                (y + 1) * (N + 2) + \
-                (z + 1) * (N + 2) * (N + 2)) * 4], 4); \
+                (y + 1) * D + \
+                (z + 1) * D * D) * 4], 4); \
 } while (0)
 
-    // Get the smallest rect we need to consider.
+// Get the smallest rect of cells we need to consider, within the block
+// cells extended by a given border.
+static void get_rect(const uint8_t *data, int border, int rect[2][3])
+{
+    int x, y, z;
+    uint8_t tmp[4];
+
+    rect[0][0] = rect[0][1] = rect[0][2] = INT_MAX;
+    rect[1][0] = rect[1][1] = rect[1][2] = INT_MIN;
     // XXX: can we measure how much we gain with that?
-    for (z = -1; z < N + 1; z++)
-    for (y = -1; y < N + 1; y++)
-    for (x = -1; x < N + 1; x++) {
+    for (z = -1; z < N + 2; z++)
+    for (y = -1; y < N + 2; y++)
+    for (x = -1; x < N + 2; x++) {
         get_at(data, x, y, z, tmp);
         if (tmp[3]) {
             rect[0][0] = min(rect[0][0], x - 2);
@@ -300,66 +295,184 @@ int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
             rect[1][2] = max(rect[1][2], z + 2);
         }
     }
-    rect[0][0] = max(rect[0][0], 0);
-    rect[0][1] = max(rect[0][1], 0);
-    rect[0][2] = max(rect[0][2], 0);
-    rect[1][0] = min(rect[1][0], N);
-    rect[1][1] = min(rect[1][1], N);
-    rect[1][2] = min(rect[1][2], N);
-
-    // Add up the contribution of each voxel to the vertices values.
+    rect[0][0] = max(rect[0][0], -border);
+    rect[0][1] = max(rect[0][1], -border);
+    rect[0][2] = max(rect[0][2], -border);
+    rect[1][0] = min(rect[1][0], N + border);
+    rect[1][1] = min(rect[1][1], N + border);
+    rect[1][2] = min(rect[1][2], N + border);
+}
+
+// Compute the triangles of a single cell, with their positions and colors.
+static int get_cell_triangles(const uint8_t *data, int x, int y, int z,
+                              bool flat, mc_vert_t (*tri)[3])
+{
+    int i, v, nb_tri;
+    int densities[8];
+    uint8_t tmp[4], c1[4], c2[4];
+
+    for (v = 0; v < 8; v++) {
+        get_at(data, x + VERTICES_POSITIONS[v][0],
+                     y + VERTICES_POSITIONS[v][1],
+                     z + VERTICES_POSITIONS[v][2],
+                     tmp);
+        densities[v] = tmp[3];
+    }
+    nb_tri = mc_compute(densities, tri);
+
+    for (i = 0; i < nb_tri; i++) {
+        for (v = 0; v < 3; v++) {
+            mc_interp_pos(&tri[i][v], tri[i][v].pos, flat);
+            get_at(data, x + VERTICES_POSITIONS[tri[i][v].v0][0],
+                         y + VERTICES_POSITIONS[tri[i][v].v0][1],
+                         z + VERTICES_POSITIONS[tri[i][v].v0][2],
+                         c1);
+            get_at(data, x + VERTICES_POSITIONS[tri[i][v].v1][0],
+                         y + VERTICES_POSITIONS[tri[i][v].v1][1],
+                         z + VERTICES_POSITIONS[tri[i][v].v1][2],
+                         c2);
+            memcpy(tri[i][v].color, c1[3] > c2[3] ? c1 : c2, 4);
+        }
+    }
+    if (flat) nb_tri = split_triangles(nb_tri, tri, tri);
+    return nb_tri;
+}
+
+#undef get_at
+
+static void set_vertex(voxel_vertex_t *out, const mc_vert_t *vert,
+                       int x, int y, int z, const float n[3])
+{
+    memset(out, 0, sizeof(*out));
+    memcpy(out->color, vert->color, sizeof(out->color));
+    out->color[3] = 255;
+    out->pos[0] = vert->pos[0] + x * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
+    out->pos[1] = vert->pos[1] + y * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
+    out->pos[2] = vert->pos[2] + z * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
+    out->normal[0] = n[0] * 64;
+    out->normal[1] = n[1] * 64;
+    out->normal[2] = n[2] * 64;
+}
+
+int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
+                              int effects, voxel_vertex_t *out,
+                              int *size, int *subdivide)
+{
+    int i, x, y, z, v, nb_tri, nb_tri_tot = 0;
+    uint8_t *data;
+    int rect[2][3];
+    mc_vert_t tri[30][3];
+    float n[3];
+    const bool flat = !(effects & EFFECT_MC_SMOOTH);
+
+    *size = 3;      // Triangles.
+    *subdivide = MC_VOXEL_SUB_POS;
+
+    // To speed things up we first get the voxel cube around the block.
+    data = malloc(D * D * D * 4);
+    read_data(mesh, block_pos, data);
+    get_rect(data, 0, rect);
+
     for (z = rect[0][2]; z < rect[1][2]; z++)
     for (y = rect[0][1]; y < rect[1][1]; y++)
     for (x = rect[0][0]; x < rect[1][0]; x++) {
-        memset(densities, 0, sizeof(densities));
-        for (v = 0; v < 8; v++) {
-            vx = x + VERTICES_POSITIONS[v][0];
-            vy = y + VERTICES_POSITIONS[v][1];
-            vz = z + VERTICES_POSITIONS[v][2];
-            get_at(data, vx, vy, vz, tmp);
-            densities[v] = tmp[3];
-        }
-        nb_tri = mc_compute(densities, tri);
-
+        nb_tri = get_cell_triangles(data, x, y, z, flat, tri);
         for (i = 0; i < nb_tri; i++) {
-            for (v = 0; v < 3; v++) {
-                mc_interp_pos(&tri[i][v], tri[i][v].pos, flat);
-                uint8_t c1[4], c2[4];
-                get_at(data, x + VERTICES_POSITIONS[tri[i][v].v0][0],
-                             y + VERTICES_POSITIONS[tri[i][v].v0][1],
-                             z + VERTICES_POSITIONS[tri[i][v].v0][2],
-                             c1);
-                get_at(data, x + VERTICES_POSITIONS[tri[i][v].v1][0],
-                             y + VERTICES_POSITIONS[tri[i][v].v1][1],
-                             z + VERTICES_POSITIONS[tri[i][v].v1][2],
-                             c2);
-                memcpy(tri[i][v].color, c1[3] > c2[3] ? c1 : c2, 4);
-            }
+            compute_triangle_normal(tri[i], n);
+            for (v = 0; v < 3; v++)
+                set_vertex(&out[nb_tri_tot * 3 + v], &tri[i][v], x, y, z, n);
+            nb_tri_tot++;
         }
-        if (flat) nb_tri = split_triangles(nb_tri, tri, tri);
+    }
+    free(data);
+    return nb_tri_tot;
+}
 
+// Return the key of the voxel edge of a marching cube vertex, unique in
+// the voxels cube around the block.
+static int get_edge_key(int x, int y, int z, const mc_vert_t *vert)
+{
+    const int *p0 = VERTICES_POSITIONS[vert->v0];
+    const int *p1 = VERTICES_POSITIONS[vert->v1];
+    int axis = (p0[0] != p1[0]) ? 0 : (p0[1] != p1[1]) ? 1 : 2;
+    x += min(p0[0], p1[0]) + 1;
+    y += min(p0[1], p1[1]) + 1;
+    z += min(p0[2], p1[2]) + 1;
+    return (x + y * D + z * D * D) * 3 + axis;
+}
+
+/*
+ * Indexed version of the smooth marching cube rendering.
+ *
+ * The vertices are shared by all the triangles attached to the same voxel
+ * edge, and get the area weighted average normal of those triangles.  To
+ * get the same normals on both sides of a block border, we also add the
+ * contribution of the triangles of the cells around the block.
+ */
+int mesh_generate_indexed_vertices_mc(const mesh_t *mesh,
+                                      const int block_pos[3],
+                                      int effects, voxel_vertex_t *out,
+                                      uint16_t *indices, int *nb_indices,
+                                      int *subdivide)
+{
+    int i, x, y, z, v, nb_tri, nb = 0, key, pass;
+    uint8_t *data;
+    uint16_t *edges;
+    float (*normals)[3];
+    int rect[2][3];
+    mc_vert_t tri[30][3];
+    float n[3];
+    bool inside;
+
+    assert(effects & EFFECT_MC_SMOOTH);
+    *nb_indices = 0;
+    *subdivide = MC_VOXEL_SUB_POS;
+
+    data = malloc(D * D * D * 4);
+    read_data(mesh, block_pos, data);
+    get_rect(data, 1, rect);
+
+    // Index + 1 of the vertex of each voxel edge.
+    edges = calloc(D * D * D * 3, sizeof(*edges));
+    // There is at most one vertex per edge of the block cells.
+    normals = malloc((N + 1) * (N + 1) * (N + 1) * 3 * sizeof(*normals));
+
+    // First pass for the block cells, second pass for the cells around
+    // it, that only add to the normals of the existing vertices.
+    for (pass = 0; pass < 2; pass++)
+    for (z = rect[0][2]; z < rect[1][2]; z++)
+    for (y = rect[0][1]; y < rect[1][1]; y++)
+    for (x = rect[0][0]; x < rect[1][0]; x++) {
+        inside = x >= 0 && x < N && y >= 0 && y < N && z >= 0 && z < N;
+        if (inside != (pass == 0)) continue;
+        nb_tri = get_cell_triangles(data, x, y, z, false, tri);
         for (i = 0; i < nb_tri; i++) {
-            compute_triangle_normal(tri[i], n);
+            compute_triangle_cross(tri[i], n);
             for (v = 0; v < 3; v++) {
-                vi = nb_tri_tot * 3 + v;
-                memcpy(out[vi].color, tri[i][v].color, sizeof(out[vi].color));
-                out[vi].color[3] = 255;
-                out[vi].pos[0] = tri[i][v].pos[0] + x * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].pos[1] = tri[i][v].pos[1] + y * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].pos[2] = tri[i][v].pos[2] + z * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].normal[0] = n[0] * 64;
-                out[vi].normal[1] = n[1] * 64;
-                out[vi].normal[2] = n[2] * 64;
-                // XXX: this shouldn't matter.
-                memset(out[vi].occlusion_uv, 0, sizeof(out[vi].occlusion_uv));
-                memset(out[vi].bump_uv, 0, sizeof(out[vi].bump_uv));
-                memset(out[vi].gradient, 0, sizeof(out[vi].gradient));
+                key = get_edge_key(x, y, z, &tri[i][v]);
+                if (!edges[key]) {
+                    if (!inside) continue;
+                    set_vertex(&out[nb], &tri[i][v], x, y, z, n);
+                    vec3_set(normals[nb], 0, 0, 0);
+                    edges[key] = ++nb;
+                }
+                vec3_iadd(normals[edges[key] - 1], n);
+                if (inside) indices[(*nb_indices)++] = edges[key] - 1;
             }
-            nb_tri_tot++;
         }
     }
+
+    for (i = 0; i < nb; i++) {
+        vec3_normalize(normals[i], normals[i]);
+        out[i].normal[0] = normals[i][0] * 64;
+        out[i].normal[1] = normals[i][1] * 64;
+        out[i].normal[2] = normals[i][2] * 64;
+    }
+
+    free(normals);
+    free(edges);
     free(data);
-    return nb_tri_tot;
+    return nb;
 }
 
 // Static data for marching cube algo.
@@ -267,7 +267,7 @@ bool mesh_get_bbox(const mesh_t *mesh, int bbox[2][3], bool exact)
             ret[0][2] = min(ret[0][2], block->pos[2]);
             ret[1][0] = max(ret[1][0], block->pos[0] + N);
             ret[1][1] = max(ret[1][1], block->pos[1] + N);
-            ret[1][2] = max(ret[1][2], block->pos[1] + N);
+            ret[1][2] = max(ret[1][2], block->pos[2] + N);
         }
     } else {
         iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
@@ -451,6 +451,13 @@ mesh_t *mesh_copy(const mesh_t *other)
     return mesh;
 }
 
+void mesh_unshare(mesh_t *mesh)
+{
+    uint64_t key = mesh->key;
+    mesh_prepare_write(mesh);
+    mesh->key = key; // The value didn't change.
+}
+
 void mesh_set(mesh_t *mesh, const mesh_t *other)
 {
     block_t *block, *tmp;
@@ -723,88 +730,188 @@ void mesh_read(const mesh_t *mesh,
                const int pos[3], const int size[3],
                uint8_t *data)
 {
-    // For the moment we only support the case where we get the rectangle
-    // of a block plus a one voxel border around it!
-    assert(pos[0] - (pos[0] & ~(int)(N - 1)) == N - 1);
-    assert(pos[1] - (pos[1] & ~(int)(N - 1)) == N - 1);
-    assert(pos[2] - (pos[2] & ~(int)(N - 1)) == N - 1);
-    assert(size[0] == N + 2);
-    assert(size[1] == N + 2);
-    assert(size[2] == N + 2);
-
-    block_t *block;
-    int block_pos[3] = {pos[0] + 1, pos[1] + 1, pos[2] + 1};
-    int i, z, y, x, dx, dy, dz, p[3];
-    uint8_t v[4];
-    mesh_accessor_t accessor;
+    const block_t *block;
+    int i, y, z, n, bpos[3], first[3], last[3];
 
     memset(data, 0, size[0] * size[1] * size[2] * 4);
-    block = mesh_get_block_at(mesh, block_pos, NULL);
-    if (!block) goto rest;
-
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        dx = x + 1;
-        dy = y + 1;
-        dz = z + 1;
-        memcpy(&data[(dz * size[1] * size[0] + dy * size[0] + dx) * 4],
-               &block->data->voxels[z * N * N + y * N + x],
-               4);
-    }
-
-rest:
-    // Fill the rest.
-    // In order to optimize access, we iter in such a way to avoid changing
-    // the current block: start with the planes, then the edges, and finally
-    // the 8 corners.
-    accessor = mesh_get_accessor(mesh);
-    const int ranges[26][3][2] = {
-        // 6 planes.
-        {{0,         1}, {1,     N + 1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 1}},
-        {{1,     N + 1}, {0,         1}, {1,     N + 1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{1,     N + 1}, {1,     N + 1}, {0,         1}},
-        {{1,     N + 1}, {1,     N + 1}, {N + 1, N + 2}},
-        // 4 edges moving along X.
-        {{1,     N + 1}, {0,         1}, {0,         1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {0,         1}},
-        {{1,     N + 1}, {0,         1}, {N + 1, N + 2}},
-        {{1,     N + 1}, {N + 1, N + 2}, {N + 1, N + 2}},
-        // 4 edges moving along Y.
-        {{0,         1}, {1,     N + 1}, {0,         1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {0,         1}},
-        {{0,         1}, {1,     N + 1}, {1,     N + 2}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 2}},
-        // 4 edges moving along Z.
-        {{0,         1}, {0,         1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {0,         1}, {1,     N + 1}},
-        {{0,         1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {1,     N + 1}},
-        // 8 Corners.
-        {{0,     1    }, {0,     1    }, {0,     1    }},
-        {{N + 1, N + 2}, {0,     1    }, {0,     1    }},
-        {{0,     1    }, {N + 1, N + 2}, {0,     1    }},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {0,     1    }},
-        {{0,     1    }, {0,     1    }, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {0,     1    }, {N + 1, N + 2}},
-        {{0,     1    }, {N + 1, N + 2}, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {N + 1, N + 2}},
-    };
+    // Copy the rows of each block intersecting the box.
+    for (bpos[2] = pos[2] & ~(int)(N - 1); bpos[2] < pos[2] + size[2];
+         bpos[2] += N)
+    for (bpos[1] = pos[1] & ~(int)(N - 1); bpos[1] < pos[1] + size[1];
+         bpos[1] += N)
+    for (bpos[0] = pos[0] & ~(int)(N - 1); bpos[0] < pos[0] + size[0];
+         bpos[0] += N) {
+        block = mesh_get_block_at(mesh, bpos, NULL);
+        if (!block) continue;
+        for (i = 0; i < 3; i++) {
+            first[i] = max(pos[i], bpos[i]);
+            last[i] = min(pos[i] + size[i], bpos[i] + N);
+        }
+        n = last[0] - first[0];
+        for (z = first[2]; z < last[2]; z++)
+        for (y = first[1]; y < last[1]; y++) {
+            memcpy(&data[(((z - pos[2]) * size[1] + (y - pos[1])) * size[0] +
+                          (first[0] - pos[0])) * 4],
+                   block->data->voxels[(first[0] - bpos[0]) +
+                                       (y - bpos[1]) * N +
+                                       (z - bpos[2]) * N * N],
+                   n * 4);
+        }
+    }
+}
+
+
+/*
+ * Simple 3D DDA state, used to walk along a ray in a grid of cubic cells.
+ * The cells are identified by the position of their lower corner.
+ */
+typedef struct {
+    int     pos[3];     // Current cell.
+    int     step[3];
+    int     size;       // Size of the cells.
+    float   t_max[3];   // Distance of the next boundary on each axis.
+    float   t_delta[3];
+    float   t;          // Distance at which we entered the current cell.
+    int     axis;       // Axis we crossed to enter the cell, or -1.
+} dda_t;
+
+static void dda_init(dda_t *dda, const float o[3], const float d[3],
+                     float t, int size, int axis)
+{
+    int i;
+    float p;
+
+    dda->size = size;
+    dda->t = t;
+    dda->axis = axis;
+    for (i = 0; i < 3; i++) {
+        dda->step[i] = d[i] >= 0 ? +1 : -1;
+        p = (o[i] + d[i] * t) / size;
+        // Avoid rounding errors on the axis we just crossed.
+        if (i == axis)
+            p = d[i] > 0 ? round(p) : round(p) - 1;
+        dda->pos[i] = (int)floor(p) * size;
+        if (d[i] == 0) {
+            dda->t_max[i] = INFINITY;
+            dda->t_delta[i] = INFINITY;
+            continue;
+        }
+        dda->t_delta[i] = size / fabs(d[i]);
+        dda->t_max[i] =
+            (dda->pos[i] + (d[i] > 0 ? size : 0) - o[i]) / d[i];
+    }
+}
+
+static void dda_next(dda_t *dda)
+{
+    int i = 0;
+    if (dda->t_max[1] < dda->t_max[i]) i = 1;
+    if (dda->t_max[2] < dda->t_max[i]) i = 2;
+    dda->t = dda->t_max[i];
+    dda->pos[i] += dda->step[i] * dda->size;
+    dda->t_max[i] += dda->t_delta[i];
+    dda->axis = i;
+}
 
-    for (i = 0; i < 26; i++)
-    for (z = ranges[i][2][0]; z < ranges[i][2][1]; z++)
-    for (y = ranges[i][1][0]; y < ranges[i][1][1]; y++)
-    for (x = ranges[i][0][0]; x < ranges[i][0][1]; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        mesh_get_at(mesh, &accessor, p, v);
-        memcpy(&data[(z * size[1] * size[0] + y * size[0] + x) * 4], v, 4);
+// Compute the intersection of a ray with a box.  Return the axis of the
+// entry face (or -1 if we start inside).
+static bool ray_bbox(const int bbox[2][3], const float o[3],
+                     const float d[3], float *t0, float *t1, int *axis)
+{
+    int i;
+    float a, b, tmp;
+
+    if (bbox[0][0] >= bbox[1][0]) return false;
+
+    *t0 = 0;
+    *t1 = INFINITY;
+    *axis = -1;
+    for (i = 0; i < 3; i++) {
+        if (d[i] == 0) {
+            if (o[i] < bbox[0][i] || o[i] > bbox[1][i]) return false;
+            continue;
+        }
+        a = (bbox[0][i] - o[i]) / d[i];
+        b = (bbox[1][i] - o[i]) / d[i];
+        if (a > b) {
+            tmp = a;
+            a = b;
+            b = tmp;
+        }
+        if (a > *t0) {
+            *t0 = a;
+            *axis = i;
+        }
+        *t1 = min(*t1, b);
     }
+    return *t0 <= *t1;
 }
 
+bool mesh_raycast(const mesh_t *mesh, const float origin[3],
+                  const float dir[3], int pos[3], int normal[3])
+{
+    block_t *block;
+    int i, bbox[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                         {INT_MIN, INT_MIN, INT_MIN}};
+
+    // Box of all the non empty blocks.
+    for (block = mesh->blocks; block; block = block->hh.next) {
+        if (!block->data->id) continue;
+        for (i = 0; i < 3; i++) {
+            bbox[0][i] = min(bbox[0][i], block->pos[i]);
+            bbox[1][i] = max(bbox[1][i], block->pos[i] + N);
+        }
+    }
+    return mesh_raycast_in_bbox(mesh, bbox, origin, dir, pos, normal);
+}
+
+bool mesh_raycast_in_bbox(const mesh_t *mesh, const int bbox[2][3],
+                          const float origin[3], const float dir[3],
+                          int pos[3], int normal[3])
+{
+    dda_t bdda, vdda;
+    block_t *block;
+    float t0, t1;
+    int i, axis, p[3];
+    const uint8_t *v;
+
+    if (!ray_bbox(bbox, origin, dir, &t0, &t1, &axis)) return false;
+
+    // First walk the blocks, then the voxels inside the non empty ones.
+    dda_init(&bdda, origin, dir, t0, N, axis);
+    for (; bdda.t <= t1; dda_next(&bdda)) {
+        HASH_FIND(hh, mesh->blocks, bdda.pos, sizeof(bdda.pos), block);
+        if (!block || !block->data->id) continue;
+        dda_init(&vdda, origin, dir, bdda.t, 1, bdda.axis);
+        for (i = 0; i < 3; i++) {
+            vdda.pos[i] = min(max(vdda.pos[i], block->pos[i]),
+                              block->pos[i] + N - 1);
+        }
+        while (true) {
+            for (i = 0; i < 3; i++) {
+                p[i] = vdda.pos[i] - block->pos[i];
+                if (p[i] < 0 || p[i] >= N) break;
+            }
+            if (i < 3) break; // Out of the block.
+            v = BLOCK_AT(block, p[0], p[1], p[2]);
+            if (v[3] >= 127) goto hit;
+            dda_next(&vdda);
+        }
+    }
+    return false;
+
+hit:
+    memcpy(pos, vdda.pos, sizeof(vdda.pos));
+    memset(normal, 0, 3 * sizeof(int));
+    axis = vdda.axis;
+    if (axis == -1) { // We started inside a voxel.
+        axis = 0;
+        if (fabs(dir[1]) > fabs(dir[axis])) axis = 1;
+        if (fabs(dir[2]) > fabs(dir[axis])) axis = 2;
+    }
+    normal[axis] = dir[axis] > 0 ? -1 : +1;
+    return true;
+}
 
 void mesh_get_global_stats(mesh_global_stats_t *stats)
 {
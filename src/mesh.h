@@ -112,6 +112,17 @@ static inline void mesh_get_block_aabb(const int pos[3], int aabb[2][3])
 
 mesh_t *mesh_copy(const mesh_t *mesh);
 
+/*
+ * Function: mesh_unshare
+ * Give a mesh its own blocks, after a <mesh_copy>.
+ *
+ * The blocks still share their voxels data, but writing into the other
+ * copies won't modify anything that the mesh reads.  This allows to read
+ * the mesh from an other thread, as long as it is deleted from the main
+ * thread, since the data reference counts are not atomic.
+ */
+void mesh_unshare(mesh_t *mesh);
+
 void mesh_set(mesh_t *mesh, const mesh_t *other);
 
 mesh_accessor_t mesh_get_accessor(const mesh_t *mesh);
@@ -221,10 +232,58 @@ void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *accessor,
 void mesh_copy_block(const mesh_t *src, const int src_pos[3],
                      mesh_t *dst, const int dst_pos[3]);
 
+/*
+ * Function: mesh_read
+ * Copy the voxels of a box of the mesh into a buffer.
+ *
+ * This copies directly the rows of the blocks intersecting the box, so it
+ * is much faster than calling mesh_get_at for each voxel.
+ *
+ * Parameters:
+ *   mesh - The mesh.
+ *   pos  - Position of the first voxel of the box.
+ *   size - Size of the box.
+ *   data - Output RGBA values, with the x coordinate varying first.
+ */
 void mesh_read(const mesh_t *mesh,
                const int pos[3], const int size[3],
                uint8_t *data);
 
+/*
+ * Function: mesh_raycast
+ * Find the first visible voxel hit by a ray.
+ *
+ * We walk the ray along the blocks first, and only check the voxels of
+ * the non empty blocks.  Like for the rendering, voxels with an alpha
+ * value lower than 127 are considered invisible.
+ *
+ * Parameters:
+ *   mesh   - The mesh.
+ *   origin - Origin of the ray.
+ *   dir    - Direction of the ray.
+ *   pos    - Output position of the hit voxel.
+ *   normal - Output normal of the voxel face hit by the ray.
+ *
+ * Return:
+ *   true if a voxel was hit.
+ */
+bool mesh_raycast(const mesh_t *mesh, const float origin[3],
+                  const float dir[3], int pos[3], int normal[3]);
+
+/*
+ * Function: mesh_raycast_in_bbox
+ * Same as <mesh_raycast>, but only check the voxels inside a given box.
+ *
+ * Use this when casting many rays into the same mesh, since
+ * <mesh_raycast> has to compute the box of the mesh blocks each time.
+ *
+ * Parameters:
+ *   bbox   - The box, for example as returned by <mesh_get_bbox>.
+ */
+bool mesh_raycast_in_bbox(const mesh_t *mesh, const int bbox[2][3],
+                          const float origin[3], const float dir[3],
+                          int pos[3], int normal[3]);
+
 typedef struct {
     int       nb_meshes;
     int       nb_blocks;
@@ -24,7 +24,19 @@ static const int N = BLOCK_SIZE;
 // Implemented in marchingcube.c
 int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
                               int effects, voxel_vertex_t *out,
-                              int *size, int *pos_scale);
+                              int *size, int *subdivide);
+
+int mesh_generate_indexed_vertices_mc(const mesh_t *mesh,
+                                      const int block_pos[3],
+                                      int effects, voxel_vertex_t *out,
+                                      uint16_t *indices, int *nb_indices,
+                                      int *subdivide);
+
+// Implemented in surfacenets.c
+int mesh_generate_vertices_sn(const mesh_t *mesh, const int block_pos[3],
+                              int effects, voxel_vertex_t *out,
+                              uint16_t *indices, int *nb_indices,
+                              int *subdivide);
 
 static bool block_is_face_visible(uint32_t neighboors_mask, int f)
 {
@@ -209,9 +221,34 @@ static uint16_t get_pos_data(uint16_t x, uint16_t y, uint16_t z, uint16_t f)
 }
 
 
-int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
-                           int effects, voxel_vertex_t *out,
-                           int *size, int *subdivide)
+/*
+ * Pack a gradient into 3 x 5 bits, with each component in the range
+ * [-15, +15] stored with a bias of 16.
+ *
+ * The shader only uses the gradient direction, so we scale it so that the
+ * largest component is 15.  This way the small gradients (like the +/- 1
+ * fallback from the faces normals) don't get quantized to zero, that
+ * would give a NaN normal.
+ */
+static uint16_t pack_gradient(const int8_t gradient[3])
+{
+    int i, v, m = 0;
+    uint16_t ret = 0;
+    for (i = 0; i < 3; i++) m = max(m, abs(gradient[i]));
+    for (i = 0; i < 3; i++) {
+        v = m ? (int)round(gradient[i] * 15.0 / m) + 16 : 16;
+        ret |= v << (i * 5);
+    }
+    return ret;
+}
+
+/*
+ * Generate the cubes vertices of a block, either in the full or the packed
+ * format, depending on which output array is set.
+ */
+static int generate_vertices(const mesh_t *mesh, const int block_pos[3],
+                             voxel_vertex_t *out,
+                             voxel_vertex_packed_t *packed)
 {
     int x, y, z, f;
     int i, nb = 0;
@@ -222,13 +259,8 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
     int8_t normal[3], tangent[3], gradient[3];
     int pos[3];
     const int *vpos;
-
-    if (effects & EFFECT_MARCHING_CUBES)
-        return mesh_generate_vertices_mc(mesh, block_pos, effects, out,
-                                         size, subdivide);
-
-    *size = 4;      // Quad.
-    *subdivide = 1; // Unit is one voxel.
+    voxel_vertex_packed_t *p;
+    uint16_t packed_gradient = 0;
 
     // To speed things up we first get the voxel cube around the block.
     // XXX: can we do this while still using mesh iterators somehow?
@@ -253,8 +285,22 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
             block_get_gradient(neighboors_mask, neighboors, f, gradient);
             shadow_mask = block_get_shadow_mask(neighboors_mask, f);
             borders_mask = block_get_border_mask(neighboors_mask, f);
+            if (packed) packed_gradient = pack_gradient(gradient);
             for (i = 0; i < 4; i++) {
                 vpos = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
+                if (packed) {
+                    p = &packed[nb * 4 + i];
+                    p->pos[0] = x + vpos[0];
+                    p->pos[1] = y + vpos[1];
+                    p->pos[2] = z + vpos[2];
+                    p->face_corner = f * 4 + i;
+                    memcpy(p->color, v, sizeof(v));
+                    p->color[3] = p->color[3] ? 255 : 0;
+                    p->shadow_mask = shadow_mask;
+                    p->borders_mask = borders_mask;
+                    p->gradient = packed_gradient;
+                    continue;
+                }
                 out[nb * 4 + i].pos[0] = x + vpos[0];
                 out[nb * 4 + i].pos[1] = y + vpos[1];
                 out[nb * 4 + i].pos[2] = z + vpos[2];
@@ -282,3 +328,64 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
     return nb;
 }
 
+// Generate unindexed triangles from the smooth meshers.
+static int generate_triangles(const mesh_t *mesh, const int block_pos[3],
+                              int effects, voxel_vertex_t *out,
+                              int *subdivide)
+{
+    voxel_vertex_t *verts;
+    uint16_t *indices;
+    int i, nb_indices;
+
+    verts = malloc(MESH_BLOCK_MAX_VERTICES * sizeof(*verts));
+    indices = malloc(MESH_BLOCK_MAX_VERTICES * sizeof(*indices));
+    mesh_generate_indexed_vertices(mesh, block_pos, effects, verts,
+                                   indices, &nb_indices, subdivide);
+    for (i = 0; i < nb_indices; i++)
+        out[i] = verts[indices[i]];
+    free(verts);
+    free(indices);
+    return nb_indices / 3;
+}
+
+int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
+                           int effects, voxel_vertex_t *out,
+                           int *size, int *subdivide)
+{
+    if (mesh_use_indexed_vertices(effects)) {
+        *size = 3;
+        return generate_triangles(mesh, block_pos, effects, out, subdivide);
+    }
+    if (effects & EFFECT_MARCHING_CUBES)
+        return mesh_generate_vertices_mc(mesh, block_pos, effects, out,
+                                         size, subdivide);
+
+    *size = 4;      // Quad.
+    *subdivide = 1; // Unit is one voxel.
+    return generate_vertices(mesh, block_pos, out, NULL);
+}
+
+int mesh_generate_vertices_packed(const mesh_t *mesh, const int block_pos[3],
+                                  voxel_vertex_packed_t *out)
+{
+    return generate_vertices(mesh, block_pos, NULL, out);
+}
+
+int mesh_generate_indexed_vertices(const mesh_t *mesh, const int block_pos[3],
+                                   int effects, voxel_vertex_t *out,
+                                   uint16_t *indices, int *nb_indices,
+                                   int *subdivide)
+{
+    assert(mesh_use_indexed_vertices(effects));
+    if (effects & EFFECT_SURFACE_NETS)
+        return mesh_generate_vertices_sn(mesh, block_pos, effects, out,
+                                         indices, nb_indices, subdivide);
+    return mesh_generate_indexed_vertices_mc(mesh, block_pos, effects, out,
+                                             indices, nb_indices, subdivide);
+}
+
+bool mesh_use_indexed_vertices(int effects)
+{
+    if (effects & EFFECT_SURFACE_NETS) return true;
+    return (effects & EFFECT_MARCHING_CUBES) && (effects & EFFECT_MC_SMOOTH);
+}
@@ -282,6 +282,7 @@ void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
     painter_t painter2;
     float box2[4][4];
     int aabb[2][3];
+    PROFILER_SCOPE("mesh_op");
     mesh_t *cached;
     static cache_t *cache = NULL;
     const float *sym_o = painter->symmetry_origin;
@@ -462,6 +463,7 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
     mesh_iterator_t iter;
     int bpos[3];
     uint64_t id1, id2;
+    PROFILER_SCOPE("mesh_merge");
 
     // Check if the merge op has been cached.
     if (!cache) cache = cache_create(512);
@@ -489,6 +491,119 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
     cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
 }
 
+// Half resolution version of a block, that fills an octant of a block of
+// the downsampled mesh.
+typedef struct {
+    bool    empty;
+    uint8_t voxels[N * N * N / 8][4];
+} octant_t;
+
+static int octant_del(void *data)
+{
+    free(data);
+    return 0;
+}
+
+/*
+ * Return the downsampled octant of a block, or NULL if it is empty.
+ *
+ * The octants are cached by block data id, so that after an edit we only
+ * recompute the blocks that changed.
+ */
+static const octant_t *get_octant(const uint8_t (*data)[4], uint64_t id)
+{
+    int i, x, y, z, dx, dy, dz, w, color[3];
+    const uint8_t *v;
+    uint8_t *value;
+    octant_t *octant;
+    static cache_t *cache = NULL;
+
+    if (!id) return NULL;
+    if (!cache) cache = cache_create(64 * MB);
+    octant = cache_get(cache, &id, sizeof(id));
+    if (octant) goto end;
+
+    octant = calloc(1, sizeof(*octant));
+    octant->empty = true;
+    for (z = 0; z < N / 2; z++)
+    for (y = 0; y < N / 2; y++)
+    for (x = 0; x < N / 2; x++) {
+        value = octant->voxels[x + y * N / 2 + z * N * N / 4];
+        memset(color, 0, sizeof(color));
+        w = 0;
+        for (dz = 0; dz < 2; dz++)
+        for (dy = 0; dy < 2; dy++)
+        for (dx = 0; dx < 2; dx++) {
+            v = data[(x * 2 + dx) + (y * 2 + dy) * N + (z * 2 + dz) * N * N];
+            if (!v[3]) continue;
+            value[3] = max(value[3], v[3]);
+            for (i = 0; i < 3; i++) color[i] += v[i] * v[3];
+            w += v[3];
+        }
+        if (!value[3]) continue;
+        for (i = 0; i < 3; i++) value[i] = color[i] / w;
+        octant->empty = false;
+    }
+    cache_add(cache, &id, sizeof(id), octant, sizeof(*octant), octant_del);
+
+end:
+    return octant->empty ? NULL : octant;
+}
+
+// Check if all the voxels of a block of a mesh are transparent.
+static bool block_is_transparent(const mesh_t *mesh, const int bpos[3])
+{
+    int i;
+    const uint8_t (*data)[4];
+    data = mesh_get_block_data(mesh, NULL, bpos, NULL);
+    if (!data) return true;
+    for (i = 0; i < N * N * N; i++)
+        if (data[i][3]) return false;
+    return true;
+}
+
+void mesh_downsample(const mesh_t *mesh, const mesh_t *prev, mesh_t *out)
+{
+    mesh_iterator_t iter;
+    mesh_accessor_t accessor;
+    int i, x, y, z, bpos[3], pos[3], p[3];
+    uint64_t id, prev_id;
+    const uint8_t (*data)[4];
+    const octant_t *octant;
+    const uint8_t zero[4] = {0};
+
+    if (prev)
+        iter = mesh_get_union_iterator(mesh, prev, MESH_ITER_BLOCKS);
+    else
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    accessor = mesh_get_accessor(out);
+    while (mesh_iter(&iter, bpos)) {
+        data = mesh_get_block_data(mesh, NULL, bpos, &id);
+        if (prev) {
+            mesh_get_block_data(prev, NULL, bpos, &prev_id);
+            if (id == prev_id) continue;
+        }
+        octant = get_octant(data, id);
+        // Position of the octant in the output mesh: since the block
+        // position is a multiple of N, this is the floor division by two.
+        for (i = 0; i < 3; i++) {
+            pos[i] = bpos[i] >> 1;
+            p[i] = pos[i] & ~(int)(N - 1);
+        }
+        if (!octant && !mesh_get_block_data(out, NULL, p, NULL)) continue;
+        for (z = 0; z < N / 2; z++)
+        for (y = 0; y < N / 2; y++)
+        for (x = 0; x < N / 2; x++) {
+            mesh_set_at(out, &accessor,
+                        (int[]){pos[0] + x, pos[1] + y, pos[2] + z},
+                        octant ? octant->voxels[x + y * N / 2 +
+                                                z * N * N / 4] : zero);
+        }
+        if (!octant && block_is_transparent(out, p))
+            mesh_clear_block(out, &accessor, p);
+    }
+}
+
 void mesh_crop(mesh_t *mesh, const float box[4][4])
 {
     painter_t painter = {
@@ -66,6 +66,26 @@ typedef struct voxel_vertex
     uint8_t  bump_uv[2]                 __attribute__((aligned(4)));
 } voxel_vertex_t;
 
+/*
+ * Type: voxel_vertex_packed_t
+ * Compact version of voxel_vertex_t for the cubes rendering (12 bytes
+ * instead of 36).
+ *
+ * The normal, tangent and uv are reconstructed in the shader from the
+ * face and corner index, and the occlusion and bump texture coordinates
+ * from the shadow and borders masks.  The gradient is stored as three
+ * 5 bits values with a bias of 16.
+ */
+typedef struct voxel_vertex_packed
+{
+    uint8_t  pos[3];
+    uint8_t  face_corner;   // face * 4 + corner.
+    uint8_t  color[4];
+    uint8_t  shadow_mask;
+    uint8_t  borders_mask;
+    uint16_t gradient;
+} voxel_vertex_packed_t;
+
 
 // Type: painter_t
 // The painting context, including the tool, brush, mode, radius,
@@ -157,6 +177,37 @@ int mesh_select(const mesh_t *mesh,
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
                 const uint8_t color[4]);
 
+/*
+ * Function: mesh_downsample
+ * Create a half resolution version of a mesh.
+ *
+ * Each output voxel at position p is computed from the 2x2x2 input voxels
+ * starting at 2p: the alpha is the maximum of the input alphas, and the
+ * color is the alpha weighted average of the input colors.
+ *
+ * The half resolution version of each input block is cached by block id,
+ * and if we pass the previous version of the input, only the blocks that
+ * changed since are updated in the output.
+ *
+ * Parameters:
+ *   mesh   - The input mesh.
+ *   prev   - The previous input mesh, already downsampled into out, or
+ *            NULL if out is empty.
+ *   out    - The output mesh.
+ */
+void mesh_downsample(const mesh_t *mesh, const mesh_t *prev, mesh_t *out);
+
+/*
+ * Define: MESH_BLOCK_MAX_VERTICES
+ * Size of a vertex array large enough for the output of
+ * <mesh_generate_vertices> with any block.
+ *
+ * The cube rendering can output at most half the block voxels with six
+ * quads each, but the flat marching cube rendering can split each cell into
+ * up to 30 triangles.
+ */
+#define MESH_BLOCK_MAX_VERTICES (BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 30 * 3)
+
 /*
  * Function: mesh_generate_vertices
  * Generate a vertice array for rendering a mesh block.
@@ -165,7 +216,8 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
  *   mesh       - Input mesh.
  *   block_pos  - Position of the mesh block to render.
  *   effects    - Effect flags.
- *   out        - Output array.
+ *   out        - Output array, of at least <MESH_BLOCK_MAX_VERTICES>
+ *                elements.
  *   size       - Output the size of a single face.
  *                4 for quads and 3 for triangles.  Normal mesh uses quad
  *                but marching cube effect return triangle arrays.
@@ -177,6 +229,54 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
                            int effects, voxel_vertex_t *out,
                            int *size, int *subdivide);
 
+/*
+ * Function: mesh_generate_vertices_packed
+ * Same as <mesh_generate_vertices> for the cubes rendering, but using the
+ * compact vertex format.
+ *
+ * Return:
+ *   The number of quads generated.
+ */
+int mesh_generate_vertices_packed(const mesh_t *mesh, const int block_pos[3],
+                                  voxel_vertex_packed_t *out);
+
+/*
+ * Function: mesh_generate_indexed_vertices
+ * Generate an indexed triangles array for rendering a mesh block.
+ *
+ * Only supported by the smooth renderings (see
+ * <mesh_use_indexed_vertices>), where the vertices are shared between the
+ * triangles.
+ *
+ * Parameters:
+ *   mesh       - Input mesh.
+ *   block_pos  - Position of the block to render.
+ *   effects    - Effect flags.
+ *   out        - Output vertices, at least <MESH_BLOCK_MAX_VERTICES>.
+ *   indices    - Output triangles indices, at least
+ *                <MESH_BLOCK_MAX_VERTICES>.
+ *   nb_indices - Output number of indices.
+ *   subdivide  - Output unit per voxel of the vertices positions.
+ *
+ * Return:
+ *   The number of vertices generated.
+ */
+int mesh_generate_indexed_vertices(const mesh_t *mesh, const int block_pos[3],
+                                   int effects, voxel_vertex_t *out,
+                                   uint16_t *indices, int *nb_indices,
+                                   int *subdivide);
+
+/*
+ * Function: mesh_use_indexed_vertices
+ * Check if a rendering effects uses indexed vertices.
+ *
+ * This is the case for the surface nets and smooth marching cubes
+ * rendering.  For those, <mesh_generate_indexed_vertices> should be used
+ * rather than <mesh_generate_vertices>, that would duplicate the shared
+ * vertices.
+ */
+bool mesh_use_indexed_vertices(int effects);
+
 // XXX: use int[2][3] for the box?
 void mesh_crop(mesh_t *mesh, const float box[4][4]);
 
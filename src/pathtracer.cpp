@@ -32,6 +32,7 @@
 #define STB_IMAGE_STATIC
 
 #include "../ext_src/yocto/yocto_bvh.h"
+#include "../ext_src/yocto/yocto_image.h"
 #include "../ext_src/yocto/yocto_scene.h"
 #include "../ext_src/yocto/yocto_trace.h"
 
@@ -39,11 +40,17 @@
 #pragma GCC diagnostic pop
 #endif
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
 #include <iterator>
+#include <condition_variable>
 #include <future>
 #include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
 
 extern "C" {
 #include "goxel.h"
@@ -66,6 +73,182 @@ enum {
     CHANGE_MATERIAL     = 1 << 7,
 };
 
+/*
+ * Key of the shape generated for a mesh block.  As in the renderer, the
+ * shape depends on the data of the block and of its 26 neighbors.
+ *
+ * We use a hash of the blocks content rather than the data ids, and the
+ * shapes are in the block local space, so all the blocks with the same
+ * content and neighbors (like in walls or floors) share the same shape.
+ */
+struct block_key_t {
+    uint64_t hashes[27];
+    int      effects;
+
+    bool operator==(const block_key_t &other) const {
+        return memcmp(this, &other, sizeof(*this)) == 0;
+    }
+};
+
+struct block_key_hash {
+    size_t operator()(const block_key_t &key) const {
+        return XXH32(&key, sizeof(key), 0);
+    }
+};
+
+struct block_shape_t {
+    int          shape; // Index in the scene shapes, or -1 if empty.
+    unsigned int gen;   // Last sync that used this shape.
+};
+
+// Content hash of a block data.
+struct data_hash_t {
+    uint64_t     hash;
+    unsigned int gen;   // Last sync that used this data.
+};
+
+// Minimum number of samples batches before we consider a tile converged.
+#define NOISE_MIN_BATCHES 4
+
+// Number of low resolution passes rendered first when the camera moves,
+// at 1/8, 1/4 and 1/2 of the full resolution.
+#define PREVIEW_LEVELS 3
+
+// Number of passes of the denoiser filter, each pass doubles its size.
+#define DENOISE_PASSES 5
+// Minimum time in seconds between two denoising while rendering.
+#define DENOISE_DELAY 0.1
+
+/*
+ * Voxel grid of a block shape, to intersect the rays with a DDA traversal
+ * of the block voxels instead of a bvh of the quads.
+ *
+ * We only store a bit mask of the voxels that have some faces, and for
+ * each of them the index of its first quad.  This works because the cubes
+ * mesher generates the quads voxel by voxel, in the same order as the
+ * mask bits.
+ */
+#define GRID_SIZE (BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE)
+struct voxel_grid_t {
+    bool             enabled;
+    uint64_t         mask[GRID_SIZE / 64];
+    uint16_t         rank[GRID_SIZE / 64]; // Number of bits before each word.
+    vector<uint16_t> first;     // First quad of each voxel, plus the total.
+    vector<uint8_t>  faces;     // Face of each quad: axis * 2 + (n > 0).
+    const yocto_shape *shape;
+};
+
+/*
+ * The render is split into tiles (the yocto image regions), each traced
+ * one samples batch at a time by a persistent pool of threads.
+ */
+struct tile_t {
+    int          region;    // Index in the regions list.
+    int          sample;    // Number of samples already traced.
+    unsigned int job;       // Id of the render job of the tile.
+    int          level;     // Preview level, or PREVIEW_LEVELS.
+};
+
+// Tiles queue of a worker.  The worker takes the tiles from the front, and
+// the other workers steal from the back once their own queue is empty.
+struct tile_queue_t {
+    std::mutex      mutex;
+    deque<tile_t>   tiles;
+};
+
+/*
+ * Lock free ring buffer of the completed regions, filled by the workers
+ * and emptied by the UI thread.  This is a bounded multi producers queue
+ * where each cell has a sequence number telling if it is ready to be
+ * written or read.
+ */
+struct tile_ring_t {
+    struct cell_t {
+        atomic<size_t> seq;
+        image_region   region;
+        bool           converted; // Already in the display buffer.
+    };
+    unique_ptr<cell_t[]> cells;
+    size_t               mask;
+    atomic<size_t>       head;  // Next cell to write.
+    atomic<size_t>       tail;  // Next cell to read.
+    atomic<bool>         overflow; // Set if we dropped some regions.
+};
+
+/*
+ * Luminance statistics of the samples batches of a pixel, used to estimate
+ * the noise: we consider each batch mean as one measure of the pixel value,
+ * and compute the standard error of the mean of all the batches.
+ */
+struct pixel_stats_t {
+    float   last;   // Luminance sum of the previous batches samples.
+    float   sum;    // Sum of the batches mean luminance.
+    float   sum2;   // Sum of the squared batches mean luminance.
+    int     n;      // Number of batches.
+};
+
+// A low resolution pass, traced with a single sample per pixel.
+struct preview_t {
+    image4f                 image;
+    trace_state             state;
+    vector<image_region>    regions;
+    atomic<int>             remaining;  // Number of tiles left to trace.
+};
+
+/*
+ * Task that the workers run on ranges of rows, in priority over the
+ * tiles, see pool_run_rows.
+ */
+struct rows_task_t {
+    std::function<void(int, int)>   func;
+    int                             h;
+    int                             chunk;  // Number of rows per call.
+    atomic<int>                     next;   // First row not taken yet.
+    atomic<int>                     users;  // Workers running the task.
+};
+
+/*
+ * Copy of the traced pixels, updated by the workers after each samples
+ * batch of a tile, so that the denoiser and the display refresh never
+ * read the pixels being traced.  The mutex also protects the display
+ * buffer.
+ */
+struct snapshot_t {
+    std::mutex              mutex;
+    image4f                 image;
+    vector<int>             samples;
+    vector<float>           noise;      // Pixels noise, for the heatmap.
+    yocto::image<vec3f>     albedo;
+    yocto::image<vec3f>     normal;
+};
+
+/*
+ * Planar buffers of the denoiser, so that the filter loops can be
+ * vectorized.
+ */
+struct denoiser_t {
+    int             w, h;
+    vector<float>   color[2][4];    // Two RGBA buffers, for the passes.
+    vector<float>   lum;            // Luminance of the pass input.
+    vector<float>   guide[6];       // Normal and albedo.
+    vector<float>   weight;         // Samples / 16, see denoise_pass.
+};
+
+struct trace_pool_t {
+    vector<std::thread>         threads;
+    unique_ptr<tile_queue_t[]>  queues; // One per thread.
+    std::mutex                  mutex;  // For the condition variables.
+    std::condition_variable     wake;   // Some tiles have been queued.
+    std::condition_variable     idle;   // No more pending tiles.
+    // Cancellation token: the tiles of older jobs get dropped.
+    atomic<unsigned int>        job;
+    atomic<int>                 queued;  // Number of tiles in the queues.
+    atomic<int>                 pending; // Queued or running tiles.
+    atomic<bool>                cancel;  // Abort the running tiles.
+    atomic<rows_task_t*>        task;    // Set with the mutex locked.
+    bool                        quit;
+};
+
 struct pathtracer_internal {
 
     // Different hash keys to quickly check for state changes.
@@ -78,32 +261,52 @@ struct pathtracer_internal {
 
     yocto_scene scene;
     bvh_scene bvh;
+
+    // Cache of the blocks shapes, so that after an edit we only regenerate
+    // the shapes of the modified blocks.
+    unordered_map<block_key_t, block_shape_t, block_key_hash> blocks;
+    unordered_map<uint64_t, data_hash_t> data_hashes; // Indexed by data id.
+    unsigned int blocks_gen;
+    vector<int> free_shapes;    // Unused slots in scene.shapes.
+    vector<voxel_grid_t> grids; // Voxel grid of each shape, if enabled.
+    bool no_voxels;             // Use a bvh for all the shapes.
+    vector<int> dirty_shapes;   // Shapes whose bvh needs to be rebuilt.
     image4f image;
-    image4f display;
+    uint8_t *buf;               // Copy of pt->buf.
+    // Denoiser guide buffers: albedo and normal of the first hit of each
+    // pixel.
+    yocto::image<vec3f> albedo;
+    yocto::image<vec3f> normal;
+    snapshot_t snapshot;
+    denoiser_t denoiser;
+    image4f denoised;
+    bool denoise;               // Copy of pt->denoise.
+    bool denoise_dirty;         // Set when the image changed.
+    double denoise_time;        // Time of the last denoising.
     trace_state state;
     trace_lights lights;
     trace_params trace_prms;
+    trace_params job_prms;      // Copy of trace_prms used by the workers.
     bvh_params bvh_prms;
-    tonemap_params tonemap_prms;
-    atomic<int> trace_sample;
-    vector<future<void>> trace_futures;
-    deque<image_region> trace_queue;
-    std::mutex trace_queuem;
-    atomic<bool> trace_stop;
+    vector<image_region> regions;
+    preview_t previews[PREVIEW_LEVELS];
+    vector<pixel_stats_t> stats;
+    float noise_threshold;      // Copy of pt->noise_threshold.
+    bool show_noise;
+    // Set if the workers can write the tiles directly into the display
+    // buffer, that is if we don't show the noise or the denoised image.
+    atomic<bool> direct_display;
+    atomic<int> tiles_done;     // Number of traced tiles batches.
+    int tiles_total;
+    int part[2];                // Copy of pt->part.
+    int samples_range[2];       // Samples of the part we render.
+    bool offline;               // No display, so no previews.
+    trace_pool_t pool;
+    tile_ring_t ring;
     float exposure;
 };
 
 
-template <typename T>
-inline bool try_pop(std::deque<T> &queue, std::mutex &mut, T& value) {
-    lock_guard<mutex> lock(mut);
-    if (queue.empty()) return false;
-    value = queue.front();
-    queue.pop_front();
-    return true;
-}
-
-
 /*
  * Get a item from a list by name or create a new one if it doesn't exists
  */
@@ -160,22 +363,32 @@ static yocto_shape create_shape_for_block(
         const mesh_t *mesh, const int block_pos[3])
 {
     voxel_vertex_t* vertices;
-    int i, nb, size, subdivide;
+    uint16_t *indices = NULL;
+    int i, nb, nb_vertices, nb_indices = 0, size = 0, subdivide;
     yocto_shape shape = {};
+    const int effects = goxel.rend.settings.effects;
 
     vertices = (voxel_vertex_t*)calloc(
-                BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
-                sizeof(*vertices));
-    nb = mesh_generate_vertices(mesh, block_pos,
-                                goxel.rend.settings.effects,
-                                vertices, &size, &subdivide);
+                MESH_BLOCK_MAX_VERTICES, sizeof(*vertices));
+    if (mesh_use_indexed_vertices(effects)) {
+        indices = (uint16_t*)calloc(MESH_BLOCK_MAX_VERTICES,
+                                    sizeof(*indices));
+        nb_vertices = mesh_generate_indexed_vertices(
+                mesh, block_pos, effects, vertices,
+                indices, &nb_indices, &subdivide);
+        nb = nb_indices / 3;
+    } else {
+        nb = mesh_generate_vertices(mesh, block_pos, effects,
+                                    vertices, &size, &subdivide);
+        nb_vertices = nb * size;
+    }
     if (!nb) goto end;
 
     // Set vertices data.
-    shape.positions.resize(nb * size);
-    shape.colors.resize(nb * size);
-    shape.normals.resize(nb * size);
-    for (i = 0; i < nb * size; i++) {
+    shape.positions.resize(nb_vertices);
+    shape.colors.resize(nb_vertices);
+    shape.normals.resize(nb_vertices);
+    for (i = 0; i < nb_vertices; i++) {
         shape.positions[i] = {vertices[i].pos[0] / (float)subdivide,
                               vertices[i].pos[1] / (float)subdivide,
                               vertices[i].pos[2] / (float)subdivide};
@@ -189,7 +402,13 @@ static yocto_shape create_shape_for_block(
     }
 
     // Set primitives (quads or triangles) data.
-    if (size == 4) {
+    if (indices) {
+        shape.triangles.resize(nb);
+        for (i = 0; i < nb; i++)
+            shape.triangles[i] = {indices[i * 3 + 0],
+                                  indices[i * 3 + 1],
+                                  indices[i * 3 + 2]};
+    } else if (size == 4) {
         shape.quads.resize(nb);
         for (i = 0; i < nb; i++)
             shape.quads[i] = {i * 4 + 0, i * 4 + 1, i * 4 + 2, i * 4 + 3};
@@ -200,42 +419,884 @@ static yocto_shape create_shape_for_block(
     }
 
 end:
+    free(indices);
     free(vertices);
     return shape;
 }
 
-// Stop the asynchronous renderer.
-void stop_render(vector<future<void>>& futures,
-    deque<image_region>& queue,
-    std::mutex& queuem,
-    atomic<bool>* cancel)
+/*
+ * Compute the voxel grid of a block shape generated by the cubes mesher,
+ * and setup its bvh so that it uses the grid for the intersections.
+ */
+static void voxel_grid_build(voxel_grid_t &grid, const yocto_shape &shape,
+                             bvh_shape &bvh)
+{
+    const int n = BLOCK_SIZE;
+    int i, a, axis, last = -1, idx, pos[3];
+    vec3f center, normal;
+    bbox3f bbox = invalidb3f;
+
+    memset(grid.mask, 0, sizeof(grid.mask));
+    grid.first.clear();
+    grid.faces.resize(shape.quads.size());
+    grid.shape = &shape;
+
+    for (i = 0; i < (int)shape.quads.size(); i++) {
+        const vec4i &q = shape.quads[i];
+        center = (shape.positions[q.x] + shape.positions[q.z]) / 2;
+        normal = shape.normals[q.x];
+        // The face axis is the one where the quad is flat.
+        axis = 0;
+        for (a = 0; a < 3; a++) {
+            if (shape.positions[q.x][a] == shape.positions[q.z][a]) axis = a;
+        }
+        grid.faces[i] = axis * 2 + (normal[axis] > 0 ? 1 : 0);
+        center[axis] -= normal[axis] > 0 ? 0.5 : -0.5;
+        for (a = 0; a < 3; a++) pos[a] = floor(center[a]);
+        idx = pos[0] + pos[1] * n + pos[2] * n * n;
+        assert(idx >= last && idx < GRID_SIZE);
+        if (idx != last) {
+            grid.mask[idx / 64] |= 1ULL << (idx % 64);
+            grid.first.push_back(i);
+            last = idx;
+        }
+        bbox = merge(bbox, shape.positions[q.x]);
+        bbox = merge(bbox, shape.positions[q.z]);
+    }
+    grid.first.push_back(shape.quads.size());
+    for (i = 0, a = 0; i < GRID_SIZE / 64; i++) {
+        grid.rank[i] = a;
+        a += __builtin_popcountll(grid.mask[i]);
+    }
+
+    bvh.nodes.resize(1);
+    bvh.nodes[0] = {};
+    bvh.nodes[0].bbox = bbox;
+}
+
+// Check if a voxel of the grid has a face, and if so set the hit values.
+static bool voxel_grid_test_face(const voxel_grid_t &grid, int idx, int face,
+                                 const ray3f &ray, float t,
+                                 int &element, vec2f &uv, float &distance)
+{
+    int k, i;
+    vec3f p, p0, e1, e2;
+
+    if (t < ray.tmin || t > ray.tmax) return false;
+    k = grid.rank[idx / 64] + __builtin_popcountll(
+            grid.mask[idx / 64] & ((1ULL << (idx % 64)) - 1));
+    for (i = grid.first[k]; i < grid.first[k + 1]; i++) {
+        if (grid.faces[i] != face) continue;
+        const vec4i &q = grid.shape->quads[i];
+        p = ray.o + ray.d * t;
+        p0 = grid.shape->positions[q.x];
+        e1 = grid.shape->positions[q.y] - p0;
+        e2 = grid.shape->positions[q.w] - p0;
+        // Same uv as yocto intersect_quad.
+        uv = {clamp(dot(p - p0, e1) / dot(e1, e1), 0.f, 1.f),
+              clamp(dot(p - p0, e2) / dot(e2, e2), 0.f, 1.f)};
+        element = i;
+        distance = t;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Intersect a ray with a block voxel grid, using a DDA traversal of the
+ * voxels.  Since the faces are all aligned with the voxels, we only have to
+ * test the faces we enter and leave each visited voxel from.
+ */
+static bool voxel_grid_intersect(const void *data, const ray3f &ray,
+                                 int &element, vec2f &uv, float &distance,
+                                 bool find_any)
+{
+    const voxel_grid_t &grid = *(const voxel_grid_t*)data;
+    const int n = BLOCK_SIZE;
+    int a, pos[3], step[3], idx, enter_axis = -1, exit_axis;
+    float t0 = ray.tmin, t1 = ray.tmax, ta, tb, t;
+    float tnext[3], tdelta[3];
+
+    // Clip the ray to the block.
+    for (a = 0; a < 3; a++) {
+        if (ray.d[a] == 0) {
+            if (ray.o[a] < 0 || ray.o[a] > n) return false;
+            continue;
+        }
+        ta = (0 - ray.o[a]) / ray.d[a];
+        tb = (n - ray.o[a]) / ray.d[a];
+        if (ta > tb) swap(ta, tb);
+        if (ta > t0) {
+            t0 = ta;
+            enter_axis = a;
+        }
+        t1 = min(t1, tb);
+    }
+    if (t0 > t1) return false;
+
+    for (a = 0; a < 3; a++) {
+        pos[a] = clamp((int)floor(ray.o[a] + ray.d[a] * t0), 0, n - 1);
+        // Make sure we start from the entered voxel.
+        if (a == enter_axis) pos[a] = ray.d[a] > 0 ? 0 : n - 1;
+        step[a] = ray.d[a] > 0 ? 1 : -1;
+        if (ray.d[a] == 0) {
+            tnext[a] = flt_max;
+            tdelta[a] = flt_max;
+            continue;
+        }
+        tnext[a] = (pos[a] + (step[a] > 0 ? 1 : 0) - ray.o[a]) / ray.d[a];
+        tdelta[a] = fabs(1 / ray.d[a]);
+    }
+
+    t = t0;
+    while (true) {
+        exit_axis = tnext[0] < tnext[1] ?
+                        (tnext[0] < tnext[2] ? 0 : 2) :
+                        (tnext[1] < tnext[2] ? 1 : 2);
+        idx = pos[0] + pos[1] * n + pos[2] * n * n;
+        if (grid.mask[idx / 64] & (1ULL << (idx % 64))) {
+            if (enter_axis >= 0 && voxel_grid_test_face(
+                        grid, idx, enter_axis * 2 + (step[enter_axis] < 0),
+                        ray, t, element, uv, distance))
+                return true;
+            if (voxel_grid_test_face(
+                        grid, idx, exit_axis * 2 + (step[exit_axis] > 0),
+                        ray, tnext[exit_axis], element, uv, distance))
+                return true;
+        }
+        if (tnext[exit_axis] > t1) break;
+        t = tnext[exit_axis];
+        pos[exit_axis] += step[exit_axis];
+        if (pos[exit_axis] < 0 || pos[exit_axis] >= n) break;
+        tnext[exit_axis] += tdelta[exit_axis];
+        enter_axis = exit_axis;
+    }
+    return false;
+}
+
+static void ring_init(tile_ring_t &ring, int size)
+{
+    size_t i, n = 1;
+    while (n < (size_t)size) n *= 2;
+    ring.cells.reset(new tile_ring_t::cell_t[n]);
+    for (i = 0; i < n; i++) ring.cells[i].seq = i;
+    ring.mask = n - 1;
+    ring.head = 0;
+    ring.tail = 0;
+    ring.overflow = false;
+}
+
+// Add a region to the ring, called from the workers.
+static void ring_push(tile_ring_t &ring, const image_region &region,
+                      bool converted)
+{
+    tile_ring_t::cell_t *cell;
+    size_t pos = ring.head.load(memory_order_relaxed), seq;
+
+    while (true) {
+        cell = &ring.cells[pos & ring.mask];
+        seq = cell->seq.load(memory_order_acquire);
+        if (seq == pos) {
+            if (ring.head.compare_exchange_weak(pos, pos + 1,
+                                                memory_order_relaxed))
+                break;
+        } else if (seq < pos) {
+            // Full: the UI thread will update the whole image instead.
+            ring.overflow = true;
+            return;
+        } else {
+            pos = ring.head.load(memory_order_relaxed);
+        }
+    }
+    cell->region = region;
+    cell->converted = converted;
+    cell->seq.store(pos + 1, memory_order_release);
+}
+
+// Get a region from the ring, only called from the UI thread.
+static bool ring_pop(tile_ring_t &ring, image_region &region,
+                     bool *converted)
+{
+    tile_ring_t::cell_t *cell;
+    size_t pos = ring.tail.load(memory_order_relaxed);
+
+    if (!ring.cells) return false;
+    cell = &ring.cells[pos & ring.mask];
+    if (cell->seq.load(memory_order_acquire) != pos + 1) return false;
+    region = cell->region;
+    if (converted) *converted = cell->converted;
+    cell->seq.store(pos + ring.mask + 1, memory_order_release);
+    ring.tail.store(pos + 1, memory_order_relaxed);
+    return true;
+}
+
+// Get the next tile to trace, from our own queue or stolen from an other
+// worker.
+static bool pool_pop_tile(trace_pool_t &pool, int id, tile_t *tile)
+{
+    int i, n = pool.threads.size();
+    tile_queue_t *queue;
+
+    for (i = 0; i < n; i++) {
+        queue = &pool.queues[(id + i) % n];
+        lock_guard<mutex> lock(queue->mutex);
+        if (queue->tiles.empty()) continue;
+        if (i == 0) {
+            *tile = queue->tiles.front();
+            queue->tiles.pop_front();
+        } else {
+            *tile = queue->tiles.back();
+            queue->tiles.pop_back();
+        }
+        pool.queued--;
+        return true;
+    }
+    return false;
+}
+
+static void pool_tile_done(trace_pool_t &pool)
 {
-    if (cancel) *cancel = true;
-    for (auto& f : futures) f.get();
-    futures.clear();
+    if (--pool.pending == 0) {
+        lock_guard<mutex> lock(pool.mutex);
+        pool.idle.notify_all();
+    }
+}
+
+// Run the rows of a task until there are none left.
+static void rows_task_run(rows_task_t *task)
+{
+    int y;
+    while ((y = task->next.fetch_add(task->chunk)) < task->h)
+        task->func(y, min(y + task->chunk, task->h));
+}
+
+// Help running the current rows task of the pool, if any.
+static void pool_help_task(trace_pool_t &pool)
+{
+    rows_task_t *task;
+    if (!pool.task) return;
+    {
+        lock_guard<mutex> lock(pool.mutex);
+        task = pool.task;
+        if (!task) return;
+        task->users++;
+    }
+    rows_task_run(task);
+    task->users--;
+}
+
+/*
+ * Run f(y0, y1) on ranges of rows from 0 to h, with the workers and the
+ * calling thread.  The workers pick the task between two tiles.
+ */
+template <typename F>
+static void pool_run_rows(trace_pool_t &pool, int h, const F &f)
+{
+    rows_task_t task;
+    int n = max((int)pool.threads.size(), 1) + 1;
+
+    task.func = f;
+    task.h = h;
+    task.chunk = max(1, h / (n * 4));
+    task.next = 0;
+    task.users = 0;
     {
-        std::lock_guard<mutex> guard{queuem};
-        queue.clear();
+        lock_guard<mutex> lock(pool.mutex);
+        pool.task = &task;
+        pool.wake.notify_all();
+    }
+    rows_task_run(&task);
+    {
+        lock_guard<mutex> lock(pool.mutex);
+        pool.task = nullptr;
+    }
+    // Wait for the workers still running some rows.
+    while (task.users) std::this_thread::yield();
+}
+
+/*
+ * Estimate the relative noise of a pixel.  Like Cycles we divide the error
+ * by the square root of the value rather than by the value itself, so that
+ * the dark pixels don't need too many samples.
+ */
+static float pixel_noise(const pixel_stats_t &stats)
+{
+    float mean, var;
+    if (stats.n < 2) return INFINITY;
+    mean = stats.sum / stats.n;
+    var = max(0.0f, stats.sum2 - stats.n * mean * mean) /
+          (stats.n * (stats.n - 1));
+    return sqrtf(var) / sqrtf(max(mean, 0.0f) + 0.0001f);
+}
+
+/*
+ * Update the pixels statistics of a region after a samples batch.
+ *
+ * Return:
+ *   The root mean square of the region pixels noise.  We don't use the
+ *   maximum since the estimate of a single pixel is itself quite noisy.
+ */
+static float update_stats(pathtracer_internal_t *p,
+                          const image_region &region, int num_samples)
+{
+    int i, j, w = p->state.image_size.x;
+    float lum, mean, noise, ret = 0;
+
+    for (j = region.min.y; j < region.max.y; j++)
+    for (i = region.min.x; i < region.max.x; i++) {
+        pixel_stats_t &stats = p->stats[j * w + i];
+        lum = luminance(p->state.pixels[j * w + i].radiance);
+        mean = (lum - stats.last) / num_samples;
+        stats.last = lum;
+        stats.sum += mean;
+        stats.sum2 += mean * mean;
+        stats.n++;
+        noise = pixel_noise(stats);
+        ret += noise * noise;
+    }
+    return sqrtf(ret / max(region.size().x * region.size().y, 1));
+}
+
+static vec3f clamp3(const vec3f &v, float a, float b)
+{
+    return {clamp(v.x, a, b), clamp(v.y, a, b), clamp(v.z, a, b)};
+}
+
+/*
+ * Seed the pixels random generators of a region for a given samples batch.
+ *
+ * Each batch gets its own random sequence, independent of the previous
+ * batches, so that the render can be split into samples ranges traced by
+ * different processes and still give the same result.
+ */
+static void seed_region(pathtracer_internal_t *p, const image_region &region,
+                        int batch)
+{
+    int i, j, k, w = p->state.image_size.x;
+    uint32_t seed;
+
+    for (j = region.min.y; j < region.max.y; j++)
+    for (i = region.min.x; i < region.max.x; i++) {
+        k = j * w + i;
+        seed = XXH32(&batch, sizeof(batch), k);
+        p->state.pixels[k].rng = make_rng(p->job_prms.seed ^ seed,
+                                          ((uint64_t)batch << 32) | k);
+    }
+}
+
+/*
+ * Compute the denoiser guide buffers of a region, by tracing a single ray
+ * at the center of each pixel.
+ */
+static void trace_features(pathtracer_internal_t *p,
+                           const image_region &region)
+{
+    const yocto_camera &camera = p->scene.cameras.at(p->job_prms.camera);
+    int i, j;
+    ray3f ray;
+    bvh_intersection isec;
+    material_point material;
+
+    for (j = region.min.y; j < region.max.y; j++)
+    for (i = region.min.x; i < region.max.x; i++) {
+        ray = eval_camera(camera, {i, j}, p->image.size(), {0.5, 0.5},
+                          zero2f);
+        isec = intersect_bvh(p->bvh, ray);
+        if (!isec.hit) {
+            p->albedo[{i, j}] = {1, 1, 1};
+            p->normal[{i, j}] = zero3f;
+            continue;
+        }
+        const yocto_instance &instance = p->scene.instances[isec.instance];
+        material = eval_material(p->scene, instance, isec.element, isec.uv);
+        p->albedo[{i, j}] = clamp3(material.diffuse + material.specular,
+                                   0, 1);
+        p->normal[{i, j}] = eval_shading_normal(p->scene, instance,
+                isec.element, isec.uv, ray.d, true);
+    }
+}
+
+// Color of a pixel in the noise heatmap: blue when converged, green at
+// the threshold, and red when still noisy.
+static vec4b noise_color(float noise, float threshold)
+{
+    float t;
+    if (threshold <= 0) threshold = 0.05;
+    t = clamp(log2f(noise / threshold) / 4 + 0.5f, 0.0f, 1.0f);
+    return float_to_byte(vec4f{clamp(2 * t - 1, 0.0f, 1.0f),
+                               1 - fabsf(2 * t - 1),
+                               clamp(1 - 2 * t, 0.0f, 1.0f), 1});
+}
+
+/*
+ * Tables to convert the linear radiance into the display sRGB bytes.  This
+ * gives the same values as yocto tonemap (with the default parameters)
+ * followed by float_to_byte, without calling pow for each channel.
+ *
+ * The lookup table gives the byte value at the start of 4096 buckets of
+ * the [0, 1] range.  The sRGB curve is never steep enough for a bucket to
+ * cover more than one byte step, so a single comparison with the next
+ * byte threshold gives the exact value.
+ */
+struct srgb_table_t {
+    uint8_t lut[4096];
+    float   thresholds[257];    // Smallest value giving each byte.
+};
+
+static uint8_t srgb_byte(float v)
+{
+    return clamp((int)(rgb_to_srgb(v) * 256), 0, 255);
+}
+
+static const srgb_table_t &get_srgb_table(void)
+{
+    static const srgb_table_t table = []() {
+        srgb_table_t table;
+        float lo, hi, mid;
+        int i;
+
+        table.thresholds[0] = -INFINITY;
+        table.thresholds[256] = INFINITY;
+        for (i = 1; i < 256; i++) {
+            lo = 0;
+            hi = 1;
+            while (true) {
+                mid = (lo + hi) / 2;
+                if (mid <= lo || mid >= hi) break;
+                if (srgb_byte(mid) >= i) hi = mid;
+                else lo = mid;
+            }
+            table.thresholds[i] = hi;
+        }
+        for (i = 0; i < 4096; i++)
+            table.lut[i] = srgb_byte(i / 4096.0f);
+        return table;
+    }();
+    return table;
+}
+
+/*
+ * Convert n linear RGBA pixels into sRGB bytes.  The loops are kept simple
+ * so that the compiler can vectorize the buckets computation.
+ */
+static void tonemap_row(const float *src, uint8_t *dst, int n)
+{
+    const srgb_table_t &table = get_srgb_table();
+    int i, j, m, k, idx[64];
+
+    n *= 4;
+    for (i = 0; i < n; i += 64) {
+        m = min(64, n - i);
+        for (j = 0; j < m; j++)
+            idx[j] = (int)fminf(fmaxf(src[i + j] * 4096.0f, 0), 4095);
+        for (j = 0; j < m; j++) {
+            k = table.lut[idx[j]];
+            dst[i + j] = k + (src[i + j] >= table.thresholds[k + 1]);
+        }
     }
+    // The alpha is the pixel coverage, not a color.
+    for (i = 3; i < n; i += 4)
+        dst[i] = (uint8_t)fminf(fmaxf(src[i] * 256, 0), 255);
 }
 
+/*
+ * Tonemap a region of an image into the display buffer.  This is called
+ * from the workers for the tiles they just traced, so it only touches the
+ * given region.  The pixels not traced yet keep their preview value.
+ *
+ * Must be called with the snapshot mutex locked.
+ */
+static void tonemap_region(pathtracer_internal_t *p, const image4f &src,
+                           const image_region &region)
+{
+    const int w = p->image.size().x;
+    const int *samples = p->snapshot.samples.data();
+    int i, j, k;
+
+    if (!p->buf) return;
+    for (i = region.min.y; i < region.max.y; i++) {
+        for (j = region.min.x; j < region.max.x; j = k) {
+            while (j < region.max.x && !samples[i * w + j])
+                j++;
+            for (k = j; k < region.max.x; k++)
+                if (!samples[i * w + k]) break;
+            if (k == j) break;
+            tonemap_row(&src[{j, i}].x, &p->buf[(i * w + j) * 4], k - j);
+        }
+    }
+}
+
+// Smallest region containing two regions.
+static image_region union_regions(const image_region &a,
+                                  const image_region &b)
+{
+    return {{min(a.min.x, b.min.x), min(a.min.y, b.min.y)},
+            {max(a.max.x, b.max.x), max(a.max.y, b.max.y)}};
+}
+
+// Update a region of the display buffer, according to the display mode.
+// Must be called with the snapshot mutex locked.
+static void update_display(pathtracer_internal_t *p,
+                           const image_region &region)
+{
+    const int w = p->image.size().x;
+    int i, j;
+    vec4b v;
+
+    if (!p->buf) return;
+    if (!p->show_noise) {
+        tonemap_region(p, p->denoise ? p->denoised : p->snapshot.image,
+                       region);
+        return;
+    }
+    for (i = region.min.y; i < region.max.y; i++)
+    for (j = region.min.x; j < region.max.x; j++) {
+        v = noise_color(p->snapshot.noise[i * w + j], p->noise_threshold);
+        memcpy(&p->buf[(i * w + j) * 4], &v, 4);
+    }
+}
+
+// Show a preview level, scaled up to the display size.  Called from the
+// worker that traced the last tile of the level.
+static void show_preview(pathtracer_internal_t *p, int level)
+{
+    const int ratio = 1 << (PREVIEW_LEVELS - level);
+    const image4f &preview = p->previews[level].image;
+    const vec2i size = preview.size();
+    const int w = p->image.size().x, h = p->image.size().y;
+    vector<vec4b> src(size.x);
+    int i, j;
+    uint8_t *row;
+    lock_guard<mutex> lock(p->snapshot.mutex);
+
+    if (!p->buf) return;
+    for (i = 0; i < h; i++) {
+        row = &p->buf[i * w * 4];
+        // Rows using the same preview row are all the same.
+        if (i % ratio) {
+            memcpy(row, row - w * 4, w * 4);
+            continue;
+        }
+        tonemap_row(&preview[{0, min(i / ratio, size.y - 1)}].x,
+                    (uint8_t*)src.data(), size.x);
+        for (j = 0; j < w; j++)
+            memcpy(&row[j * 4], &src[min(j / ratio, size.x - 1)], 4);
+    }
+}
+
+/*
+ * Copy a traced region into the snapshot, and into the display buffer if
+ * we show the image directly.  Return true if the display got updated.
+ *
+ * Parameters:
+ *   p          - The path tracer.
+ *   region     - The traced region.
+ *   features   - If set, also copy the denoiser guide buffers.
+ */
+static bool publish_region(pathtracer_internal_t *p,
+                           const image_region &region, bool features)
+{
+    snapshot_t &snap = p->snapshot;
+    const int w = p->image.size().x, n = region.size().x;
+    int i, j, k;
+    bool display;
+    lock_guard<mutex> lock(snap.mutex);
+
+    for (j = region.min.y; j < region.max.y; j++) {
+        k = j * w + region.min.x;
+        memcpy(&snap.image[k], &p->image[k], n * sizeof(vec4f));
+        for (i = 0; i < n; i++) {
+            snap.samples[k + i] = p->state.pixels[k + i].samples;
+            snap.noise[k + i] = pixel_noise(p->stats[k + i]);
+        }
+        if (!features) continue;
+        memcpy(&snap.albedo[k], &p->albedo[k], n * sizeof(vec3f));
+        memcpy(&snap.normal[k], &p->normal[k], n * sizeof(vec3f));
+    }
+    display = p->direct_display;
+    if (display) tonemap_region(p, snap.image, region);
+    return display;
+}
+
+// Allocate the snapshot for a new render.
+static void snapshot_init(pathtracer_internal_t *p)
+{
+    const vec2i size = p->image.size();
+    p->snapshot.image = image4f(size);
+    p->snapshot.samples.assign(size.x * size.y, 0);
+    p->snapshot.noise.assign(size.x * size.y, INFINITY);
+    p->snapshot.albedo = yocto::image<vec3f>(size, zero3f);
+    p->snapshot.normal = yocto::image<vec3f>(size, zero3f);
+}
+
+/*
+ * Queue all the tiles of a level, starting from the lowest resolution
+ * preview.  This can be called from the workers.
+ */
+static void queue_tiles(pathtracer_internal_t *p, int level,
+                        unsigned int job)
+{
+    trace_pool_t &pool = p->pool;
+    int i, n;
+
+    n = level < PREVIEW_LEVELS ? p->previews[level].regions.size() :
+                                 p->regions.size();
+    pool.pending += n;
+    for (i = 0; i < n; i++) {
+        tile_queue_t &queue = pool.queues[i % pool.threads.size()];
+        lock_guard<mutex> lock(queue.mutex);
+        queue.tiles.push_back({i, p->samples_range[0], job, level});
+        pool.queued++;
+    }
+    lock_guard<mutex> lock(pool.mutex);
+    pool.wake.notify_all();
+}
+
+// Trace a tile of a preview level.  The last tile of a level queues the
+// next level.
+static void trace_preview(pathtracer_internal_t *p, const tile_t &tile)
+{
+    preview_t &preview = p->previews[tile.level];
+
+    trace_region(preview.image, preview.state, p->scene, p->bvh, p->lights,
+                 preview.regions[tile.region], 1, p->job_prms);
+    if (tile.job != p->pool.job) return;
+    if (--preview.remaining > 0) return;
+    show_preview(p, tile.level);
+    ring_push(p->ring, {{0, 0}, p->image.size()}, true);
+    queue_tiles(p, tile.level + 1, tile.job);
+}
+
+static void worker_run(pathtracer_internal_t *p, int id)
+{
+    trace_pool_t &pool = p->pool;
+    tile_queue_t &queue = pool.queues[id];
+    const trace_params &prms = p->job_prms;
+    tile_t tile;
+    int num_samples, skipped;
+    float noise;
+    bool converted, first;
+
+    while (true) {
+        {
+            unique_lock<mutex> lock(pool.mutex);
+            pool.wake.wait(lock, [&pool]() {
+                return pool.quit || pool.queued > 0 || pool.task; });
+            if (pool.quit) return;
+        }
+        pool_help_task(pool);
+        while (pool_pop_tile(pool, id, &tile)) {
+            pool_help_task(pool);
+            if (tile.job != pool.job) { // Cancelled.
+                pool_tile_done(pool);
+                continue;
+            }
+            if (tile.level < PREVIEW_LEVELS) {
+                trace_preview(p, tile);
+                pool_tile_done(pool);
+                continue;
+            }
+            const image_region &region = p->regions[tile.region];
+            num_samples = min(prms.batch, p->samples_range[1] - tile.sample);
+            first = tile.sample == p->samples_range[0];
+            if (first) trace_features(p, region);
+            seed_region(p, region, tile.sample / prms.batch);
+            trace_region(p->image, p->state, p->scene, p->bvh, p->lights,
+                         region, num_samples, prms);
+            tile.sample += num_samples;
+            if (tile.job != pool.job) {
+                pool_tile_done(pool);
+                continue;
+            }
+            noise = update_stats(p, region, num_samples);
+            converted = publish_region(p, region, first);
+            ring_push(p->ring, region, converted);
+            // Stop early if the tile has converged, so that the remaining
+            // workers focus on the noisy tiles.
+            skipped = 0;
+            if (    p->noise_threshold > 0 &&
+                    tile.sample >= NOISE_MIN_BATCHES * prms.batch &&
+                    noise < p->noise_threshold) {
+                skipped = (prms.samples - tile.sample + prms.batch - 1) /
+                          prms.batch;
+                tile.sample = prms.samples;
+            }
+            p->tiles_done += 1 + skipped;
+            if (tile.sample >= p->samples_range[1]) {
+                pool_tile_done(pool);
+                continue;
+            }
+            // Queue the next batch of the tile, after the other tiles so
+            // that the whole image gets refined progressively.
+            lock_guard<mutex> lock(queue.mutex);
+            queue.tiles.push_back(tile);
+            pool.queued++;
+        }
+    }
+}
+
+static void pool_init(pathtracer_internal_t *p)
+{
+    trace_pool_t &pool = p->pool;
+    int i, n;
+
+    if (!pool.threads.empty()) return;
+    n = max(1u, std::thread::hardware_concurrency());
+    pool.queues.reset(new tile_queue_t[n]);
+    pool.quit = false;
+    pool.job = 0;
+    pool.queued = 0;
+    pool.pending = 0;
+    pool.cancel = false;
+    pool.task = nullptr;
+    for (i = 0; i < n; i++)
+        pool.threads.emplace_back(worker_run, p, i);
+}
+
+static void pool_release(pathtracer_internal_t *p)
+{
+    trace_pool_t &pool = p->pool;
+    {
+        lock_guard<mutex> lock(pool.mutex);
+        pool.quit = true;
+        pool.wake.notify_all();
+    }
+    for (auto &thread : pool.threads) thread.join();
+    pool.threads.clear();
+}
+
+/*
+ * Stop the asynchronous renderer.
+ *
+ * We cancel the current job and wait until the workers aborted the tiles
+ * they were tracing, since they write into the image and the trace state.
+ */
+static void stop_render(pathtracer_internal_t *p)
+{
+    trace_pool_t &pool = p->pool;
+    size_t i, n;
+    image_region region;
+
+    if (pool.threads.empty()) return;
+    pool.job++;
+    for (i = 0; i < pool.threads.size(); i++) {
+        lock_guard<mutex> lock(pool.queues[i].mutex);
+        n = pool.queues[i].tiles.size();
+        pool.queues[i].tiles.clear();
+        pool.queued -= n;
+        pool.pending -= n;
+    }
+    pool.cancel = true;
+    {
+        unique_lock<mutex> lock(pool.mutex);
+        pool.idle.wait(lock, [&pool]() { return pool.pending == 0; });
+    }
+    pool.cancel = false;
+    while (ring_pop(p->ring, region, NULL)) {}
+}
+
+/*
+ * Return the content hash of a mesh block, or zero if there is no block.
+ * Since a block data id changes each time the data is modified, we only
+ * compute the hash once per id.
+ */
+static uint64_t get_data_hash(pathtracer_internal_t *p, const mesh_t *mesh,
+                              mesh_accessor_t *accessor, const int pos[3])
+{
+    const int size = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 4;
+    const void *data;
+    uint64_t id, hash;
+
+    data = mesh_get_block_data(mesh, accessor, pos, &id);
+    if (!data) return 0;
+    auto it = p->data_hashes.find(id);
+    if (it != p->data_hashes.end()) {
+        it->second.gen = p->blocks_gen;
+        return it->second.hash;
+    }
+    hash = (uint64_t)XXH32(data, size, 0) << 32 | XXH32(data, size, 1);
+    if (!hash) hash = 1;
+    p->data_hashes[id] = {hash, p->blocks_gen};
+    return hash;
+}
+
+static void get_block_key(pathtracer_internal_t *p, const mesh_t *mesh,
+                          mesh_accessor_t *accessor, const int block_pos[3],
+                          block_key_t *key)
+{
+    int i, x, y, z, pos[3];
+
+    memset(key, 0, sizeof(*key)); // Zero the padding, since we hash it.
+    key->effects = goxel.rend.settings.effects;
+    for (i = 0, z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++, i++) {
+        pos[0] = block_pos[0] + x * BLOCK_SIZE;
+        pos[1] = block_pos[1] + y * BLOCK_SIZE;
+        pos[2] = block_pos[2] + z * BLOCK_SIZE;
+        key->hashes[i] = get_data_hash(p, mesh, accessor, pos);
+    }
+}
+
+/*
+ * Return the index of the scene shape of a block, creating it if it is not
+ * in the cache already.  Return -1 if the block has no geometry.
+ */
+static int get_block_shape(pathtracer_t *pt, const mesh_t *mesh,
+                           mesh_accessor_t *accessor, const int block_pos[3])
+{
+    pathtracer_internal_t *p = pt->p;
+    block_key_t key;
+    yocto_shape shape;
+    int index = -1;
+
+    get_block_key(p, mesh, accessor, block_pos, &key);
+    auto it = p->blocks.find(key);
+    if (it != p->blocks.end()) {
+        it->second.gen = p->blocks_gen;
+        return it->second.shape;
+    }
+
+    shape = create_shape_for_block(mesh, block_pos);
+    if (!shape.positions.empty()) {
+        if (!p->free_shapes.empty()) {
+            index = p->free_shapes.back();
+            p->free_shapes.pop_back();
+            p->scene.shapes[index] = std::move(shape);
+        } else {
+            index = p->scene.shapes.size();
+            p->scene.shapes.push_back(std::move(shape));
+            p->grids.resize(p->scene.shapes.size());
+        }
+        // Only the cubes mesher output can use the voxel grid.
+        p->grids[index].enabled = !p->no_voxels &&
+            !(key.effects & EFFECT_MARCHING_CUBES) &&
+            !mesh_use_indexed_vertices(key.effects);
+        p->dirty_shapes.push_back(index);
+    }
+    p->blocks[key] = {index, p->blocks_gen};
+    return index;
+}
 
 static int sync_mesh(pathtracer_t *pt, int w, int h, bool force)
 {
     uint32_t key = 0, k;
     mesh_iterator_t iter;
+    mesh_accessor_t accessor;
     const mesh_t *mesh;
-    int block_pos[3], i, changed = 0;
-    yocto_shape shape;
+    int block_pos[3], i, changed = 0, shape, material;
+    frame3f frame;
     yocto_instance instance;
     pathtracer_internal_t *p = pt->p;
     const layer_t *layers, *layer;
+    vector<yocto_instance> &instances = p->scene.instances;
 
     layers = goxel_get_render_layers(false);
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->mesh) continue;
         k = mesh_get_key(layer->mesh);
         key = XXH32(&k, sizeof(k), key);
+        key = XXH32(layer->mat, sizeof(layer->mat), key);
         i = get_material_id(pt, layer->material, &changed);
         key = XXH32(&i, sizeof(i), key);
     }
@@ -249,29 +1310,64 @@ static int sync_mesh(pathtracer_t *pt, int w, int h, bool force)
     if (!force && key == p->mesh_key) return changed;
 
     p->mesh_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
-    p->scene = {};
-    p->lights = {};
+    stop_render(p);
     changed |= CHANGE_MESH;
+    p->blocks_gen++;
+
+    // Remove all the blocks instances (the only ones without uri), we add
+    // them back below.
+    instances.erase(remove_if(instances.begin(), instances.end(),
+                              [](const yocto_instance &instance) {
+                                  return instance.uri.empty(); }),
+                    instances.end());
 
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->mesh) continue;
         mesh = layer->mesh;
+        material = get_material_id(pt, layer->material, &changed);
+        // Clone layers use the mesh of their base layer.
+        frame = identity3x4f;
+        if (layer->base_id) frame = frame3f(mat4f(
+                    {layer->mat[0][0], layer->mat[0][1], layer->mat[0][2],
+                     layer->mat[0][3]},
+                    {layer->mat[1][0], layer->mat[1][1], layer->mat[1][2],
+                     layer->mat[1][3]},
+                    {layer->mat[2][0], layer->mat[2][1], layer->mat[2][2],
+                     layer->mat[2][3]},
+                    {layer->mat[3][0], layer->mat[3][1], layer->mat[3][2],
+                     layer->mat[3][3]}));
+        accessor = mesh_get_accessor(mesh);
         iter = mesh_get_iterator(mesh,
                         MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
         while (mesh_iter(&iter, block_pos)) {
-            shape = create_shape_for_block(mesh, block_pos);
-            // shape.material = get_material_id(pt, layer->material, &changed);
-            if (shape.positions.empty()) continue;
-            p->scene.shapes.push_back(shape);
-            instance.material = get_material_id(pt, layer->material, &changed);
-            instance.uri = shape.uri;
-            instance.shape = p->scene.shapes.size() - 1;
-            instance.frame = translation_frame(vec3f(
+            shape = get_block_shape(pt, mesh, &accessor, block_pos);
+            if (shape < 0) continue;
+            instance = {};
+            instance.material = material;
+            instance.shape = shape;
+            instance.frame = frame * translation_frame(vec3f(
                                     block_pos[0], block_pos[1], block_pos[2]));
-            p->scene.instances.push_back(instance);
+            instances.push_back(instance);
+        }
+    }
+
+    // Release the shapes of the blocks that are not used anymore.
+    for (auto it = p->blocks.begin(); it != p->blocks.end();) {
+        if (it->second.gen == p->blocks_gen) {
+            it++;
+            continue;
+        }
+        if (it->second.shape >= 0) {
+            p->scene.shapes[it->second.shape] = {};
+            p->grids[it->second.shape] = {};
+            p->free_shapes.push_back(it->second.shape);
+            p->dirty_shapes.push_back(it->second.shape);
         }
+        it = p->blocks.erase(it);
+    }
+    for (auto it = p->data_hashes.begin(); it != p->data_hashes.end();) {
+        if (it->second.gen == p->blocks_gen) it++;
+        else it = p->data_hashes.erase(it);
     }
 
     return changed;
@@ -292,10 +1388,17 @@ static int sync_floor(pathtracer_t *pt, bool force)
     if (!force && key == p->floor_key) return 0;
     changed |= CHANGE_FLOOR;
     p->floor_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
-
-    if (pt->floor.type == PT_FLOOR_NONE) return changed;
+    stop_render(p);
+
+    if (pt->floor.type == PT_FLOOR_NONE) {
+        p->scene.instances.erase(
+                remove_if(p->scene.instances.begin(),
+                          p->scene.instances.end(),
+                          [](const yocto_instance &instance) {
+                              return instance.uri == "<floor>"; }),
+                p->scene.instances.end());
+        return changed;
+    }
 
     color[0] = pt->floor.color[0] / 255.f;
     color[1] = pt->floor.color[1] / 255.f;
@@ -319,6 +1422,7 @@ static int sync_floor(pathtracer_t *pt, bool force)
         shape->colors.push_back(color);
     }
     shape->quads.push_back({0, 1, 3, 2});
+    p->dirty_shapes.push_back(getindex(p->scene.shapes, shape));
     // shape->material = get_material_id(pt, pt->floor.material, &changed);
     instance = getdefault(p->scene.instances, "<floor>");
     instance->material = get_material_id(pt, pt->floor.material, &changed);
@@ -347,8 +1451,7 @@ static int sync_camera(pathtracer_t *pt, int w, int h,
     key = XXH32(&h, sizeof(h), key);
     if (!force && key == p->camera_key) return 0;
     p->camera_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
 
     mat4_copy(camera->mat, m);
     cam->frame = frame3f(mat4f({m[0][0], m[0][1], m[0][2], m[0][3]},
@@ -381,8 +1484,7 @@ static int sync_world(pathtracer_t *pt, bool force)
     key = XXH32(&pt->world.color, sizeof(pt->world.color), key);
     if (!force && key == p->world_key) return 0;
     p->world_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
 
     texture = getdefault(p->scene.textures, "<world>");
     texture->uri = "textures/uniform.hdr";
@@ -433,8 +1535,7 @@ static int sync_light(pathtracer_t *pt, bool force)
 
     if (!force && key == p->light_key) return 0;
     p->light_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
 
     ke = goxel.rend.light.intensity;
     material = getdefault(p->scene.materials, "<light>");
@@ -447,6 +1548,7 @@ static int sync_light(pathtracer_t *pt, bool force)
     shape->positions.push_back({1, 0, 0});
     shape->positions.push_back({1, 1, 0});
     shape->triangles.push_back({0, 1, 2});
+    p->dirty_shapes.push_back(getindex(p->scene.shapes, shape));
 
     instance = getdefault(p->scene.instances, "<light>");
     instance->material = getindex(p->scene.materials, material);
@@ -462,66 +1564,171 @@ static int sync_options(pathtracer_t *pt, bool force)
     uint64_t key = 0;
     pathtracer_internal_t *p = pt->p;
     key = XXH32(&pt->num_samples, sizeof(pt->num_samples), key);
+    key = XXH32(&pt->noise_threshold, sizeof(pt->noise_threshold), key);
+    key = XXH32(pt->part, sizeof(pt->part), key);
     if (!force && key == p->options_key) return 0;
     p->options_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
     p->trace_prms.samples = pt->num_samples;
+    // The noise of a part doesn't tell anything about the full render.
+    p->noise_threshold = pt->part[1] ? 0 : pt->noise_threshold;
+    p->part[0] = pt->part[0];
+    p->part[1] = pt->part[1];
     p->trace_prms.resolution = max(pt->w, pt->h);
     return CHANGE_OPTIONS;
 }
 
-static void start_render(
-        image4f& image, trace_state& state,
-        const yocto_scene& scene, const bvh_scene& bvh,
-        const trace_lights& lights,
-        vector<future<void>>& futures, atomic<int>& current_sample,
-        deque<image_region>& queue,
-        mutex& queuem,
-        const trace_params& trace_prms,
-        atomic<bool>* cancel)
-{
-    auto& camera     = scene.cameras.at(trace_prms.camera);
-    auto  image_size = camera_resolution(camera, trace_prms.resolution);
-    state            = make_trace_state(image_size, trace_prms.seed);
-    auto regions = make_regions(image.size(), trace_prms.region, true);
-    if (cancel) *cancel = false;
-
-    futures.clear();
-    futures.emplace_back(async([trace_prms, regions, &current_sample, &image,
-                                &scene, &lights, &bvh, &state, &queue,
-                                &queuem, cancel]() {
-        for (auto sample = 0; sample < trace_prms.samples;
-             sample += trace_prms.batch) {
-            if (cancel && *cancel) return;
-            current_sample   = sample;
-            auto num_samples = min(trace_prms.batch,
-                                   trace_prms.samples - current_sample);
-            auto futures  = vector<future<void>>{};
-            int nthreads = std::thread::hardware_concurrency();
-            std::atomic<size_t> next_idx(0);
-            for (int thread_id = 0; thread_id < nthreads; thread_id++) {
-                futures.emplace_back(async(std::launch::async,
-                            [num_samples, &trace_prms, &image, &scene, &lights,
-                             &bvh, &state, &queue, &queuem, &next_idx, cancel,
-                             &regions]() {
-                    while (true) {
-                        if (cancel && *cancel) break;
-                        auto idx = next_idx.fetch_add(1);
-                        if (idx >= regions.size()) break;
-                        auto region = regions[idx];
-                        trace_region(image, state, scene, bvh, lights,
-                                     region, num_samples, trace_prms);
-                        {
-                            std::lock_guard<mutex> guard{queuem};
-                            queue.push_back(region);
-                        }
-                    }
-                }));
-            }
+/*
+ * Start the asynchronous renderer.
+ *
+ * Parameters:
+ *   p          - The path tracer.
+ *   preview    - If set, we first render the low resolution previews.
+ */
+static void start_render(pathtracer_internal_t *p, bool preview)
+{
+    trace_pool_t &pool = p->pool;
+    const trace_params &prms = p->job_prms;
+    int i, n, ratio, nb_batches, part, nb_parts;
+    vec2i size;
+
+    pool_init(p);
+    p->job_prms = p->trace_prms;
+    p->job_prms.cancel = &pool.cancel;
+    p->state = make_trace_state(p->image.size(), prms.seed);
+    p->regions = make_regions(p->image.size(), prms.region, true);
+    p->stats.assign(p->image.size().x * p->image.size().y, pixel_stats_t{});
+    p->albedo = yocto::image<vec3f>(p->image.size(), zero3f);
+    p->normal = yocto::image<vec3f>(p->image.size(), zero3f);
+    snapshot_init(p);
+    n = p->regions.size();
+
+    // Split the batches evenly between the parts.
+    nb_batches = (prms.samples + prms.batch - 1) / prms.batch;
+    nb_parts = max(p->part[1], 1);
+    part = clamp(p->part[0], 0, nb_parts - 1);
+    p->samples_range[0] = nb_batches * part / nb_parts * prms.batch;
+    p->samples_range[1] = min(prms.samples,
+            nb_batches * (part + 1) / nb_parts * prms.batch);
+    p->tiles_done = 0;
+    p->tiles_total = n * (nb_batches * (part + 1) / nb_parts -
+                          nb_batches * part / nb_parts);
+    ring_init(p->ring, n * 2);
+
+    for (i = 0; preview && i < PREVIEW_LEVELS; i++) {
+        ratio = 1 << (PREVIEW_LEVELS - i);
+        size = {(p->image.size().x + ratio - 1) / ratio,
+                (p->image.size().y + ratio - 1) / ratio};
+        p->previews[i].image = image4f(size);
+        p->previews[i].state = make_trace_state(size, prms.seed);
+        p->previews[i].regions = make_regions(size, prms.region, true);
+        p->previews[i].remaining = p->previews[i].regions.size();
+    }
+    queue_tiles(p, preview ? 0 : PREVIEW_LEVELS, ++pool.job);
+}
+
+/*
+ * Build the top level bvh of the scene, assuming the shapes bvh are up to
+ * date.  yocto build_bvh would also rebuild all the shapes bvh, so instead
+ * we call it on a copy of the scene where each shape is replaced by a
+ * single line going through its bounding box corners.
+ */
+static void build_instances_bvh(bvh_scene &bvh, const bvh_params &params)
+{
+    bvh_scene tmp;
+    vector<vec3f> corners(bvh.shapes.size() * 2);
+    const vec2i line = {0, 1};
+    const float radius[2] = {0, 0};
+    bvh_params tmp_params = params;
+    int i;
+
+    tmp.instances = bvh.instances;
+    tmp.shapes.resize(bvh.shapes.size());
+    for (i = 0; i < (int)bvh.shapes.size(); i++) {
+        if (bvh.shapes[i].nodes.empty()) continue;
+        if (bvh.shapes[i].nodes[0].bbox.min.x >
+            bvh.shapes[i].nodes[0].bbox.max.x) continue; // Empty shape.
+        corners[i * 2 + 0] = bvh.shapes[i].nodes[0].bbox.min;
+        corners[i * 2 + 1] = bvh.shapes[i].nodes[0].bbox.max;
+        tmp.shapes[i].lines = {&line, 1};
+        tmp.shapes[i].positions = {&corners[i * 2], 2};
+        tmp.shapes[i].radius = {radius, 2};
+    }
+    // The parallel build would spawn new threads for each proxy shape.
+    tmp_params.noparallel = true;
+    build_bvh(tmp, tmp_params);
+    bvh.nodes = std::move(tmp.nodes);
+}
+
+/*
+ * Update the scene bvh after some shapes or instances changed: only
+ * rebuild the bvh of the dirty shapes, and then the top level bvh.
+ */
+static void update_bvh(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    const yocto_scene &scene = p->scene;
+    bvh_scene &bvh = p->bvh;
+    vector<future<void>> futures;
+    atomic<size_t> next(0);
+    bvh_params params = p->bvh_prms;
+    int i, nthreads;
+
+    bvh.shapes.resize(scene.shapes.size());
+    p->grids.resize(scene.shapes.size());
+    // The shapes vector might have been reallocated, so always reset the
+    // pointers to the shapes data.
+    for (i = 0; i < (int)scene.shapes.size(); i++) {
+        p->grids[i].shape = &scene.shapes[i];
+        bvh.shapes[i].intersect_func = nullptr;
+        if (p->grids[i].enabled) {
+            bvh.shapes[i].intersect_func = voxel_grid_intersect;
+            bvh.shapes[i].intersect_data = &p->grids[i];
         }
-        current_sample = trace_prms.samples;
-    }));
+        bvh.shapes[i].points = scene.shapes[i].points;
+        bvh.shapes[i].lines = scene.shapes[i].lines;
+        bvh.shapes[i].triangles = scene.shapes[i].triangles;
+        bvh.shapes[i].quads = scene.shapes[i].quads;
+        bvh.shapes[i].quadspos = scene.shapes[i].quadspos;
+        bvh.shapes[i].positions = scene.shapes[i].positions;
+        bvh.shapes[i].radius = scene.shapes[i].radius;
+    }
+    if (scene.instances.empty()) {
+        bvh.instances = {};
+    } else {
+        bvh.instances = {&scene.instances[0].frame,
+                         (int)scene.instances.size(),
+                         sizeof(scene.instances[0])};
+    }
+
+    // The blocks shapes are small, so we build several of them in
+    // parallel rather than each one with several threads.
+    sort(p->dirty_shapes.begin(), p->dirty_shapes.end());
+    p->dirty_shapes.erase(unique(p->dirty_shapes.begin(),
+                                 p->dirty_shapes.end()),
+                          p->dirty_shapes.end());
+    params.noparallel = true;
+    nthreads = std::thread::hardware_concurrency();
+    for (i = 0; i < nthreads; i++) {
+        futures.emplace_back(async(std::launch::async,
+                    [&p, &bvh, &next, &params]() {
+            size_t idx;
+            int i;
+            while ((idx = next.fetch_add(1)) < p->dirty_shapes.size()) {
+                i = p->dirty_shapes[idx];
+                if (p->grids[i].enabled) {
+                    voxel_grid_build(p->grids[i], p->scene.shapes[i],
+                                     bvh.shapes[i]);
+                } else {
+                    build_bvh(bvh.shapes[i], params);
+                }
+            }
+        }));
+    }
+    for (auto &f : futures) f.get();
+    p->dirty_shapes.clear();
+
+    build_instances_bvh(bvh, p->bvh_prms);
 }
 
 static int sync(pathtracer_t *pt, int w, int h, const float viewport[4],
@@ -547,7 +1754,7 @@ static int sync(pathtracer_t *pt, int w, int h, const float viewport[4],
 
     // Update BVH if needed.
     if (changes & (CHANGE_MESH | CHANGE_LIGHT | CHANGE_FLOOR)) {
-        p->bvh = make_bvh(p->scene, p->bvh_prms);
+        update_bvh(pt);
     }
     if (changes & (CHANGE_LIGHT | CHANGE_MATERIAL)) {
         p->lights = make_trace_lights(p->scene);
@@ -558,48 +1765,200 @@ static int sync(pathtracer_t *pt, int w, int h, const float viewport[4],
                 p->lights.environments.empty()) {
             p->trace_prms.sampler = trace_params::sampler_type::eyelight;
         }
+        // Make sure no worker still writes into the old image.
+        stop_render(p);
         p->trace_prms.resolution = max(w, h);
         p->image = image4f({w, h});
-        p->display = image4f({w, h});
+        p->buf = pt->buf;
+        start_render(p, (changes & CHANGE_CAMERA) && !p->offline);
+    }
+    return changes;
+}
 
-        stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                    &p->trace_stop);
+// Fast approximation of exp(-x) for x >= 0, good enough for the filter
+// weights.  See "A Fast, Compact Approximation of the Exponential
+// Function", Schraudolph 1999.
+static inline float fast_exp_neg(float x)
+{
+    int32_t i;
+    float f;
+    x = fminf(x, 80); // Avoid the branch, exp(-80) is small enough.
+    i = (int32_t)(1065353216 - 12102203 * x);
+    memcpy(&f, &i, sizeof(f));
+    return f;
+}
 
-        p->state = make_trace_state({w, h});
-        p->trace_sample = 0;
-        p->trace_stop = false;
-        start_render(p->image, p->state, p->scene,
-                     p->bvh, p->lights,
-                     p->trace_futures, p->trace_sample,
-                     p->trace_queue, p->trace_queuem, p->trace_prms,
-                     &p->trace_stop);
+/*
+ * Load the rows y0 to y1 of the snapshot into the denoiser buffers.
+ *
+ * We divide the colors by the albedo, so that only the lighting gets
+ * blurred and not the voxels colors.
+ */
+static void denoise_load(pathtracer_internal_t *p, int y0, int y1)
+{
+    denoiser_t &d = p->denoiser;
+    const snapshot_t &snap = p->snapshot;
+    int k, c;
+    vec3f a;
+
+    for (k = y0 * d.w; k < y1 * d.w; k++) {
+        const vec4f &v = snap.image[k];
+        const vec3f &albedo = snap.albedo[k];
+        const vec3f &normal = snap.normal[k];
+        a = clamp3(albedo, 0.01, 1);
+        d.color[0][0][k] = v.x / a.x;
+        d.color[0][1][k] = v.y / a.y;
+        d.color[0][2][k] = v.z / a.z;
+        d.color[0][3][k] = v.w;
+        for (c = 0; c < 3; c++) {
+            d.guide[c][k] = normal[c];
+            d.guide[3 + c][k] = albedo[c];
+        }
+        d.weight[k] = max(snap.samples[k], 1) / 16.0f;
     }
-    return changes;
 }
 
-static void make_preview(pathtracer_t *pt)
+/*
+ * One pass of the edge avoiding a-trous wavelet filter, on the rows y0 to
+ * y1 of the image.  See "Edge-Avoiding A-Trous Wavelet Transform for fast
+ * Global Illumination Filtering", Dammertz et al. 2010.
+ *
+ * This is a 3x3 blur with holes of size `step`, where each neighbour
+ * weight is reduced by the differences of color, normal and albedo.  The
+ * color tolerance is 4 / step / sqrt(samples), so it gets halved at each
+ * pass.
+ *
+ * We process each of the nine taps over a whole row at a time, with one
+ * simple loop per step, so that the compiler can vectorize them.
+ */
+static void denoise_pass(denoiser_t &d, int pass, int y0, int y1)
 {
-    int i, j, pi, pj;
-    pathtracer_internal_t *p = pt->p;
-    trace_params preview_prms = p->trace_prms;
-    int preview_ratio = 8;
-    image4f preview;
-    vec4b v;
+    const float kernel[3] = {0.25, 0.5, 0.25};
+    const int step = 1 << pass, w = d.w, h = d.h;
+    const float step2 = step * step;
+    const vector<float> *src = d.color[pass % 2];
+    vector<float> *dst = d.color[(pass + 1) % 2];
+    vector<float> acc(w * 6);
+    float *sum[4] = {&acc[0], &acc[w], &acc[w * 2], &acc[w * 3]};
+    float *wsum = &acc[w * 4], *wt = &acc[w * 5];
+    const float *lp, *lq, *sp, *gp, *gq, *cq;
+    float kw, dl, g;
+    int x, y, i, j, c, qy, dx, x0, x1, n;
+
+    for (y = y0; y < y1; y++) {
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        lp = &d.lum[y * w];
+        sp = &d.weight[y * w];
+        for (j = -1; j <= 1; j++) {
+            qy = y + j * step;
+            if (qy < 0 || qy >= h) continue;
+            for (i = -1; i <= 1; i++) {
+                dx = i * step;
+                x0 = max(0, -dx);
+                x1 = min(w, w - dx);
+                n = x1 - x0;
+                if (n <= 0) continue;
+                kw = kernel[i + 1] * kernel[j + 1];
+                // Color distance.
+                lq = &d.lum[qy * w + x0 + dx];
+                for (x = 0; x < n; x++) {
+                    dl = lq[x] - lp[x0 + x];
+                    wt[x] = dl * dl * sp[x0 + x] * step2 /
+                        (fmaxf(lp[x0 + x] * lp[x0 + x], lq[x] * lq[x]) +
+                         0.0001f);
+                }
+                // Normal and albedo distances.
+                for (c = 0; c < 6; c++) {
+                    gp = &d.guide[c][y * w + x0];
+                    gq = &d.guide[c][qy * w + x0 + dx];
+                    for (x = 0; x < n; x++) {
+                        g = gq[x] - gp[x];
+                        wt[x] += 100 * g * g;
+                    }
+                }
+                for (x = 0; x < n; x++) {
+                    wt[x] = kw * fast_exp_neg(wt[x]);
+                    wsum[x0 + x] += wt[x];
+                }
+                for (c = 0; c < 4; c++) {
+                    cq = &src[c][qy * w + x0 + dx];
+                    for (x = 0; x < n; x++)
+                        sum[c][x0 + x] += cq[x] * wt[x];
+                }
+            }
+        }
+        for (c = 0; c < 4; c++) {
+            for (x = 0; x < w; x++)
+                dst[c][y * w + x] = sum[c][x] / wsum[x];
+        }
+    }
+}
 
-    preview_prms.resolution /= preview_ratio;
-    preview_prms.samples = 1;
+// Compute the luminance of the rows y0 to y1 of a pass input.
+static void denoise_luminance(denoiser_t &d, int pass, int y0, int y1)
+{
+    const vector<float> *src = d.color[pass % 2];
+    int k;
+    for (k = y0 * d.w; k < y1 * d.w; k++)
+        d.lum[k] = luminance(vec3f{src[0][k], src[1][k], src[2][k]});
+}
 
-    preview = trace_image(p->scene, p->bvh, p->lights, preview_prms);
-    preview = tonemap(preview, p->tonemap_prms);
+// Multiply back the filtered rows by the albedo into p->denoised.
+static void denoise_store(pathtracer_internal_t *p, int y0, int y1)
+{
+    const denoiser_t &d = p->denoiser;
+    const vector<float> *src = d.color[DENOISE_PASSES % 2];
+    int k;
+    vec3f a;
+
+    for (k = y0 * d.w; k < y1 * d.w; k++) {
+        a = clamp3({d.guide[3][k], d.guide[4][k], d.guide[5][k]}, 0.01, 1);
+        p->denoised[k] = {src[0][k] * a.x, src[1][k] * a.y,
+                          src[2][k] * a.z, src[3][k]};
+    }
+}
 
-    for (i = 0; i < pt->h; i++) {
-        for (j = 0; j < pt->w; j++) {
-            pi = clamp(i / preview_ratio, 0, preview.size().y - 1);
-            pj = clamp(j / preview_ratio, 0, preview.size().x - 1);
-            v = float_to_byte(preview[{pj, pi}]);
-            memcpy(&pt->buf[(i * pt->w + j) * 4], &v, 4);
+/*
+ * Denoise the whole image into p->denoised.
+ *
+ * We read the pixels from the snapshot, and each step runs as a rows task
+ * of the workers pool.
+ */
+static void denoise_image(pathtracer_internal_t *p)
+{
+    const vec2i size = p->image.size();
+    denoiser_t &d = p->denoiser;
+    int i, c, n = size.x * size.y;
+
+    if (p->denoised.size() != size) {
+        p->denoised = image4f(size);
+        d.w = size.x;
+        d.h = size.y;
+        for (c = 0; c < 4; c++) {
+            d.color[0][c].resize(n);
+            d.color[1][c].resize(n);
         }
+        for (c = 0; c < 6; c++) d.guide[c].resize(n);
+        d.lum.resize(n);
+        d.weight.resize(n);
     }
+    {
+        lock_guard<mutex> lock(p->snapshot.mutex);
+        pool_run_rows(p->pool, size.y, [p](int y0, int y1) {
+            denoise_load(p, y0, y1);
+        });
+    }
+    for (i = 0; i < DENOISE_PASSES; i++) {
+        pool_run_rows(p->pool, size.y, [&d, i](int y0, int y1) {
+            denoise_luminance(d, i, y0, y1);
+        });
+        pool_run_rows(p->pool, size.y, [&d, i](int y0, int y1) {
+            denoise_pass(d, i, y0, y1);
+        });
+    }
+    pool_run_rows(p->pool, size.y, [p](int y0, int y1) {
+        denoise_store(p, y0, y1);
+    });
 }
 
 /*
@@ -613,39 +1972,79 @@ static void make_preview(pathtracer_t *pt)
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4])
 {
     pathtracer_internal_t *p;
-    int changes, i, j, size = 0;
-    image_region region = image_region{};
-    vec4b v;
+    int changes, done, size = 0;
+    image_region region = image_region{}, dirty = image_region{};
+    bool empty = false, refresh = false, converted;
 
     if (!pt->p) pt->p = new pathtracer_internal_t();
     p = pt->p;
     p->trace_prms.resolution = max(pt->w, pt->h);
-    changes = sync(pt, pt->w, pt->h, viewport, pt->force_restart);
+    // The workers write into the buffer, so we restart if it changed.
+    changes = sync(pt, pt->w, pt->h, viewport,
+                   pt->force_restart || pt->buf != p->buf);
     pt->force_restart = false;
-    assert(p->display.size()[0] == pt->w);
-    assert(p->display.size()[1] == pt->h);
+    assert(p->image.size()[0] == pt->w);
+    assert(p->image.size()[1] == pt->h);
     if (changes) pt->status = PT_RUNNING;
 
-    if (changes & CHANGE_CAMERA) {
-        make_preview(pt);
-        pt->progress = 0;
-        return;
+    if (pt->show_noise != p->show_noise || pt->denoise != p->denoise) {
+        p->show_noise = pt->show_noise;
+        p->denoise = pt->denoise;
+        refresh = true;
     }
+    p->direct_display = !p->show_noise && !p->denoise;
+
+    // Read the count first, since the workers push the region before
+    // incrementing it.
+    done = p->tiles_done;
 
-    while (try_pop(p->trace_queue, p->trace_queuem, region)) {
-        tonemap(p->display, p->image, region, p->tonemap_prms);
-        for (i = region.min[1]; i < region.max[1]; i++)
-        for (j = region.min[0]; j < region.max[0]; j++) {
-            v = float_to_byte(p->display[{j, i}]);
-            memcpy(&pt->buf[(i * pt->w + j) * 4], &v, 4);
+    // If the workers couldn't push some regions, update the whole image.
+    if (p->ring.overflow.exchange(false)) {
+        while (ring_pop(p->ring, region, NULL)) {}
+        refresh = true;
+    }
+
+    while (true) {
+        if (!ring_pop(p->ring, region, &converted)) {
+            empty = true;
+            break;
+        }
+        dirty = dirty.size().x ? union_regions(dirty, region) : region;
+        // The denoiser needs the whole image, so we update it later.
+        if (p->denoise) {
+            p->denoise_dirty = true;
+        } else if (!refresh && (p->show_noise || !converted)) {
+            lock_guard<mutex> lock(p->snapshot.mutex);
+            update_display(p, region);
         }
         size += region.size().x * region.size().y;
         if (size >= p->image.size().x * p->image.size().y) break;
     }
-    pt->progress = (float)p->trace_sample / p->trace_prms.samples;
+    pt->progress = (float)done / max(p->tiles_total, 1);
 
-    if (pt->status != PT_FINISHED &&
-            p->trace_sample == p->trace_prms.samples) {
+    if (p->denoise && p->denoise_dirty && (
+            done == p->tiles_total ||
+            sys_get_time() - p->denoise_time >= DENOISE_DELAY)) {
+        refresh = true;
+    }
+    if (refresh) {
+        if (p->denoise) {
+            denoise_image(p);
+            p->denoise_dirty = false;
+            p->denoise_time = sys_get_time();
+        }
+        lock_guard<mutex> lock(p->snapshot.mutex);
+        pool_run_rows(p->pool, pt->h, [p](int y0, int y1) {
+            update_display(p, {{0, y0}, {p->image.size().x, y1}});
+        });
+        dirty = {{0, 0}, p->image.size()};
+    }
+    pt->dirty[0] = dirty.min.x;
+    pt->dirty[1] = dirty.min.y;
+    pt->dirty[2] = dirty.size().x;
+    pt->dirty[3] = dirty.size().y;
+
+    if (pt->status != PT_FINISHED && empty && done == p->tiles_total) {
         pt->status = PT_FINISHED;
     }
 }
@@ -658,12 +2057,327 @@ void pathtracer_stop(pathtracer_t *pt)
 {
     pathtracer_internal_t *p = pt->p;
     if (!p) return;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
+    pool_release(p);
     delete p;
     pt->p = nullptr;
 }
 
+/*
+ * Header of the partial render files, followed by the accumulated
+ * samples of each pixel, and the denoiser albedo and normal buffers.
+ */
+struct part_header_t {
+    char    magic[4];
+    int     version;
+    int     size[2];
+    int     samples;            // Total number of samples of the render.
+    int     samples_range[2];
+};
+
+struct part_pixel_t {
+    vec3f   radiance;
+    int     hits;
+    int     samples;
+};
+
+static const char PART_MAGIC[4] = {'G', 'X', 'P', 'T'};
+#define PART_VERSION 2
+
+// Save the samples accumulations of a part of the render.
+static int save_part(const pathtracer_internal_t *p, const char *path)
+{
+    FILE *file;
+    part_header_t header = {};
+    vector<part_pixel_t> pixels(p->state.pixels.size());
+    size_t i, n = pixels.size();
+    bool ok;
+
+    memcpy(header.magic, PART_MAGIC, 4);
+    header.version = PART_VERSION;
+    header.size[0] = p->image.size().x;
+    header.size[1] = p->image.size().y;
+    header.samples = p->job_prms.samples;
+    header.samples_range[0] = p->samples_range[0];
+    header.samples_range[1] = p->samples_range[1];
+    for (i = 0; i < n; i++) {
+        const trace_pixel &pixel = p->state.pixels[i];
+        pixels[i] = {pixel.radiance, pixel.hits, pixel.samples};
+    }
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot write %s", path);
+        return -1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         fwrite(pixels.data(), sizeof(pixels[0]), n, file) == n &&
+         fwrite(p->albedo.data(), sizeof(vec3f), n, file) == n &&
+         fwrite(p->normal.data(), sizeof(vec3f), n, file) == n;
+    fclose(file);
+    if (!ok) LOG_E("Cannot write %s", path);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Add the samples of a partial render file into the state.
+ *
+ * Parameters:
+ *   p      - The path tracer.
+ *   path   - Path of the part file.
+ *   first  - Set for the first part, that also gives the features.
+ *   header - Output header of the file.
+ */
+static int load_part(pathtracer_internal_t *p, const char *path, bool first,
+                     part_header_t &header)
+{
+    FILE *file;
+    vector<part_pixel_t> pixels;
+    vec2i size;
+    size_t i, n;
+    bool ok;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return -1;
+    }
+    if (    fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, PART_MAGIC, 4) != 0 ||
+            header.version != PART_VERSION ||
+            header.size[0] <= 0 || header.size[1] <= 0 ||
+            header.samples_range[0] < 0 ||
+            header.samples_range[0] >= header.samples_range[1] ||
+            header.samples_range[1] > header.samples) {
+        LOG_E("%s is not a render part file", path);
+        fclose(file);
+        return -1;
+    }
+    size = {header.size[0], header.size[1]};
+    if (first) {
+        p->state = make_trace_state(size);
+        p->albedo = yocto::image<vec3f>(size);
+        p->normal = yocto::image<vec3f>(size);
+    } else if (size != p->state.image_size) {
+        LOG_E("%s size doesn't match the other parts", path);
+        fclose(file);
+        return -1;
+    }
+    n = (size_t)size.x * size.y;
+    pixels.resize(n);
+    // All the parts have the same features, we only read the first ones.
+    ok = fread(pixels.data(), sizeof(pixels[0]), n, file) == n && (!first ||
+            (fread(p->albedo.data(), sizeof(vec3f), n, file) == n &&
+             fread(p->normal.data(), sizeof(vec3f), n, file) == n));
+    fclose(file);
+    if (!ok) {
+        LOG_E("%s is truncated", path);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        trace_pixel &pixel = p->state.pixels[i];
+        pixel.radiance += pixels[i].radiance;
+        pixel.hits += pixels[i].hits;
+        pixel.samples += pixels[i].samples;
+    }
+    LOG_I("Merge %s: samples %d to %d", path,
+          header.samples_range[0], header.samples_range[1]);
+    return 0;
+}
+
+/*
+ * Check that the parts of a render cover each sample exactly once, so
+ * that the merge gives the same image as a full render.
+ */
+static int check_parts(const char **parts, vector<part_header_t> &headers)
+{
+    size_t i;
+    int next = 0;
+
+    for (i = 1; i < headers.size(); i++) {
+        if (headers[i].samples != headers[0].samples) {
+            LOG_E("%s number of samples doesn't match the other parts",
+                  parts[i]);
+            return -1;
+        }
+    }
+    sort(headers.begin(), headers.end(),
+         [](const part_header_t &a, const part_header_t &b) {
+        return a.samples_range[0] < b.samples_range[0];
+    });
+    for (const part_header_t &header : headers) {
+        if (header.samples_range[0] < next) {
+            LOG_E("Parts samples overlap at %d", header.samples_range[0]);
+            return -1;
+        }
+        if (header.samples_range[0] > next) {
+            LOG_E("Missing part for samples %d to %d",
+                  next, header.samples_range[0]);
+            return -1;
+        }
+        next = header.samples_range[1];
+    }
+    if (next < headers[0].samples) {
+        LOG_E("Missing part for samples %d to %d", next, headers[0].samples);
+        return -1;
+    }
+    return 0;
+}
+
+// Save the tonemapped image, or the radiance for hdr files.
+static int save_result(pathtracer_t *pt, const char *path)
+{
+    pathtracer_internal_t *p = pt->p;
+
+    if (!is_hdr_filename(path))
+        return img_write(pt->buf, pt->w, pt->h, 4, path);
+    try {
+        save_image(path, p->denoise ? p->denoised : p->image);
+    } catch (const std::exception &e) {
+        LOG_E("%s", e.what());
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: pathtracer_render
+ * Render the current image into a file, without any display.
+ */
+int pathtracer_render(pathtracer_t *pt, const char *path)
+{
+    pathtracer_internal_t *p;
+    const float viewport[4] = {0, 0, (float)pt->w, (float)pt->h};
+    double start, t;
+    uint64_t nb_samples;
+
+    if (!pt->p) pt->p = new pathtracer_internal_t();
+    p = pt->p;
+    p->offline = true;
+    pt->force_restart = true;
+    reset_trace_stats();
+    start = sys_get_time();
+    while (true) {
+        pathtracer_iter(pt, viewport);
+        if (p->samples_range[0] >= p->samples_range[1]) {
+            LOG_E("No samples to render in part %d/%d",
+                  pt->part[0], pt->part[1]);
+            return -1;
+        }
+        t = sys_get_time() - start;
+        nb_samples = get_trace_stats().second;
+        fprintf(stderr, "\rrendering %3d%%  %.2f Msamples/s",
+                (int)(pt->progress * 100), nb_samples / max(t, 1e-6) / 1e6);
+        fflush(stderr);
+        if (pt->status == PT_FINISHED) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    fprintf(stderr, "\n");
+    LOG_I("Rendered %dx%d in %.1fs", pt->w, pt->h, t);
+
+    if (pt->part[1]) return save_part(p, path);
+    return save_result(pt, path);
+}
+
+/*
+ * Function: pathtracer_merge
+ * Merge the parts of a split render into the final image.
+ */
+int pathtracer_merge(pathtracer_t *pt, const char **parts, int nb_parts,
+                     const char *path)
+{
+    pathtracer_internal_t *p;
+    vector<part_header_t> headers(nb_parts);
+    int i, ret;
+    vec2i size;
+
+    pathtracer_stop(pt);
+    pt->p = p = new pathtracer_internal_t();
+    for (i = 0; i < nb_parts; i++) {
+        if (load_part(p, parts[i], i == 0, headers[i]) != 0) {
+            pathtracer_stop(pt);
+            return -1;
+        }
+    }
+    if (check_parts(parts, headers) != 0) {
+        pathtracer_stop(pt);
+        return -1;
+    }
+    size = p->state.image_size;
+    p->image = image4f(size);
+    for (i = 0; i < size.x * size.y; i++) {
+        const trace_pixel &pixel = p->state.pixels[i];
+        const vec3f c = pixel.hits ? pixel.radiance / pixel.hits : zero3f;
+        p->image[i] = {c.x, c.y, c.z,
+                       (float)pixel.hits / max(pixel.samples, 1)};
+    }
+    free(pt->buf);
+    pt->w = size.x;
+    pt->h = size.y;
+    pt->buf = (uint8_t*)calloc(pt->w * pt->h, 4);
+    p->buf = pt->buf;
+
+    p->stats.assign(size.x * size.y, pixel_stats_t{});
+    snapshot_init(p);
+    publish_region(p, {{0, 0}, size}, true);
+    pool_init(p);
+    p->denoise = pt->denoise;
+    if (p->denoise) denoise_image(p);
+    {
+        lock_guard<mutex> lock(p->snapshot.mutex);
+        update_display(p, {{0, 0}, size});
+    }
+    ret = save_result(pt, path);
+    pathtracer_stop(pt);
+    return ret;
+}
+
+/*
+ * Function: pathtracer_bench_rays
+ * Measure the speed of the rays intersections with the current image.
+ */
+double pathtracer_bench_rays(pathtracer_t *pt, int nb_rays, bool voxels,
+                             int *nb_hits)
+{
+    pathtracer_internal_t *p;
+    const float viewport[4] = {0, 0, (float)pt->w, (float)pt->h};
+    rng_state rng = make_rng(0);
+    ray3f ray;
+    vec3f pos, normal;
+    int i, hits = 0;
+    double t;
+
+    pathtracer_stop(pt);
+    pt->p = p = new pathtracer_internal_t();
+    p->no_voxels = !voxels;
+    p->offline = true;
+    p->trace_prms.resolution = max(pt->w, pt->h);
+    sync(pt, pt->w, pt->h, viewport, true);
+    stop_render(p);
+    const yocto_camera &camera = p->scene.cameras[0];
+
+    // Camera rays, plus a diffuse bounce ray for each hit.
+    t = sys_get_time();
+    for (i = 0; i < nb_rays; i++) {
+        ray = eval_camera(camera, rand2f(rng), {0.5, 0.5});
+        auto isec = intersect_bvh(p->bvh, ray);
+        if (!isec.hit) continue;
+        hits++;
+        if (++i >= nb_rays) break;
+        const yocto_instance &instance = p->scene.instances[isec.instance];
+        pos = eval_position(p->scene, instance, isec.element, isec.uv);
+        normal = eval_normal(p->scene, instance, isec.element, isec.uv,
+                             false);
+        if (dot(normal, ray.d) > 0) normal = -normal;
+        isec = intersect_bvh(p->bvh, {pos, sample_hemisphere(
+                                       normal, rand2f(rng))});
+        if (isec.hit) hits++;
+    }
+    t = sys_get_time() - t;
+    pathtracer_stop(pt);
+    if (nb_hits) *nb_hits = hits;
+    return nb_rays / t;
+}
+
 #else // Dummy implementation.
 
 extern "C" {
@@ -672,5 +2386,10 @@ extern "C" {
 
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4]) {}
 void pathtracer_stop(pathtracer_t *pt) {}
+int pathtracer_render(pathtracer_t *pt, const char *path) { return -1; }
+int pathtracer_merge(pathtracer_t *pt, const char **parts, int nb_parts,
+                     const char *path) { return -1; }
+double pathtracer_bench_rays(pathtracer_t *pt, int nb_rays, bool voxels,
+                             int *nb_hits) { return 0; }
 
 #endif // YOCTO
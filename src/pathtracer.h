@@ -42,11 +42,20 @@ typedef struct {
     int status;
     uint8_t *buf;       // RGBA buffer.
     int w, h;           // Size of the buffer.
+    int dirty[4];       // Rect (x, y, w, h) of buf updated by the last iter.
     float progress;
     bool force_restart;
     texture_t *texture;
     pathtracer_internal_t *p;
     int num_samples;
+    // Stop tracing a tile once its relative noise gets below this value.
+    // Zero to always trace all the samples.
+    float noise_threshold;
+    bool show_noise;    // Show a heatmap of the noise instead of the image.
+    bool denoise;       // Filter the noise of the image.
+    // Index and number of parts when the samples are split over several
+    // processes, zero to render all of them.  See <pathtracer_merge>.
+    int part[2];
     struct {
         int type;
         float energy;
@@ -74,3 +83,66 @@ void pathtracer_iter(pathtracer_t *pt, const float viewport[4]);
  * Stop the pathtracer thread if it is running.
  */
 void pathtracer_stop(pathtracer_t *pt);
+
+/*
+ * Function: pathtracer_render
+ * Render the current image into a file, without any display.
+ *
+ * Block until all the samples have been traced, printing the progress
+ * and the number of samples per second on stderr.
+ *
+ * Parameters:
+ *   pt   - A pathtracer instance, with an allocated buffer of the size of
+ *          the image to render.
+ *   path - Output file.  If the extension is hdr, exr or pfm, we save the
+ *          linear radiance instead of the tonemapped image.  If pt->part
+ *          is set, we save the raw samples of the part instead, to be
+ *          merged later with <pathtracer_merge>.
+ *
+ * Return:
+ *   Zero on success.
+ */
+int pathtracer_render(pathtracer_t *pt, const char *path);
+
+/*
+ * Function: pathtracer_merge
+ * Merge the parts of a split render into the final image.
+ *
+ * Each part traces a different range of samples of all the pixels, and
+ * each samples batch uses its own random sequence, so the merged image is
+ * the same as if we rendered all the samples in a single process (with no
+ * adaptive sampling, that is always disabled for the parts).
+ *
+ * Parameters:
+ *   pt       - A pathtracer instance.  The buffer gets reallocated to the
+ *              size of the parts.
+ *   parts    - Paths of the part files saved by <pathtracer_render>.
+ *   nb_parts - Number of parts.
+ *   path     - Output file, as for <pathtracer_render>.
+ *
+ * Return:
+ *   Zero on success.  The merge fails if the parts don't cover all the
+ *   samples exactly once.
+ */
+int pathtracer_merge(pathtracer_t *pt, const char **parts, int nb_parts,
+                     const char *path);
+
+/*
+ * Function: pathtracer_bench_rays
+ * Measure the speed of the rays intersections with the current image.
+ *
+ * Cast camera rays and diffuse bounce rays from a single thread.  This
+ * stops the current rendering.
+ *
+ * Parameters:
+ *   pt       - A pathtracer instance, with the size of the image to render.
+ *   nb_rays  - Number of rays to cast.
+ *   voxels   - If false, use the triangles bvh for all the shapes, instead
+ *              of the voxel grids.
+ *   nb_hits  - Output number of rays that hit a surface.  Can be NULL.
+ *
+ * Return:
+ *   The number of rays per second.
+ */
+double pathtracer_bench_rays(pathtracer_t *pt, int nb_rays, bool voxels,
+                             int *nb_hits);
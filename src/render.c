@@ -20,6 +20,9 @@
 #include "goxel.h"
 
 #include "shader_cache.h"
+#include "xxhash.h"
+
+#include <limits.h>
 
 #ifndef RENDER_CACHE_SIZE
 #   define RENDER_CACHE_SIZE (1 * GB)
@@ -56,10 +59,8 @@ struct render_item_t
     int             type;
     block_item_key_t key;
 
-    union {
-        mesh_t          *mesh;
-        float           mat[4][4];
-    };
+    mesh_t          *mesh;
+    float           mat[4][4];      // Also the mesh model matrix.
     material_t      material;
     uint8_t         color[4];
     float           clip_box[4][4];
@@ -69,6 +70,7 @@ struct render_item_t
     int             effects;
 
     GLuint      vertex_buffer;
+    GLuint      index_buffer;   // Only for indexed triangles.
     int         size;           // 4 (quads) or 3 (triangles).
     int         nb_elements;    // Number of quads or triangle.
     int         subdivide;      // Unit per voxel (usually 1).
@@ -79,6 +81,126 @@ struct render_item_t
 
 // The cache of the g_items.
 static cache_t   *g_items_cache;
+// Incremented each time an item is removed from the cache, so that we know
+// when the pointers stored in the blocks lists are not valid anymore.
+static uint64_t  g_items_gen = 1;
+
+/*
+ * To avoid recomputing the 27 neighbors keys of all the blocks at each
+ * frame, we keep for each rendered mesh the list of its blocks with their
+ * render item key.  When a mesh changes, we build the new list from the
+ * previous one, and only recompute the keys of the blocks whose data or
+ * neighbors data changed.
+ */
+typedef struct render_block render_block_t;
+struct render_block
+{
+    UT_hash_handle   hh;     // Hash table of pos -> render_block_t.
+    int              pos[3];
+    uint64_t         data_id;
+    bool             dirty;
+    block_item_key_t key;
+    render_item_t    *item;  // Only valid if list->items_gen == g_items_gen.
+    bool             refined; // Level of detail state, see render_lod_block.
+};
+
+typedef struct blocks_list blocks_list_t;
+struct blocks_list
+{
+    blocks_list_t   *next, *prev;
+    uint64_t        mesh_key;
+    int             effects;
+    int             lod;    // Level of detail of the mesh.
+    render_block_t  *blocks;
+    uint64_t        items_gen;
+    int             last_used;
+};
+
+static blocks_list_t *g_blocks_lists;
+static int g_submit_count; // Used to release the unused blocks lists.
+static void blocks_lists_cleanup(bool all);
+
+/*
+ * Level of detail: the far away blocks are rendered from a downsampled
+ * version of the mesh, so that we don't draw many voxels per pixel.
+ *
+ * For each rendered mesh we keep a pyramid of lower resolution meshes,
+ * where each level has half the resolution of the previous one.  The
+ * levels are only created when needed.  When the mesh changes we update
+ * the pyramid of its previous version in place, and mesh_downsample only
+ * recomputes the blocks that changed.
+ */
+#define RENDER_LOD_MAX 6
+// Maximum size in pixel of a rendered voxel before we use a finer level.
+#define RENDER_LOD_PIXELS 1.0
+// Fraction of a level the view has to move before we switch level, to
+// avoid flickering between two levels.
+#define RENDER_LOD_HYSTERESIS 0.25
+
+typedef struct lod_pyramid lod_pyramid_t;
+struct lod_pyramid
+{
+    lod_pyramid_t   *next, *prev;
+    uint64_t        mesh_key;
+    // Level 0 is a copy of the input mesh, used to find the blocks that
+    // changed when we update the pyramid.
+    mesh_t          *levels[RENDER_LOD_MAX + 1];
+    int             last_used;
+};
+
+static lod_pyramid_t *g_lod_pyramids;
+static void lod_pyramids_cleanup(bool all);
+
+/*
+ * Ray marching rendering (EFFECT_RAYMARCH).
+ *
+ * Instead of generating the blocks vertices, we copy the blocks voxels
+ * into slots of a 3D texture atlas, and render the box of the mesh with a
+ * shader that walks the voxels along the view rays.  For each mesh we also
+ * create a small 3D texture, the table, that gives the atlas slot of each
+ * block of the mesh box.
+ *
+ * The slots are keyed by the blocks data ids, so after an edit we only
+ * upload the voxels of the modified blocks and rebuild the table.
+ *
+ * Not supported with GLES2, that doesn't have 3D textures.
+ */
+
+// Size of the atlas, in blocks (32MB).
+static const int RAYMARCH_ATLAS_SIZE[3] = {16, 16, 8};
+
+typedef struct raymarch_slot raymarch_slot_t;
+struct raymarch_slot
+{
+    UT_hash_handle  hh;         // Hash table of data_id -> slot.
+    raymarch_slot_t *next, *prev; // List sorted from least recently used.
+    uint64_t        data_id;
+    int             index;      // Index of the slot in the atlas.
+    int             last_used;
+};
+
+typedef struct raymarch_volume raymarch_volume_t;
+struct raymarch_volume
+{
+    raymarch_volume_t *next, *prev;
+    uint64_t        mesh_key;
+    uint64_t        slots_gen;  // g_raymarch_slots_gen when table was set.
+    GLuint          table;
+    int             origin[3];  // Position of the box in voxels.
+    int             size[3];    // Size of the box in blocks.
+    int             last_used;
+};
+
+static GLuint g_raymarch_atlas;
+static GLuint g_raymarch_cube_buffer;
+static raymarch_slot_t *g_raymarch_slots;
+static raymarch_slot_t *g_raymarch_slots_lru;
+static int g_raymarch_nb_slots;
+// Incremented each time a slot is reused for an other block.
+static uint64_t g_raymarch_slots_gen;
+static raymarch_volume_t *g_raymarch_volumes;
+static void raymarch_cleanup(bool all);
+
 static const int BATCH_QUAD_COUNT = 1 << 14;
 static model3d_t *g_cube_model;
 static model3d_t *g_line_model;
@@ -94,8 +216,12 @@ static GLuint g_occlusion_tex;
 static GLuint g_bump_tex;
 static GLuint g_shadow_map_fbo;
 static texture_t *g_shadow_map; // XXX: the fbo should be part of the tex.
+// Key of the scene currently rendered in the shadow map, and its matrix.
+static uint32_t g_shadow_map_key;
+static float g_shadow_map_mvp[4][4];
 
 #define OFFSET(n) offsetof(voxel_vertex_t, n)
+#define PACKED_OFFSET(n) offsetof(voxel_vertex_packed_t, n)
 
 enum {
     A_POS_LOC = 0,
@@ -107,15 +233,19 @@ enum {
     A_UV_LOC,
     A_BUMP_UV_LOC,
     A_OCCLUSION_UV_LOC,
+    A_PACKED_LOC,
+    A_COUNT
 };
 
-// The list of all the attributes used by the shaders.
-static const struct {
+typedef struct {
     int size;
     int type;
     int norm;
     int offset;
-} ATTRIBUTES[] = {
+} attribute_t;
+
+// The list of all the attributes used by the shaders.
+static const attribute_t ATTRIBUTES[A_COUNT] = {
     [A_POS_LOC] = {3, GL_UNSIGNED_BYTE, false, OFFSET(pos)},
     [A_NORMAL_LOC] = { 3, GL_BYTE, false, OFFSET(normal)},
     [A_TANGENT_LOC] = {3, GL_BYTE, false, OFFSET(tangent)},
@@ -127,6 +257,14 @@ static const struct {
     [A_OCCLUSION_UV_LOC] = {2, GL_UNSIGNED_BYTE, false, OFFSET(occlusion_uv)},
 };
 
+// The attributes used with the packed vertices.  The face and corner index
+// is the fourth component of the position.
+static const attribute_t PACKED_ATTRIBUTES[A_COUNT] = {
+    [A_POS_LOC] = {4, GL_UNSIGNED_BYTE, false, PACKED_OFFSET(pos)},
+    [A_COLOR_LOC] = {4, GL_UNSIGNED_BYTE, true, PACKED_OFFSET(color)},
+    [A_PACKED_LOC] = {4, GL_UNSIGNED_BYTE, false, PACKED_OFFSET(shadow_mask)},
+};
+
 static const char *ATTR_NAMES[] = {
     [A_POS_LOC] = "a_pos",
     [A_NORMAL_LOC] = "a_normal",
@@ -137,6 +275,7 @@ static const char *ATTR_NAMES[] = {
     [A_UV_LOC] = "a_uv",
     [A_BUMP_UV_LOC] = "a_bump_uv",
     [A_OCCLUSION_UV_LOC] = "a_occlusion_uv",
+    [A_PACKED_LOC] = "a_packed",
     NULL,
 };
 
@@ -342,6 +481,10 @@ void render_init()
 
 void render_deinit(void)
 {
+    blocks_lists_cleanup(true);
+    lod_pyramids_cleanup(true);
+    raymarch_cleanup(true);
+    g_shadow_map_key = 0;
     cache_delete(g_items_cache);
     GL(glDeleteBuffers(1, &g_index_buffer));
     g_index_buffer = 0;
@@ -356,75 +499,424 @@ void render_deinit(void)
 
 // A global buffer large enough to contain all the vertices for any block.
 static voxel_vertex_t* g_vertices_buffer = NULL;
+// Same thing for the indices of the indexed meshes.
+static uint16_t *g_indices_buffer = NULL;
 
 // Used for the cache.
 static int item_delete(void *item_)
 {
     render_item_t *item = item_;
     GL(glDeleteBuffers(1, &item->vertex_buffer));
+    if (item->index_buffer) GL(glDeleteBuffers(1, &item->index_buffer));
     free(item);
+    g_items_gen++;
     return 0;
 }
 
 static render_item_t *get_item_for_block(
         const mesh_t *mesh,
-        mesh_iterator_t *iter,
         const int block_pos[3],
-        int effects, float smoothness)
+        const block_item_key_t *key,
+        int effects)
 {
     render_item_t *item;
-    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH;
-    uint64_t block_data_id;
-    int p[3], i, x, y, z;
-    block_item_key_t key = {};
-
-    memset(&key, 0, sizeof(key)); // Just to be sure!
-    key.effects = effects & effects_mask;
-    // The hash key take into consideration all the blocks adjacent to
-    // the current block!
-    for (i = 0, z = -1; z <= 1; z++)
-    for (y = -1; y <= 1; y++)
-    for (x = -1; x <= 1; x++, i++) {
-        p[0] = block_pos[0] + x * BLOCK_SIZE;
-        p[1] = block_pos[1] + y * BLOCK_SIZE;
-        p[2] = block_pos[2] + z * BLOCK_SIZE;
-        mesh_get_block_data(mesh, NULL, p, &block_data_id);
-        key.ids[i] = block_data_id;
-    }
+    int vertex_size, nb_vertices, nb_indices = 0;
 
-    item = cache_get(g_items_cache, &key, sizeof(key));
+    item = cache_get(g_items_cache, key, sizeof(*key));
     if (item) return item;
 
+    PROFILER_SCOPE("get_item_for_block");
     item = calloc(1, sizeof(*item));
-    item->key = key;
+    item->key = *key;
     GL(glGenBuffers(1, &item->vertex_buffer));
     GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
     if (!g_vertices_buffer)
-        g_vertices_buffer = calloc(
-                BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
-                sizeof(*g_vertices_buffer));
-    item->nb_elements = mesh_generate_vertices(
-            mesh, block_pos, effects, g_vertices_buffer,
-            &item->size, &item->subdivide);
-    if (item->nb_elements > BATCH_QUAD_COUNT) {
-        LOG_W("Too many quads!");
-        item->nb_elements = BATCH_QUAD_COUNT;
+        g_vertices_buffer = calloc(MESH_BLOCK_MAX_VERTICES,
+                                   sizeof(*g_vertices_buffer));
+    if (key->effects & EFFECT_PACKED_VERTICES) {
+        // The packed vertices are smaller, so they fit in the same buffer.
+        vertex_size = sizeof(voxel_vertex_packed_t);
+        item->size = 4;
+        item->subdivide = 1;
+        item->nb_elements = mesh_generate_vertices_packed(
+                mesh, block_pos, (voxel_vertex_packed_t*)g_vertices_buffer);
+        nb_vertices = item->nb_elements * item->size;
+    } else if (mesh_use_indexed_vertices(key->effects)) {
+        if (!g_indices_buffer)
+            g_indices_buffer = calloc(MESH_BLOCK_MAX_VERTICES,
+                                      sizeof(*g_indices_buffer));
+        vertex_size = sizeof(voxel_vertex_t);
+        item->size = 3;
+        nb_vertices = mesh_generate_indexed_vertices(
+                mesh, block_pos, effects, g_vertices_buffer,
+                g_indices_buffer, &nb_indices, &item->subdivide);
+        item->nb_elements = nb_indices / 3;
+    } else {
+        vertex_size = sizeof(voxel_vertex_t);
+        item->nb_elements = mesh_generate_vertices(
+                mesh, block_pos, effects, g_vertices_buffer,
+                &item->size, &item->subdivide);
+        nb_vertices = item->nb_elements * item->size;
     }
     if (item->nb_elements != 0) {
-        GL(glBufferData(GL_ARRAY_BUFFER,
-                item->nb_elements * item->size * sizeof(*g_vertices_buffer),
-                g_vertices_buffer, GL_STATIC_DRAW));
+        GL(glBufferData(GL_ARRAY_BUFFER, nb_vertices * vertex_size,
+                        g_vertices_buffer, GL_STATIC_DRAW));
+    }
+    if (item->nb_elements != 0 && nb_indices) {
+        GL(glGenBuffers(1, &item->index_buffer));
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, item->index_buffer));
+        GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                        nb_indices * sizeof(*g_indices_buffer),
+                        g_indices_buffer, GL_STATIC_DRAW));
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
     }
 
-    cache_add(g_items_cache, &key, sizeof(key), item,
-              item->nb_elements * item->size * sizeof(*g_vertices_buffer),
+    cache_add(g_items_cache, key, sizeof(*key), item,
+              nb_vertices * vertex_size +
+              nb_indices * sizeof(*g_indices_buffer),
               item_delete);
     return item;
 }
 
+static void blocks_list_delete(blocks_list_t *list)
+{
+    render_block_t *block, *tmp;
+    HASH_ITER(hh, list->blocks, block, tmp) {
+        HASH_DEL(list->blocks, block);
+        free(block);
+    }
+    free(list);
+}
+
+static uint64_t blocks_list_get_data_id(const blocks_list_t *list,
+                                        const int pos[3])
+{
+    render_block_t *block;
+    HASH_FIND(hh, list->blocks, pos, 3 * sizeof(int), block);
+    return block ? block->data_id : 0;
+}
+
+static render_block_t *blocks_list_add(blocks_list_t *list, const int pos[3],
+                                       uint64_t data_id)
+{
+    render_block_t *block = calloc(1, sizeof(*block));
+    memcpy(block->pos, pos, sizeof(block->pos));
+    block->data_id = data_id;
+    HASH_ADD(hh, list->blocks, pos, sizeof(block->pos), block);
+    return block;
+}
+
+// Mark all the blocks whose key depends on a given block position.
+static void blocks_list_mark_dirty(blocks_list_t *list, const int pos[3])
+{
+    render_block_t *block;
+    int x, y, z, p[3];
+    for (z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++) {
+        p[0] = pos[0] + x * BLOCK_SIZE;
+        p[1] = pos[1] + y * BLOCK_SIZE;
+        p[2] = pos[2] + z * BLOCK_SIZE;
+        HASH_FIND(hh, list->blocks, p, sizeof(p), block);
+        if (block) block->dirty = true;
+    }
+}
+
+static void blocks_list_compute_key(const blocks_list_t *list,
+                                    render_block_t *block)
+{
+    int p[3], i, x, y, z;
+
+    memset(&block->key, 0, sizeof(block->key)); // Just to be sure!
+    block->key.effects = list->effects;
+    // The hash key take into consideration all the blocks adjacent to
+    // the current block!
+    for (i = 0, z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++, i++) {
+        p[0] = block->pos[0] + x * BLOCK_SIZE;
+        p[1] = block->pos[1] + y * BLOCK_SIZE;
+        p[2] = block->pos[2] + z * BLOCK_SIZE;
+        block->key.ids[i] = blocks_list_get_data_id(list, p);
+    }
+}
+
+/*
+ * Create the list of blocks to render for a mesh: all the mesh blocks
+ * plus the neighbors of the non empty ones.  If a base list is given, we
+ * only compute the keys of the blocks that changed compared to it.
+ */
+static blocks_list_t *blocks_list_create(const mesh_t *mesh, int effects,
+                                         int lod, const blocks_list_t *base)
+{
+    const int NEIGHBORS[6][3] = {
+        {0, 0, -1}, {0, 0, +1},
+        {0, -1, 0}, {0, +1, 0},
+        {-1, 0, 0}, {+1, 0, 0},
+    };
+    blocks_list_t *list;
+    render_block_t *block, *other;
+    mesh_iterator_t iter;
+    int i, p[3];
+    uint64_t data_id;
+
+    list = calloc(1, sizeof(*list));
+    list->mesh_key = mesh_get_key(mesh);
+    list->effects = effects;
+    list->lod = lod;
+    list->items_gen = g_items_gen;
+
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, p)) {
+        mesh_get_block_data(mesh, &iter, p, &data_id);
+        blocks_list_add(list, p, data_id);
+    }
+    for (block = list->blocks; block; block = block->hh.next) {
+        if (!block->data_id) continue;
+        for (i = 0; i < 6; i++) {
+            p[0] = block->pos[0] + NEIGHBORS[i][0] * BLOCK_SIZE;
+            p[1] = block->pos[1] + NEIGHBORS[i][1] * BLOCK_SIZE;
+            p[2] = block->pos[2] + NEIGHBORS[i][2] * BLOCK_SIZE;
+            HASH_FIND(hh, list->blocks, p, sizeof(p), other);
+            if (!other) blocks_list_add(list, p, 0);
+        }
+    }
+
+    // Find the blocks whose neighborhood changed since the base list.
+    for (block = list->blocks; block; block = block->hh.next) {
+        if (!base) {
+            block->dirty = true;
+            continue;
+        }
+        if (blocks_list_get_data_id(base, block->pos) != block->data_id)
+            blocks_list_mark_dirty(list, block->pos);
+    }
+    if (base) {
+        for (other = base->blocks; other; other = other->hh.next) {
+            if (!other->data_id) continue;
+            HASH_FIND(hh, list->blocks, other->pos, sizeof(other->pos),
+                      block);
+            if (!block) blocks_list_mark_dirty(list, other->pos);
+        }
+    }
+
+    for (block = list->blocks; block; block = block->hh.next) {
+        other = NULL;
+        if (base)
+            HASH_FIND(hh, base->blocks, block->pos, sizeof(block->pos),
+                      other);
+        if (other) block->refined = other->refined;
+        if (other && !block->dirty) {
+            block->key = other->key;
+            if (base->items_gen == g_items_gen) block->item = other->item;
+        } else {
+            blocks_list_compute_key(list, block);
+        }
+        block->dirty = false;
+    }
+    return list;
+}
+
+/*
+ * Return the cached blocks list of a mesh, creating it if needed.
+ *
+ * When the mesh is not in the cache, we use as a base the most recently
+ * used list of the same level of detail that has not been used in the
+ * current frame, since it is most likely the previous version of the mesh.
+ */
+static blocks_list_t *get_blocks_list(const mesh_t *mesh, int effects,
+                                      int lod)
+{
+    blocks_list_t *list, *base = NULL;
+    uint64_t mesh_key = mesh_get_key(mesh);
+
+    effects &= EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH |
+               EFFECT_SURFACE_NETS | EFFECT_PACKED_VERTICES;
+    DL_FOREACH(g_blocks_lists, list) {
+        if (list->mesh_key == mesh_key && list->effects == effects)
+            goto end;
+    }
+    DL_FOREACH(g_blocks_lists, list) {
+        if (list->effects != effects || list->lod != lod) continue;
+        if (list->last_used == g_submit_count) continue;
+        if (!base || list->last_used > base->last_used) base = list;
+    }
+    list = blocks_list_create(mesh, effects, lod, base);
+    DL_APPEND(g_blocks_lists, list);
+end:
+    list->last_used = g_submit_count;
+    return list;
+}
+
+static render_item_t *blocks_list_get_item(blocks_list_t *list,
+                                           render_block_t *block,
+                                           const mesh_t *mesh, int effects)
+{
+    render_block_t *b;
+    // If some items got removed from the cache, we need to query all of them
+    // again.
+    if (list->items_gen != g_items_gen) {
+        for (b = list->blocks; b; b = b->hh.next) b->item = NULL;
+        list->items_gen = g_items_gen;
+    }
+    if (!block->item)
+        block->item = get_item_for_block(mesh, block->pos, &block->key,
+                                         effects);
+    return block->item;
+}
+
+// Release the blocks lists that haven't been used for a few renders.
+static void blocks_lists_cleanup(bool all)
+{
+    blocks_list_t *list, *tmp;
+    DL_FOREACH_SAFE(g_blocks_lists, list, tmp) {
+        if (!all && g_submit_count - list->last_used < 8) continue;
+        DL_DELETE(g_blocks_lists, list);
+        blocks_list_delete(list);
+    }
+}
+
+static void lod_pyramid_delete(lod_pyramid_t *pyramid)
+{
+    int i;
+    for (i = 0; i <= RENDER_LOD_MAX; i++)
+        mesh_delete(pyramid->levels[i]);
+    free(pyramid);
+}
+
+// Release the lod pyramids that haven't been used for a few renders.
+static void lod_pyramids_cleanup(bool all)
+{
+    lod_pyramid_t *pyramid, *tmp;
+    DL_FOREACH_SAFE(g_lod_pyramids, pyramid, tmp) {
+        if (!all && g_submit_count - pyramid->last_used < 8) continue;
+        DL_DELETE(g_lod_pyramids, pyramid);
+        lod_pyramid_delete(pyramid);
+    }
+}
+
+// Update all the created levels of a pyramid to a new version of its mesh.
+static void lod_pyramid_update(lod_pyramid_t *pyramid, const mesh_t *mesh)
+{
+    int i;
+    mesh_t *prev, *tmp;
+
+    prev = pyramid->levels[0];
+    pyramid->levels[0] = mesh_copy(mesh);
+    pyramid->mesh_key = mesh_get_key(mesh);
+    for (i = 1; i <= RENDER_LOD_MAX && pyramid->levels[i]; i++) {
+        tmp = mesh_copy(pyramid->levels[i]);
+        mesh_downsample(pyramid->levels[i - 1], prev, pyramid->levels[i]);
+        mesh_delete(prev);
+        prev = tmp;
+    }
+    mesh_delete(prev);
+}
+
+/*
+ * Return a level of the lod pyramid of a mesh, creating it if needed.
+ * The level 0 is the mesh itself.
+ *
+ * When the mesh is not in the cache, we update the most recently used
+ * pyramid that has not been used in the current frame, since it is most
+ * likely the one of the previous version of the mesh.
+ */
+static mesh_t *get_lod_mesh(mesh_t *mesh, int level)
+{
+    lod_pyramid_t *pyramid, *base = NULL;
+    uint64_t mesh_key = mesh_get_key(mesh);
+
+    assert(level >= 0 && level <= RENDER_LOD_MAX);
+    if (level == 0) return mesh;
+    DL_FOREACH(g_lod_pyramids, pyramid) {
+        if (pyramid->mesh_key == mesh_key) break;
+    }
+    if (!pyramid) {
+        DL_FOREACH(g_lod_pyramids, pyramid) {
+            if (pyramid->last_used == g_submit_count) continue;
+            if (!base || pyramid->last_used > base->last_used)
+                base = pyramid;
+        }
+        pyramid = base;
+        if (pyramid) {
+            lod_pyramid_update(pyramid, mesh);
+        } else {
+            pyramid = calloc(1, sizeof(*pyramid));
+            pyramid->mesh_key = mesh_key;
+            pyramid->levels[0] = mesh_copy(mesh);
+            DL_APPEND(g_lod_pyramids, pyramid);
+        }
+    }
+    pyramid->last_used = g_submit_count;
+    if (!pyramid->levels[level]) {
+        pyramid->levels[level] = mesh_new();
+        mesh_downsample(get_lod_mesh(mesh, level - 1), NULL,
+                        pyramid->levels[level]);
+    }
+    return pyramid->levels[level];
+}
+
+// Return the attributes table and vertex size for a given effects.
+static const attribute_t *get_attributes(int effects, int *stride)
+{
+    if (effects & EFFECT_PACKED_VERTICES) {
+        *stride = sizeof(voxel_vertex_packed_t);
+        return PACKED_ATTRIBUTES;
+    }
+    *stride = sizeof(voxel_vertex_t);
+    return ATTRIBUTES;
+}
+
+/*
+ * Draw the vertices of a block item.
+ *
+ * The quads indices buffer only covers BATCH_QUAD_COUNT quads, since we
+ * use 16 bits indices.  For blocks with more quads we draw the vertex
+ * buffer in several ranges, moving the attributes pointers each time.
+ *
+ * Parameters:
+ *   item   - The block item to draw.
+ *   lines  - If set, render the quads edges instead of the faces.
+ */
+static void draw_block_item(const render_item_t *item, bool lines)
+{
+    int attr, ofs, nb, stride;
+    intptr_t base;
+    const attribute_t *attrs;
+
+    attrs = get_attributes(item->key.effects, &stride);
+    for (ofs = 0; ofs < item->nb_elements; ofs += nb) {
+        nb = item->nb_elements - ofs;
+        if (item->size == 4) nb = min(nb, BATCH_QUAD_COUNT);
+        base = ofs * item->size * stride;
+        for (attr = 0; attr < A_COUNT; attr++) {
+            if (!attrs[attr].size) continue;
+            GL(glVertexAttribPointer(attr,
+                                     attrs[attr].size,
+                                     attrs[attr].type,
+                                     attrs[attr].norm,
+                                     stride,
+                                     (void*)(base + attrs[attr].offset)));
+        }
+        if (item->index_buffer) {
+            GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, item->index_buffer));
+            GL(glDrawElements(GL_TRIANGLES, nb * 3, GL_UNSIGNED_SHORT, 0));
+            GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+        } else if (item->size != 4) {
+            // Triangles don't use the index buffer.
+            GL(glDrawArrays(GL_TRIANGLES, 0, nb * item->size));
+        } else if (!lines) {
+            GL(glDrawElements(GL_TRIANGLES, nb * 6, GL_UNSIGNED_SHORT, 0));
+        } else {
+            GL(glDrawElements(GL_LINES, nb * 8, GL_UNSIGNED_SHORT,
+                              (void*)(uintptr_t)(BATCH_QUAD_COUNT * 6 * 2)));
+        }
+    }
+}
+
 static void render_block_(renderer_t *rend, mesh_t *mesh,
-                          mesh_iterator_t *iter,
-                          const int block_pos[3],
+                          blocks_list_t *list,
+                          render_block_t *block,
                           int block_id,
                           const material_t *material,
                           int effects, gl_shader_t *shader,
@@ -432,11 +924,10 @@ static void render_block_(renderer_t *rend, mesh_t *mesh,
 {
     render_item_t *item;
     float block_model[4][4];
-    int attr;
     float block_id_f[2];
+    const int *block_pos = block->pos;
 
-    item = get_item_for_block(mesh, iter, block_pos, effects,
-                              rend->settings.smoothness);
+    item = blocks_list_get_item(list, block, mesh, effects);
     if (item->nb_elements == 0) return;
     GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
     if (gl_has_uniform(shader, "u_block_id")) {
@@ -446,44 +937,24 @@ static void render_block_(renderer_t *rend, mesh_t *mesh,
     }
     gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
 
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++) {
-        GL(glVertexAttribPointer(attr,
-                                 ATTRIBUTES[attr].size,
-                                 ATTRIBUTES[attr].type,
-                                 ATTRIBUTES[attr].norm,
-                                 sizeof(voxel_vertex_t),
-                                 (void*)(intptr_t)ATTRIBUTES[attr].offset));
-    }
-
     mat4_copy(model, block_model);
     mat4_itranslate(block_model, block_pos[0], block_pos[1], block_pos[2]);
     gl_update_uniform(shader, "u_model", block_model);
-    if (item->size == 4) {
-        if (!(effects & (EFFECT_GRID | EFFECT_EDGES))) {
-            GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
-        } else {
-            gl_update_uniform(shader, "u_l_amb", 0.0);
-            gl_update_uniform(shader, "u_z_ofs", -0.001);
-            GL(glDrawElements(GL_LINES, item->nb_elements * 8,
-                              GL_UNSIGNED_SHORT,
-                              (void*)(uintptr_t)(BATCH_QUAD_COUNT * 6 * 2)));
-            gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
-            gl_update_uniform(shader, "u_z_ofs", 0.0);
-        }
+    if (item->size == 4 && (effects & (EFFECT_GRID | EFFECT_EDGES))) {
+        gl_update_uniform(shader, "u_l_amb", 0.0);
+        gl_update_uniform(shader, "u_z_ofs", -0.001);
+        draw_block_item(item, true);
+        gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+        gl_update_uniform(shader, "u_z_ofs", 0.0);
     } else {
-        GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+        draw_block_item(item, false);
     }
 
 #ifndef GLES2
     if (effects & EFFECT_WIREFRAME) {
         gl_update_uniform(shader, "u_l_amb", 0.0);
         GL(glPolygonMode(GL_FRONT_AND_BACK, GL_LINE));
-        if (item->size == 4)
-            GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
-        else
-            GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+        draw_block_item(item, false);
         GL(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
         gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
     }
@@ -519,23 +990,13 @@ static void compute_shadow_map_box(
                 const renderer_t *rend,
                 float rect[6])
 {
-    const float POS[8][3] = {
-        {0, 0, 0},
-        {1, 0, 0},
-        {1, 0, 1},
-        {0, 0, 1},
-        {0, 1, 0},
-        {1, 1, 0},
-        {1, 1, 1},
-        {0, 1, 1},
-    };
     const int N = BLOCK_SIZE;
 
     render_item_t *item;
-    float p[3];
+    float p[3], ext[3];
     int i, bpos[3];
     mesh_iterator_t iter;
-    float view_mat[4][4], light_dir[3];
+    float view_mat[4][4], light_dir[3], mat[4][4];
 
     get_light_dir(rend, light_dir);
     mat4_lookat(view_mat, light_dir, VEC(0, 0, 0), VEC(0, 1, 0));
@@ -548,39 +1009,447 @@ static void compute_shadow_map_box(
 
     DL_FOREACH(rend->items, item) {
         if (item->type != ITEM_MESH) continue;
+        mat4_mul(view_mat, item->mat, mat);
+        // Since the matrix is linear, all the blocks of a mesh have the
+        // same extent in light space, so we only need to project their
+        // centers.
+        for (i = 0; i < 3; i++) {
+            ext[i] = (fabs(mat[0][i]) + fabs(mat[1][i]) +
+                      fabs(mat[2][i])) * N / 2;
+        }
         iter = mesh_get_iterator(item->mesh, MESH_ITER_BLOCKS);
         while (mesh_iter(&iter, bpos)) {
-            for (i = 0; i < 8; i++) {
-                vec3_set(p, bpos[0], bpos[1], bpos[2]);
-                vec3_addk(p, POS[i], N, p);
-                mat4_mul_vec3(view_mat, p, p);
-                rect[0] = min(rect[0], p[0]);
-                rect[1] = max(rect[1], p[0]);
-                rect[2] = min(rect[2], p[1]);
-                rect[3] = max(rect[3], p[1]);
-                rect[4] = min(rect[4], -p[2]);
-                rect[5] = max(rect[5], -p[2]);
-            }
+            vec3_set(p, bpos[0] + N / 2, bpos[1] + N / 2, bpos[2] + N / 2);
+            mat4_mul_vec3(mat, p, p);
+            rect[0] = min(rect[0], p[0] - ext[0]);
+            rect[1] = max(rect[1], p[0] + ext[0]);
+            rect[2] = min(rect[2], p[1] - ext[1]);
+            rect[3] = max(rect[3], p[1] + ext[1]);
+            rect[4] = min(rect[4], -p[2] - ext[2]);
+            rect[5] = max(rect[5], -p[2] + ext[2]);
+        }
+    }
+}
+
+// Attributes shared by all the blocks of a mesh rendered with lod.
+typedef struct {
+    renderer_t          *rend;
+    const material_t    *material;
+    int                 effects;
+    gl_shader_t         *shader;
+    float               model[4][4];
+    float               camera[3];      // In the mesh space.
+    bool                ortho;
+    // Size in pixel of a voxel at a distance of one (or at any distance
+    // with an orthographic projection).
+    float               pixels_scale;
+    mesh_t              *meshes[RENDER_LOD_MAX + 1];
+    blocks_list_t       *lists[RENDER_LOD_MAX + 1];
+} lod_context_t;
+
+// Return the (continuous) level of detail we want at a given distance.
+static float get_lod(const lod_context_t *ctx, float dist)
+{
+    float pixels = ctx->pixels_scale;
+    if (!ctx->ortho) pixels /= max(dist, 1.f);
+    return log2f(RENDER_LOD_PIXELS / pixels);
+}
+
+/*
+ * Render a block of a lod level, or its children of the finer level if
+ * the block is too close to the camera.
+ *
+ * To avoid flickering when a block is at the limit between two levels,
+ * we only change the level of a block when the wanted level is further
+ * than RENDER_LOD_HYSTERESIS from it, and keep the previous choice in
+ * the block 'refined' attribute otherwise.
+ */
+static void render_lod_block(lod_context_t *ctx, int level,
+                             render_block_t *block, int *block_id)
+{
+    const int N = BLOCK_SIZE;
+    float model[4][4], lo, hi, d, dist = 0, lod;
+    int i, p[3];
+    render_block_t *child;
+
+    if (level > 0) {
+        // Distance from the camera to the block box.
+        for (i = 0; i < 3; i++) {
+            lo = block->pos[i] * (1 << level);
+            hi = lo + N * (1 << level);
+            d = max(max(lo - ctx->camera[i], ctx->camera[i] - hi), 0.f);
+            dist += d * d;
+        }
+        lod = get_lod(ctx, sqrtf(dist));
+        if (lod < level - RENDER_LOD_HYSTERESIS) block->refined = true;
+        if (lod > level + RENDER_LOD_HYSTERESIS) block->refined = false;
+    }
+
+    if (level > 0 && block->refined) {
+        for (i = 0; i < 8; i++) {
+            p[0] = block->pos[0] * 2 + ((i >> 0) & 1) * N;
+            p[1] = block->pos[1] * 2 + ((i >> 1) & 1) * N;
+            p[2] = block->pos[2] * 2 + ((i >> 2) & 1) * N;
+            HASH_FIND(hh, ctx->lists[level - 1]->blocks, p, sizeof(p), child);
+            if (child) render_lod_block(ctx, level - 1, child, block_id);
+        }
+        return;
+    }
+
+    mat4_copy(ctx->model, model);
+    mat4_iscale(model, 1 << level, 1 << level, 1 << level);
+    render_block_(ctx->rend, ctx->meshes[level], ctx->lists[level], block,
+                  (*block_id)++, ctx->material, ctx->effects, ctx->shader,
+                  model);
+}
+
+/*
+ * Compute the coarsest lod level we need to render a mesh, from the
+ * farthest point of its bounding box.
+ */
+static int get_mesh_max_lod(const lod_context_t *ctx, const mesh_t *mesh)
+{
+    int i, bbox[2][3], ret;
+    float d, dist = 0;
+
+    if (!mesh_get_bbox(mesh, bbox, false)) return 0;
+    for (i = 0; i < 3; i++) {
+        d = max(fabs(bbox[0][i] - ctx->camera[i]),
+                fabs(bbox[1][i] - ctx->camera[i]));
+        dist += d * d;
+    }
+    ret = floor(get_lod(ctx, sqrtf(dist)) + RENDER_LOD_HYSTERESIS);
+    return clamp(ret, 0, RENDER_LOD_MAX);
+}
+
+static void raymarch_volume_delete(raymarch_volume_t *volume)
+{
+    GL(glDeleteTextures(1, &volume->table));
+    free(volume);
+}
+
+// Release the ray marching volumes that haven't been used for a few
+// renders, or everything, including the atlas, if 'all' is set.
+static void raymarch_cleanup(bool all)
+{
+    raymarch_volume_t *volume, *tmp;
+    raymarch_slot_t *slot, *slot_tmp;
+
+    DL_FOREACH_SAFE(g_raymarch_volumes, volume, tmp) {
+        if (!all && g_submit_count - volume->last_used < 8) continue;
+        DL_DELETE(g_raymarch_volumes, volume);
+        raymarch_volume_delete(volume);
+    }
+    if (!all) return;
+    HASH_ITER(hh, g_raymarch_slots, slot, slot_tmp) {
+        HASH_DEL(g_raymarch_slots, slot);
+        DL_DELETE(g_raymarch_slots_lru, slot);
+        free(slot);
+    }
+    g_raymarch_nb_slots = 0;
+    g_raymarch_slots_gen++;
+    if (g_raymarch_atlas) GL(glDeleteTextures(1, &g_raymarch_atlas));
+    if (g_raymarch_cube_buffer)
+        GL(glDeleteBuffers(1, &g_raymarch_cube_buffer));
+    g_raymarch_atlas = 0;
+    g_raymarch_cube_buffer = 0;
+}
+
+#ifndef GLES2
+
+static void raymarch_init(void)
+{
+    const int *s = RAYMARCH_ATLAS_SIZE;
+    const int N = BLOCK_SIZE;
+    uint8_t cube[36][3];
+    int f, i;
+    const int *p;
+
+    GL(glGenTextures(1, &g_raymarch_atlas));
+    GL(glBindTexture(GL_TEXTURE_3D, g_raymarch_atlas));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL(glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, s[0] * N, s[1] * N, s[2] * N,
+                    0, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+
+    // Unit cube triangles.
+    for (f = 0; f < 6; f++) {
+        for (i = 0; i < 6; i++) {
+            p = VERTICES_POSITIONS[FACES_VERTICES[f][
+                    ((int[]){0, 1, 2, 2, 3, 0})[i]]];
+            cube[f * 6 + i][0] = p[0];
+            cube[f * 6 + i][1] = p[1];
+            cube[f * 6 + i][2] = p[2];
         }
     }
+    GL(glGenBuffers(1, &g_raymarch_cube_buffer));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_raymarch_cube_buffer));
+    GL(glBufferData(GL_ARRAY_BUFFER, sizeof(cube), cube, GL_STATIC_DRAW));
+}
+
+/*
+ * Return the atlas slot of a block, uploading its voxels if needed.
+ *
+ * If the atlas is full we reuse the least recently used slot, as long as
+ * it is not used in the current frame.  Return NULL if the block is empty
+ * or if there is no slot left.
+ *
+ * The slots are kept in a list sorted by last use, so the least recently
+ * used one is always the first.
+ */
+static raymarch_slot_t *raymarch_get_slot(const mesh_t *mesh,
+                                          mesh_iterator_t *iter,
+                                          const int bpos[3], bool *added)
+{
+    const int *s = RAYMARCH_ATLAS_SIZE;
+    const int N = BLOCK_SIZE;
+    raymarch_slot_t *slot;
+    uint64_t data_id;
+    const void *voxels;
+    int index;
+
+    voxels = mesh_get_block_data(mesh, iter, bpos, &data_id);
+    if (!data_id) return NULL;
+    HASH_FIND(hh, g_raymarch_slots, &data_id, sizeof(data_id), slot);
+    if (slot) goto end;
+
+    if (g_raymarch_nb_slots < s[0] * s[1] * s[2]) {
+        slot = calloc(1, sizeof(*slot));
+        slot->index = g_raymarch_nb_slots++;
+    } else {
+        slot = g_raymarch_slots_lru;
+        if (slot->last_used == g_submit_count) return NULL;
+        HASH_DEL(g_raymarch_slots, slot);
+        DL_DELETE(g_raymarch_slots_lru, slot);
+        g_raymarch_slots_gen++;
+    }
+    slot->data_id = data_id;
+    HASH_ADD(hh, g_raymarch_slots, data_id, sizeof(slot->data_id), slot);
+    index = slot->index;
+    GL(glBindTexture(GL_TEXTURE_3D, g_raymarch_atlas));
+    GL(glTexSubImage3D(GL_TEXTURE_3D, 0,
+                       index % s[0] * N,
+                       index / s[0] % s[1] * N,
+                       index / (s[0] * s[1]) * N,
+                       N, N, N, GL_RGBA, GL_UNSIGNED_BYTE, voxels));
+    *added = true;
+    DL_APPEND(g_raymarch_slots_lru, slot);
+end:
+    if (slot->last_used != g_submit_count && slot->next) {
+        DL_DELETE(g_raymarch_slots_lru, slot);
+        DL_APPEND(g_raymarch_slots_lru, slot);
+    }
+    slot->last_used = g_submit_count;
+    return slot;
 }
 
+// Set the volume box and table texture from the mesh blocks.
+static void raymarch_volume_update(raymarch_volume_t *volume,
+                                   const mesh_t *mesh)
+{
+    const int *s = RAYMARCH_ATLAS_SIZE;
+    const int N = BLOCK_SIZE;
+    int i, bpos[3], aabb[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                                  {INT_MIN, INT_MIN, INT_MIN}};
+    uint8_t (*table)[4];
+    uint8_t *v;
+    mesh_iterator_t iter;
+    raymarch_slot_t *slot;
+    uint64_t data_id;
+    bool added = false;
+    bool overflow = false;
+
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = min(aabb[0][i], bpos[i]);
+            aabb[1][i] = max(aabb[1][i], bpos[i]);
+        }
+    }
+    // Empty mesh: we would overflow computing the size.
+    if (aabb[0][0] > aabb[1][0]) {
+        memset(volume->size, 0, sizeof(volume->size));
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        volume->origin[i] = aabb[0][i];
+        volume->size[i] = (aabb[1][i] - aabb[0][i]) / N + 1;
+    }
+
+    table = calloc(volume->size[0] * volume->size[1] * volume->size[2],
+                   sizeof(*table));
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        mesh_get_block_data(mesh, &iter, bpos, &data_id);
+        if (!data_id) continue;
+        slot = raymarch_get_slot(mesh, &iter, bpos, &added);
+        if (!slot) {
+            overflow = true;
+            continue;
+        }
+        v = table[(bpos[0] - aabb[0][0]) / N +
+                  (bpos[1] - aabb[0][1]) / N * volume->size[0] +
+                  (bpos[2] - aabb[0][2]) / N * volume->size[0] *
+                                               volume->size[1]];
+        v[0] = slot->index % s[0];
+        v[1] = slot->index / s[0] % s[1];
+        v[2] = slot->index / (s[0] * s[1]);
+        v[3] = 255;
+    }
+    if (overflow) LOG_W("Ray marching atlas full: some blocks are hidden");
+
+    if (!volume->table) {
+        GL(glGenTextures(1, &volume->table));
+        GL(glBindTexture(GL_TEXTURE_3D, volume->table));
+        GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    }
+    GL(glBindTexture(GL_TEXTURE_3D, volume->table));
+    GL(glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA,
+                    volume->size[0], volume->size[1], volume->size[2],
+                    0, GL_RGBA, GL_UNSIGNED_BYTE, table));
+    free(table);
+    volume->slots_gen = g_raymarch_slots_gen;
+}
+
+/*
+ * Return the ray marching volume of a mesh, creating it if needed.
+ *
+ * We always check that all the blocks are still in the atlas, since the
+ * slots can be reused by the other meshes.
+ */
+static raymarch_volume_t *get_raymarch_volume(const mesh_t *mesh)
+{
+    raymarch_volume_t *volume;
+    uint64_t mesh_key = mesh_get_key(mesh);
+    mesh_iterator_t iter;
+    int bpos[3];
+    bool added = false;
+
+    if (!g_raymarch_atlas) raymarch_init();
+    DL_FOREACH(g_raymarch_volumes, volume) {
+        if (volume->mesh_key == mesh_key) break;
+    }
+    if (!volume) {
+        volume = calloc(1, sizeof(*volume));
+        volume->mesh_key = mesh_key;
+        DL_APPEND(g_raymarch_volumes, volume);
+        raymarch_volume_update(volume, mesh);
+    } else {
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos))
+            raymarch_get_slot(mesh, &iter, bpos, &added);
+        if (added || volume->slots_gen != g_raymarch_slots_gen)
+            raymarch_volume_update(volume, mesh);
+    }
+    volume->last_used = g_submit_count;
+    return volume;
+}
+
+static void render_mesh_raymarch(renderer_t *rend, const mesh_t *mesh,
+                                 const float model[4][4],
+                                 const material_t *material)
+{
+    const int N = BLOCK_SIZE;
+    raymarch_volume_t *volume;
+    gl_shader_t *shader;
+    float vol_model[4][4], ivol_model[4][4], camera[4][4];
+    float size[3], cam_pos[3], dir[4], atlas_size[3], light_dir[3];
+    int i;
+
+    volume = get_raymarch_volume(mesh);
+    if (!volume->size[0]) return;
+
+    mat4_copy(model, vol_model);
+    mat4_itranslate(vol_model, volume->origin[0], volume->origin[1],
+                    volume->origin[2]);
+    mat4_invert(vol_model, ivol_model);
+    mat4_invert(rend->view_mat, camera);
+    mat4_mul_vec3(ivol_model, camera[3], cam_pos);
+    mat4_mul_vec4(ivol_model, VEC(-camera[2][0], -camera[2][1],
+                                  -camera[2][2], 0), dir);
+    for (i = 0; i < 3; i++) {
+        size[i] = volume->size[i] * N;
+        atlas_size[i] = RAYMARCH_ATLAS_SIZE[i];
+    }
+    get_light_dir(rend, light_dir);
+
+    shader = shader_get("raymarch", NULL, ATTR_NAMES, NULL);
+    GL(glUseProgram(shader->prog));
+    GL(glEnable(GL_DEPTH_TEST));
+    GL(glDepthFunc(GL_LEQUAL));
+    // Render the back faces, so that it works with the camera inside.
+    GL(glEnable(GL_CULL_FACE));
+    GL(glCullFace(GL_FRONT));
+    GL(glDisable(GL_BLEND));
+    if (material->base_color[3] < 1) {
+        GL(glEnable(GL_BLEND));
+        GL(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
+    }
+
+    GL(glActiveTexture(GL_TEXTURE3));
+    GL(glBindTexture(GL_TEXTURE_3D, g_raymarch_atlas));
+    GL(glActiveTexture(GL_TEXTURE4));
+    GL(glBindTexture(GL_TEXTURE_3D, volume->table));
+    gl_update_uniform(shader, "u_atlas", 3);
+    gl_update_uniform(shader, "u_table", 4);
+    gl_update_uniform(shader, "u_atlas_size", atlas_size);
+
+    gl_update_uniform(shader, "u_model", vol_model);
+    gl_update_uniform(shader, "u_view", rend->view_mat);
+    gl_update_uniform(shader, "u_proj", rend->proj_mat);
+    gl_update_uniform(shader, "u_size", size);
+    gl_update_uniform(shader, "u_camera", cam_pos);
+    gl_update_uniform(shader, "u_dir", dir);
+    gl_update_uniform(shader, "u_ortho", rend->proj_mat[3][3] == 1 ? 1.0 : 0.0);
+    gl_update_uniform(shader, "u_l_dir", light_dir);
+    gl_update_uniform(shader, "u_l_int", rend->light.intensity);
+    gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+    gl_update_uniform(shader, "u_m_base_color", material->base_color);
+    gl_update_uniform(shader, "u_m_metallic", material->metallic);
+
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_raymarch_cube_buffer));
+    GL(glEnableVertexAttribArray(A_POS_LOC));
+    GL(glVertexAttribPointer(A_POS_LOC, 3, GL_UNSIGNED_BYTE, false, 3, 0));
+    GL(glDrawArrays(GL_TRIANGLES, 0, 36));
+    GL(glDisableVertexAttribArray(A_POS_LOC));
+    GL(glCullFace(GL_BACK));
+    GL(glDisable(GL_BLEND));
+    GL(glActiveTexture(GL_TEXTURE0));
+}
+
+#endif // GLES2
+
 static void render_mesh_(renderer_t *rend, mesh_t *mesh,
+                         const float model[4][4],
                          const material_t *material, int effects,
-                         const float shadow_mvp[4][4])
+                         const float shadow_mvp[4][4],
+                         const float viewport[4])
 {
     gl_shader_t *shader;
-    float model[4][4], camera[4][4];
-    int attr, block_pos[3], block_id;
+    float camera[4][4], imodel[4][4];
+    int attr, block_id, stride;
+    const attribute_t *attrs;
     float light_dir[3], alpha;
     bool shadow = false;
-    mesh_iterator_t iter;
+    blocks_list_t *list;
+    render_block_t *block;
+    lod_context_t lod_ctx;
+    int lod, max_lod = 0;
+
+#ifndef GLES2
+    if (    (effects & EFFECT_RAYMARCH) &&
+            !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP))) {
+        render_mesh_raymarch(rend, mesh, model, material);
+        return;
+    }
+#endif
 
-    mat4_set_identity(model);
     get_light_dir(rend, light_dir);
 
-    if (effects & EFFECT_MARCHING_CUBES)
-        effects &= ~EFFECT_BORDERS;
+    // The packed vertices only support the cubes rendering.
+    if (effects & (EFFECT_MARCHING_CUBES | EFFECT_SURFACE_NETS))
+        effects &= ~(EFFECT_BORDERS | EFFECT_PACKED_VERTICES);
 
     if (effects & EFFECT_RENDER_POS)
         shader = shader_get("pos_data", NULL, ATTR_NAMES, shader_init);
@@ -597,6 +1466,7 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh,
             {"HAS_OCCLUSION_MAP", rend->settings.occlusion_strength > 0},
             {"VERTEX_LIGHTNING", !(effects & (EFFECT_BORDERS | EFFECT_UNLIT))},
             {"SMOOTHNESS", rend->settings.smoothness > 0},
+            {"PACKED_VERTICES", effects & EFFECT_PACKED_VERTICES},
             {}
         };
         shader = shader_get("mesh", defines, ATTR_NAMES, shader_init);
@@ -662,52 +1532,70 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh,
     mat4_invert(rend->view_mat, camera);
     gl_update_uniform(shader, "u_camera", camera[3]);
 
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
-        GL(glEnableVertexAttribArray(attr));
+    attrs = get_attributes(effects, &stride);
+    for (attr = 0; attr < A_COUNT; attr++)
+        if (attrs[attr].size) GL(glEnableVertexAttribArray(attr));
 
     GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
 
     block_id = 1;
-    iter = mesh_get_iterator(mesh,
-            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-    while (mesh_iter(&iter, block_pos)) {
-        render_block_(rend, mesh, &iter, block_pos,
-                      block_id++, material, effects, shader, model);
+
+    // Only use the lod in the main pass, since the picking needs the
+    // actual blocks.
+    if (    viewport && (effects & EFFECT_LOD) &&
+            !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP))) {
+        lod_ctx = (lod_context_t) {
+            .rend = rend,
+            .material = material,
+            .effects = effects,
+            .shader = shader,
+            .ortho = rend->proj_mat[3][3] == 1,
+            .pixels_scale = viewport[3] * rend->scale *
+                            rend->proj_mat[1][1] / 2,
+        };
+        mat4_copy(model, lod_ctx.model);
+        mat4_invert(model, imodel);
+        mat4_mul_vec3(imodel, camera[3], lod_ctx.camera);
+        max_lod = get_mesh_max_lod(&lod_ctx, mesh);
     }
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
-        GL(glDisableVertexAttribArray(attr));
+
+    if (max_lod > 0) {
+        for (lod = 0; lod <= max_lod; lod++) {
+            lod_ctx.meshes[lod] = get_lod_mesh(mesh, lod);
+            lod_ctx.lists[lod] = get_blocks_list(lod_ctx.meshes[lod],
+                                                 effects, lod);
+        }
+        list = lod_ctx.lists[max_lod];
+        for (block = list->blocks; block; block = block->hh.next)
+            render_lod_block(&lod_ctx, max_lod, block, &block_id);
+    } else {
+        list = get_blocks_list(mesh, effects, 0);
+        for (block = list->blocks; block; block = block->hh.next) {
+            render_block_(rend, mesh, list, block,
+                          block_id++, material, effects, shader, model);
+        }
+    }
+    for (attr = 0; attr < A_COUNT; attr++)
+        if (attrs[attr].size) GL(glDisableVertexAttribArray(attr));
 
     if (effects & EFFECT_SEE_BACK) {
         effects &= ~EFFECT_SEE_BACK;
         effects |= EFFECT_SEMI_TRANSPARENT;
-        render_mesh_(rend, mesh, material, effects, shadow_mvp);
+        render_mesh_(rend, mesh, model, material, effects, shadow_mvp,
+                     viewport);
     }
     GL(glDisable(GL_BLEND));
 }
 
-// XXX: this is quite ugly.  We could maybe use a callback of some sort
-// in the renderer instead.
-void render_get_block_pos(renderer_t *rend, const mesh_t *mesh,
-                          int id, int pos[3])
+void render_mesh(renderer_t *rend, const mesh_t *mesh,
+                 const material_t *material, int effects)
 {
-    // Basically we simulate the algo of render_mesh_ but without rendering
-    // anything.
-    int block_id, block_pos[3];
-    mesh_iterator_t iter;
-    block_id = 1;
-    iter = mesh_get_iterator(mesh,
-            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-    while (mesh_iter(&iter, block_pos)) {
-        if (block_id == id) {
-            memcpy(pos, block_pos, sizeof(block_pos));
-            return;
-        }
-        block_id++;
-    }
+    render_mesh_instance(rend, mesh, mat4_identity, material, effects);
 }
 
-void render_mesh(renderer_t *rend, const mesh_t *mesh,
-                 const material_t *material, int effects)
+void render_mesh_instance(renderer_t *rend, const mesh_t *mesh,
+                          const float mat[4][4],
+                          const material_t *material, int effects)
 {
     render_item_t *item;
     const material_t default_material = MATERIAL_DEFAULT;
@@ -719,13 +1607,16 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
         item = calloc(1, sizeof(*item));
         item->type = ITEM_MESH;
         item->mesh = mesh_copy(mesh);
+        mat4_copy(mat, item->mat);
         item->material = *material;
         item->effects = effects | rend->settings.effects;
         item->effects &= ~(EFFECT_GRID | EFFECT_EDGES);
         // With EFFECT_RENDER_POS we need to remove some effects.
         if (item->effects & EFFECT_RENDER_POS)
             item->effects &= ~(EFFECT_SEMI_TRANSPARENT | EFFECT_SEE_BACK |
-                               EFFECT_MARCHING_CUBES);
+                               EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH |
+                               EFFECT_SURFACE_NETS | EFFECT_PACKED_VERTICES |
+                               EFFECT_LOD | EFFECT_RAYMARCH);
         DL_APPEND(rend->items, item);
     }
 
@@ -736,6 +1627,7 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
         item = calloc(1, sizeof(*item));
         item->type = ITEM_MESH;
         item->mesh = mesh_copy(mesh);
+        mat4_copy(mat, item->mat);
         item->effects = EFFECT_GRID | EFFECT_BORDERS;
         item->material = *material;
         vec4_set(item->material.base_color, 0, 0, 0, alpha);
@@ -747,6 +1639,7 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
         item = calloc(1, sizeof(*item));
         item->type = ITEM_MESH;
         item->mesh = mesh_copy(mesh);
+        mat4_copy(mat, item->mat);
         item->effects = EFFECT_EDGES | EFFECT_BORDERS;
         item->material = *material;
         vec4_set(item->material.base_color, 0, 0, 0, alpha);
@@ -930,11 +1823,50 @@ static int item_sort_cmp(const render_item_t *a, const render_item_t *b)
 }
 
 
+/*
+ * Compute a key for everything the shadow map depends on: the meshes, the
+ * effects that change their geometry, and the light direction.
+ */
+static uint32_t get_shadow_map_key(const renderer_t *rend)
+{
+    uint32_t key = 0;
+    uint64_t mesh_key;
+    int effects;
+    float light_dir[3];
+    const render_item_t *item;
+
+    get_light_dir(rend, light_dir);
+    key = XXH32(light_dir, sizeof(light_dir), key);
+    DL_FOREACH(rend->items, item) {
+        if (item->type != ITEM_MESH) continue;
+        mesh_key = mesh_get_key(item->mesh);
+        effects = item->effects & (EFFECT_MARCHING_CUBES |
+                                   EFFECT_SURFACE_NETS);
+        key = XXH32(&mesh_key, sizeof(mesh_key), key);
+        key = XXH32(&effects, sizeof(effects), key);
+        key = XXH32(item->mat, sizeof(item->mat), key);
+    }
+    return key ?: 1; // 0 means no shadow map.
+}
+
+/*
+ * Render the scene depth from the light into the shadow map texture.
+ * Since it doesn't depend on the camera (unless the light is fixed to the
+ * view), we keep the previous shadow map if nothing changed.
+ */
 static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
 {
     render_item_t *item;
     float rect[6], light_dir[3];
     int effects;
+    uint32_t key;
+    PROFILER_SCOPE("render_shadow_map");
+
+    key = get_shadow_map_key(rend);
+    if (key == g_shadow_map_key) {
+        mat4_copy(g_shadow_map_mvp, shadow_mvp);
+        return;
+    }
     // Create a renderer looking at the scene from the light.
     compute_shadow_map_box(rend, rect);
     float bias_mat[4][4] = {{0.5, 0.0, 0.0, 0.0},
@@ -973,16 +1905,22 @@ static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
     GL(glClear(GL_DEPTH_BUFFER_BIT));
 
     DL_FOREACH(rend->items, item) {
-        if (item->type == ITEM_MESH) {
-            effects = (item->effects & EFFECT_MARCHING_CUBES);
+        // The ray marched meshes don't cast shadows.
+        if (item->type == ITEM_MESH && !(item->effects & EFFECT_RAYMARCH)) {
+            effects = item->effects & (EFFECT_MARCHING_CUBES |
+                                       EFFECT_SURFACE_NETS |
+                                       EFFECT_PACKED_VERTICES);
             effects |= EFFECT_SHADOW_MAP;
-            render_mesh_(&srend, item->mesh, &item->material, effects, NULL);
+            render_mesh_(&srend, item->mesh, item->mat, &item->material,
+                         effects, NULL, NULL);
         }
     }
     mat4_copy(bias_mat, ret);
     mat4_imul(ret, srend.proj_mat);
     mat4_imul(ret, srend.view_mat);
     mat4_copy(ret, shadow_mvp);
+    mat4_copy(ret, g_shadow_map_mvp);
+    g_shadow_map_key = key;
 }
 
 static void render_background(renderer_t *rend, const uint8_t col[4])
@@ -1039,6 +1977,7 @@ void render_submit(renderer_t *rend, const float viewport[4],
     const float s = rend->scale;
     bool shadow = rend->settings.shadow &&
         !(rend->settings.effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP));
+    PROFILER_SCOPE("render_submit");
 
     if (shadow) {
         GL(glDisable(GL_SCISSOR_TEST));
@@ -1058,8 +1997,8 @@ void render_submit(renderer_t *rend, const float viewport[4],
     DL_FOREACH_SAFE(rend->items, item, tmp) {
         switch (item->type) {
         case ITEM_MESH:
-            render_mesh_(rend, item->mesh, &item->material, item->effects,
-                         shadow_mvp);
+            render_mesh_(rend, item->mesh, item->mat, &item->material,
+                         item->effects, shadow_mvp, viewport);
             mesh_delete(item->mesh);
             break;
         case ITEM_MODEL3D:
@@ -1076,9 +2015,16 @@ void render_submit(renderer_t *rend, const float viewport[4],
         free(item);
     }
     assert(rend->items == NULL);
+    g_submit_count++;
+    blocks_lists_cleanup(false);
+    lod_pyramids_cleanup(false);
+    raymarch_cleanup(false);
 }
 
 void render_on_low_memory(renderer_t *rend)
 {
+    blocks_lists_cleanup(true);
+    lod_pyramids_cleanup(true);
+    raymarch_cleanup(true);
     cache_clear(g_items_cache);
 }
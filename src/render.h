@@ -42,6 +42,10 @@ enum {
     EFFECT_PROJ_SCREEN      = 1 << 16, // Image project in screen.
     EFFECT_ANTIALIASING     = 1 << 17,
     EFFECT_UNLIT            = 1 << 18,
+    EFFECT_PACKED_VERTICES  = 1 << 19, // Use compact vertices if possible.
+    EFFECT_SURFACE_NETS     = 1 << 20,
+    EFFECT_LOD              = 1 << 21, // Use lower resolution when far.
+    EFFECT_RAYMARCH         = 1 << 22, // Ray march the voxels on the GPU.
 };
 
 typedef struct {
@@ -78,6 +82,24 @@ void render_deinit(void);
 void render_mesh(renderer_t *rend, const mesh_t *mesh,
                  const material_t *material,
                  int effects);
+
+/*
+ * Function: render_mesh_instance
+ * Render a mesh with a model transformation.
+ *
+ * The blocks geometry is shared with all the other renders of the same
+ * mesh, so this is much cheaper than rendering a moved copy of the mesh.
+ *
+ * Parameters:
+ *   rend       - The renderer.
+ *   mesh       - The mesh to render.
+ *   mat        - The model matrix of the instance.
+ *   material   - The material, or NULL for the default one.
+ *   effects    - Effect flags.
+ */
+void render_mesh_instance(renderer_t *rend, const mesh_t *mesh,
+                          const float mat[4][4],
+                          const material_t *material, int effects);
 void render_grid(renderer_t *rend, const float plane[4][4],
                  const uint8_t color[4], const float clip_box[4][4]);
 void render_line(renderer_t *rend, const float a[3], const float b[3],
@@ -108,11 +130,6 @@ void render_submit(renderer_t *rend, const float viewport[4],
 // Compute the light direction in the model coordinates (toward the light)
 void render_get_light_dir(const renderer_t *rend, float out[3]);
 
-// Ugly function that return the position of the block at a given id
-// when the mesh is rendered with render_mesh.
-void render_get_block_pos(renderer_t *rend, const mesh_t *mesh,
-                          int id, int pos[3]);
-
 // Attempt to release some memory.
 void render_on_low_memory(renderer_t *rend);
 
@@ -0,0 +1,179 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Naive surface nets mesher.
+ *
+ * We consider the cells whose corners are the voxels centers.  Each cell
+ * crossed by the surface gets a single vertex, placed at the average of the
+ * crossing points of its edges.  Then for each pair of adjacent voxels
+ * with a different visibility we create a quad joining the vertices of the
+ * four cells around them.
+ *
+ * To avoid negative positions, a block handles the voxel edges starting at
+ * positions 1 to N (included), so we need the voxels from 0 to N + 1, and
+ * the cells from 0 to N.
+ */
+
+#include "goxel.h"
+
+// Number of sub position per voxel, same as for the marching cubes.
+#define SN_VOXEL_SUB_POS 8
+
+static const int N = BLOCK_SIZE;
+
+// Size of the voxels and cells arrays.
+#define S (BLOCK_SIZE + 2)
+
+#define DATA_AT(x, y, z) (data[(x) + (y) * S + (z) * S * S])
+
+static bool is_inside(const uint8_t v[4])
+{
+    return v[3] >= 127;
+}
+
+// Read the voxels from 0 to N + 1 around a block.
+static void read_data(const mesh_t *mesh, const int block_pos[3],
+                      uint8_t (*data)[4])
+{
+    const int size[3] = {S, S, S};
+    mesh_read(mesh, block_pos, size, (uint8_t*)data);
+}
+
+/*
+ * Compute the vertex of a cell.
+ * Return false if the cell is not crossed by the surface.
+ */
+static bool compute_cell_vertex(const uint8_t (*data)[4],
+                                int x, int y, int z,
+                                voxel_vertex_t *out)
+{
+    int i, j, nb = 0, mask = 0, nb_inside = 0;
+    const int cell[3] = {x, y, z};
+    const uint8_t *corners[8];
+    const int *p0, *p1;
+    float f0, f1, mu, pos[3] = {0}, grad[3] = {0}, color[3] = {0};
+
+    for (i = 0; i < 8; i++) {
+        corners[i] = DATA_AT(x + VERTICES_POSITIONS[i][0],
+                             y + VERTICES_POSITIONS[i][1],
+                             z + VERTICES_POSITIONS[i][2]);
+        if (is_inside(corners[i])) mask |= 1 << i;
+    }
+    if (mask == 0 || mask == 0xff) return false;
+
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++) {
+            grad[j] += corners[i][3] * (VERTICES_POSITIONS[i][j] ? 1 : -1);
+        }
+        if (!(mask & (1 << i))) continue;
+        for (j = 0; j < 3; j++) color[j] += corners[i][j];
+        nb_inside++;
+    }
+
+    // Average of the surface crossing points of all the edges.
+    for (i = 0; i < 12; i++) {
+        if (    !!(mask & (1 << EDGES_VERTICES[i][0])) ==
+                !!(mask & (1 << EDGES_VERTICES[i][1]))) continue;
+        p0 = VERTICES_POSITIONS[EDGES_VERTICES[i][0]];
+        p1 = VERTICES_POSITIONS[EDGES_VERTICES[i][1]];
+        f0 = corners[EDGES_VERTICES[i][0]][3] / 255.;
+        f1 = corners[EDGES_VERTICES[i][1]][3] / 255.;
+        mu = (f0 - 0.5) / (f0 - f1);
+        for (j = 0; j < 3; j++) pos[j] += p0[j] * (1 - mu) + p1[j] * mu;
+        nb++;
+    }
+
+    memset(out, 0, sizeof(*out));
+    vec3_normalize(grad, grad);
+    for (i = 0; i < 3; i++) {
+        out->pos[i] = ((cell[i] + 0.5) + pos[i] / nb) * SN_VOXEL_SUB_POS + 0.5;
+        out->normal[i] = -grad[i] * 64;
+        out->color[i] = color[i] / nb_inside;
+    }
+    out->color[3] = 255;
+    return true;
+}
+
+int mesh_generate_vertices_sn(const mesh_t *mesh, const int block_pos[3],
+                              int effects, voxel_vertex_t *out,
+                              uint16_t *indices, int *nb_indices,
+                              int *subdivide)
+{
+    // Axis of the quad edges for each edge direction.
+    const int AXIS[3][2] = {{1, 2}, {2, 0}, {0, 1}};
+    int x, y, z, i, a, b, c, nb = 0, p[3], ring[4];
+    int16_t *cells;
+    uint8_t (*data)[4];
+    const uint8_t *v0, *v1;
+
+    *subdivide = SN_VOXEL_SUB_POS;
+    *nb_indices = 0;
+
+    data = malloc(S * S * S * sizeof(*data));
+    read_data(mesh, block_pos, data);
+
+    // Compute the vertices of all the cells from 0 to N.
+    cells = malloc(S * S * S * sizeof(*cells));
+    for (z = 0; z < N + 1; z++)
+    for (y = 0; y < N + 1; y++)
+    for (x = 0; x < N + 1; x++) {
+        cells[x + y * S + z * S * S] = -1;
+        if (compute_cell_vertex(data, x, y, z, &out[nb]))
+            cells[x + y * S + z * S * S] = nb++;
+    }
+    if (nb == 0) goto end;
+
+    // Create a quad for each voxel edge crossing the surface.
+    for (z = 1; z < N + 1; z++)
+    for (y = 1; y < N + 1; y++)
+    for (x = 1; x < N + 1; x++) {
+        v0 = DATA_AT(x, y, z);
+        for (a = 0; a < 3; a++) {
+            b = AXIS[a][0];
+            c = AXIS[a][1];
+            v1 = DATA_AT(x + (a == 0), y + (a == 1), z + (a == 2));
+            if (is_inside(v0) == is_inside(v1)) continue;
+            // The four cells around the edge, in counter clockwise order
+            // when looking from the outside.
+            for (i = 0; i < 4; i++) {
+                p[0] = x;
+                p[1] = y;
+                p[2] = z;
+                if (i == 0 || i == 3) p[b]--;
+                if (i == 0 || i == 1) p[c]--;
+                ring[i] = cells[p[0] + p[1] * S + p[2] * S * S];
+                assert(ring[i] >= 0);
+            }
+            if (!is_inside(v0)) {
+                SWAP(ring[1], ring[3]);
+            }
+            indices[(*nb_indices)++] = ring[0];
+            indices[(*nb_indices)++] = ring[1];
+            indices[(*nb_indices)++] = ring[2];
+            indices[(*nb_indices)++] = ring[2];
+            indices[(*nb_indices)++] = ring[3];
+            indices[(*nb_indices)++] = ring[0];
+        }
+    }
+
+end:
+    free(cells);
+    free(data);
+    return nb;
+}
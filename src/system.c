@@ -250,6 +250,16 @@ void sys_show_keyboard(bool has_text)
     sys_callbacks.show_keyboard(sys_callbacks.user, has_text);
 }
 
+/*
+ * Function: sys_create_gl_context
+ * Create an offscreen OpenGL context when running without a window.
+ */
+bool sys_create_gl_context(void)
+{
+    if (!sys_callbacks.create_gl_context) return false;
+    return sys_callbacks.create_gl_context(sys_callbacks.user);
+}
+
 /*
  * Function: sys_save_to_photos
  * Save a png file to the system photo album.
@@ -42,6 +42,7 @@ typedef struct {
     void (*show_keyboard)(void *user, bool has_text);
     void (*save_to_photos)(void *user, const uint8_t *data, int size,
                            void (*on_finished)(int r));
+    bool (*create_gl_context)(void *user);
 } sys_callbacks_t;
 extern sys_callbacks_t sys_callbacks;
 
@@ -115,6 +116,15 @@ void sys_set_window_title(const char *title);
  */
 void sys_show_keyboard(bool has_text);
 
+/*
+ * Function: sys_create_gl_context
+ * Create an offscreen OpenGL context when running without a window.
+ *
+ * Return:
+ *   true if the context has been created and made current.
+ */
+bool sys_create_gl_context(void);
+
 /*
  * Function: sys_save_to_photo
  * Save a png file to the system photo album.
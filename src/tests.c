@@ -127,9 +127,102 @@ static void test_load_corrupt(void)
     TEST(err != 0);
 }
 
+static void test_mesh_raycast(void)
+{
+    mesh_t *mesh;
+    int pos[3], normal[3];
+    bool hit;
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){20, 3, -5}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){40, 3, -5}, (uint8_t[]){255, 0, 0, 64});
+
+    hit = mesh_raycast(mesh, (float[]){20.5, 3.5, 100}, (float[]){0, 0, -1},
+                       pos, normal);
+    TEST(hit);
+    TEST(pos[0] == 20 && pos[1] == 3 && pos[2] == -5);
+    TEST(normal[0] == 0 && normal[1] == 0 && normal[2] == 1);
+
+    hit = mesh_raycast(mesh, (float[]){-100, 3.5, -4.5}, (float[]){1, 0, 0},
+                       pos, normal);
+    TEST(hit);
+    TEST(pos[0] == 20 && normal[0] == -1);
+
+    // Invisible voxel.
+    hit = mesh_raycast(mesh, (float[]){40.5, 3.5, 100}, (float[]){0, 0, -1},
+                       pos, normal);
+    TEST(!hit);
+    mesh_delete(mesh);
+}
+
+#ifndef GLES2
+// Count the pixels of a RGBA buffer that are mostly opaque.
+static int count_opaque_pixels(const uint8_t *buf, int w, int h)
+{
+    int i, ret = 0;
+    for (i = 0; i < w * h; i++)
+        ret += buf[i * 4 + 3] >= 128;
+    return ret;
+}
+
+/*
+ * Check that the ray marching renderer covers the same pixels as the
+ * default renderer.  This needs an OpenGL context, and can run headless
+ * on mesa llvmpipe with 'goxel --test'.
+ */
+static void test_render_raymarch(void)
+{
+    const int w = 64, h = 64;
+    int x, y, z, n1, n2, effects, aabb[2][3] = {{-4, -4, -4}, {4, 4, 4}};
+    float box[4][4];
+    uint8_t *buf;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    buf = calloc(w * h, 4);
+    effects = goxel.rend.settings.effects;
+
+    // Empty mesh.
+    mesh_clear(mesh);
+    goxel.rend.settings.effects = effects | EFFECT_RAYMARCH;
+    goxel_render_to_buf(buf, w, h, 4);
+    TEST(count_opaque_pixels(buf, w, h) == 0);
+
+    for (z = aabb[0][2]; z < aabb[1][2]; z++)
+    for (y = aabb[0][1]; y < aabb[1][1]; y++)
+    for (x = aabb[0][0]; x < aabb[1][0]; x++) {
+        mesh_set_at(mesh, NULL, (int[]){x, y, z},
+                    (uint8_t[]){255, 0, 0, 255});
+    }
+    bbox_from_aabb(box, aabb);
+    if (!goxel.image->active_camera)
+        goxel.image->active_camera = image_add_camera(goxel.image, NULL);
+    camera_fit_box(goxel.image->active_camera, box);
+
+    goxel.rend.settings.effects = effects & ~EFFECT_RAYMARCH;
+    goxel_render_to_buf(buf, w, h, 4);
+    n1 = count_opaque_pixels(buf, w, h);
+    goxel.rend.settings.effects = effects | EFFECT_RAYMARCH;
+    goxel_render_to_buf(buf, w, h, 4);
+    n2 = count_opaque_pixels(buf, w, h);
+    TEST(n1 > 0 && abs(n1 - n2) <= n1 / 50);
+
+    goxel.rend.settings.effects = effects;
+    mesh_clear(mesh);
+    free(buf);
+}
+#endif
+
 void tests_run(void)
 {
     test_load_file_v2();
     test_load_file_v1_with_preview();
     test_load_corrupt();
+    test_mesh_raycast();
+}
+
+void tests_run_render(void)
+{
+#ifndef GLES2
+    test_render_raymarch();
+#endif
 }
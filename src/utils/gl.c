@@ -326,6 +326,9 @@ void gl_update_uniform(gl_shader_t *shader, const char *name, ...)
     switch (uni->type) {
     case GL_INT:
     case GL_SAMPLER_2D:
+#ifdef GL_SAMPLER_3D
+    case GL_SAMPLER_3D:
+#endif
         GL(glUniform1i(uni->loc, va_arg(args, int)));
         break;
     case GL_FLOAT:
@@ -99,14 +99,18 @@ uint8_t *img_read(const char *path, int *width, int *height, int *bpp)
 
 #if !HAVE_LIBPNG
 
-void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
+int img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
 {
-    stbi_write_png(path, w, h, bpp, img, 0);
+    if (!stbi_write_png(path, w, h, bpp, img, 0)) {
+        LOG_E("Cannot write %s", path);
+        return -1;
+    }
+    return 0;
 }
 
 #else
 
-void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
+int img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
 {
     int i;
     FILE *fp;
@@ -116,7 +120,7 @@ void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
     fp = fopen(path, "wb");
     if (!fp) {
         LOG_E("Cannot open %s", path);
-        return;
+        return -1;
     }
     png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
                                       NULL, NULL, NULL);
@@ -124,15 +128,19 @@ void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
         // With ubuntu 19.04, libpng seems to fail!
         LOG_E("Libpng error: fallback to stb-img");
         fclose(fp);
-        stbi_write_png(path, w, h, bpp, img, 0);
-        return;
+        if (!stbi_write_png(path, w, h, bpp, img, 0)) {
+            LOG_E("Cannot write %s", path);
+            return -1;
+        }
+        return 0;
     }
 
     info_ptr = png_create_info_struct(png_ptr);
     if (setjmp(png_jmpbuf(png_ptr))) {
+       LOG_E("Cannot write %s", path);
        png_destroy_write_struct(&png_ptr, &info_ptr);
        fclose(fp);
-       return;
+       return -1;
     }
     png_init_io(png_ptr, fp);
     png_set_IHDR(png_ptr, info_ptr, w, h, 8,
@@ -146,7 +154,11 @@ void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
         png_write_row(png_ptr, (png_bytep)(img + i * w * bpp));
     png_write_end(png_ptr, info_ptr);
     png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(fp);
+    if (fclose(fp) != 0) {
+        LOG_E("Cannot write %s", path);
+        return -1;
+    }
+    return 0;
 }
 
 #endif
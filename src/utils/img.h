@@ -42,8 +42,11 @@ uint8_t *img_read_from_mem(const char *data, int size,
 /*
  * Function: img_write
  * Write an image to a file.
+ *
+ * Return:
+ *   Zero on success.
  */
-void img_write(const uint8_t *img, int w, int h, int bpp, const char *path);
+int img_write(const uint8_t *img, int w, int h, int bpp, const char *path);
 
 /*
  * Function: img_write_to_mem
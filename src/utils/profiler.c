@@ -0,0 +1,163 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profiler.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Size of the ring buffers.
+#define MAX_EVENTS (1 << 15)
+#define MAX_FRAMES 256
+
+static struct {
+    bool                enabled;
+    pthread_t           thread;     // The recorded thread.
+    double              origin;
+    int                 depth;
+
+    // The events index are never wrapped, so that we can tell if an event
+    // has been overwritten.
+    profiler_event_t    events[MAX_EVENTS];
+    unsigned int        nb_events;
+
+    // Index of the first event and start time of each frame.
+    unsigned int        frames[MAX_FRAMES];
+    double              frames_start[MAX_FRAMES];
+    unsigned int        nb_frames;
+} g_prof = {};
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9 - g_prof.origin;
+}
+
+void profiler_set_enabled(bool enabled)
+{
+    if (enabled == g_prof.enabled) return;
+    if (enabled) {
+        g_prof.origin = 0;
+        g_prof.origin = get_time();
+        g_prof.thread = pthread_self();
+        g_prof.depth = 0;
+        g_prof.nb_events = 0;
+        g_prof.nb_frames = 0;
+    }
+    g_prof.enabled = enabled;
+}
+
+bool profiler_is_enabled(void)
+{
+    return g_prof.enabled;
+}
+
+void profiler_frame_begin(void)
+{
+    int i;
+    if (!g_prof.enabled) return;
+    i = g_prof.nb_frames++ % MAX_FRAMES;
+    g_prof.frames[i] = g_prof.nb_events;
+    g_prof.frames_start[i] = get_time();
+}
+
+int profiler_scope_begin(const char *name)
+{
+    profiler_event_t *event;
+    int id;
+
+    if (!g_prof.enabled) return -1;
+    if (!pthread_equal(pthread_self(), g_prof.thread)) return -1;
+    id = g_prof.nb_events++ % MAX_EVENTS;
+    event = &g_prof.events[id];
+    event->name = name;
+    event->depth = g_prof.depth++;
+    event->duration = -1;
+    event->start = get_time();
+    return id;
+}
+
+void profiler_scope_end(const int *id)
+{
+    profiler_event_t *event;
+    if (*id < 0 || !g_prof.enabled) return;
+    event = &g_prof.events[*id];
+    event->duration = get_time() - event->start;
+    g_prof.depth--;
+}
+
+int profiler_get_last_frame(profiler_event_t *events, int size,
+                            double *duration)
+{
+    unsigned int f, i, start, end;
+    int n = 0;
+
+    if (g_prof.nb_frames < 2) return 0;
+    f = g_prof.nb_frames - 2;
+    start = g_prof.frames[f % MAX_FRAMES];
+    end = g_prof.frames[(f + 1) % MAX_FRAMES];
+    if (g_prof.nb_events - start > MAX_EVENTS) return 0; // Overwritten.
+    for (i = start; i < end && n < size; i++) {
+        events[n] = g_prof.events[i % MAX_EVENTS];
+        events[n++].start -= g_prof.frames_start[f % MAX_FRAMES];
+    }
+    if (duration) {
+        *duration = g_prof.frames_start[(f + 1) % MAX_FRAMES] -
+                    g_prof.frames_start[f % MAX_FRAMES];
+    }
+    return n;
+}
+
+int profiler_write_trace(const char *path)
+{
+    FILE *out;
+    unsigned int i, first;
+    const profiler_event_t *e;
+    bool comma = false;
+    const char *fmt = "%s\n{\"name\": \"%s\", \"ph\": \"X\", "
+                      "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, \"tid\": 0}";
+
+    out = fopen(path, "w");
+    if (!out) return -1;
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+    // The frames, except the last one that is not finished.
+    first = g_prof.nb_frames > MAX_FRAMES ? g_prof.nb_frames - MAX_FRAMES : 0;
+    for (i = first; i + 1 < g_prof.nb_frames; i++) {
+        fprintf(out, fmt, comma ? "," : "", "frame",
+                g_prof.frames_start[i % MAX_FRAMES] * 1e6,
+                (g_prof.frames_start[(i + 1) % MAX_FRAMES] -
+                 g_prof.frames_start[i % MAX_FRAMES]) * 1e6);
+        comma = true;
+    }
+
+    first = g_prof.nb_events > MAX_EVENTS ? g_prof.nb_events - MAX_EVENTS : 0;
+    for (i = first; i < g_prof.nb_events; i++) {
+        e = &g_prof.events[i % MAX_EVENTS];
+        if (e->duration < 0) continue; // Not finished yet.
+        fprintf(out, fmt, comma ? "," : "", e->name,
+                e->start * 1e6, e->duration * 1e6);
+        comma = true;
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,139 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Profiler
+ * Lightweight frame profiler.
+ *
+ * The timings of the instrumented scopes get recorded in a ring buffer,
+ * that we can show in the debug panel or save as a Chrome trace file
+ * (load it in chrome://tracing).
+ *
+ * Only the main thread is recorded, the scopes called from other threads
+ * are ignored.
+ *
+ * Example:
+ *
+ * (start code)
+ * void my_function(void)
+ * {
+ *     PROFILER_SCOPE("my_function");
+ *     ...
+ * }
+ * (end)
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdbool.h>
+
+/*
+ * Type: profiler_event_t
+ * A recorded scope.
+ *
+ * Attributes:
+ *   name       - Name of the scope, should be a static string.
+ *   start      - Start time in seconds, relative to the profiler start.
+ *   duration   - Duration in seconds, or -1 if the scope is still open.
+ *   depth      - Nesting level of the scope.
+ */
+typedef struct {
+    const char  *name;
+    double      start;
+    double      duration;
+    int         depth;
+} profiler_event_t;
+
+/*
+ * Function: profiler_set_enabled
+ * Start or stop the recording.  The profiler is disabled by default.
+ */
+void profiler_set_enabled(bool enabled);
+
+/*
+ * Function: profiler_is_enabled
+ * Return whether the profiler is currently recording.
+ */
+bool profiler_is_enabled(void);
+
+/*
+ * Function: profiler_frame_begin
+ * Mark the start of a new frame.  Should be called from the main thread.
+ */
+void profiler_frame_begin(void);
+
+/*
+ * Function: profiler_scope_begin
+ * Start a timed scope.  Usually called from the <PROFILER_SCOPE> macro.
+ *
+ * Return:
+ *   An id to pass to <profiler_scope_end>, or -1 if the scope is not
+ *   recorded.
+ */
+int profiler_scope_begin(const char *name);
+
+/*
+ * Function: profiler_scope_end
+ * End a timed scope.
+ *
+ * Parameters:
+ *   id - Pointer to the value returned by <profiler_scope_begin>.  We use
+ *        a pointer so that this can be used as a cleanup function.
+ */
+void profiler_scope_end(const int *id);
+
+/*
+ * Function: profiler_get_last_frame
+ * Get the events of the last complete frame.
+ *
+ * The returned events start times are relative to the frame start.
+ *
+ * Parameters:
+ *   events     - Output events array.
+ *   size       - Size of the events array.
+ *   duration   - Output duration of the frame in seconds.  Can be NULL.
+ *
+ * Return:
+ *   The number of events written.
+ */
+int profiler_get_last_frame(profiler_event_t *events, int size,
+                            double *duration);
+
+/*
+ * Function: profiler_write_trace
+ * Save all the recorded events in the Chrome trace_event JSON format.
+ *
+ * Return:
+ *   Zero on success.
+ */
+int profiler_write_trace(const char *path);
+
+/*
+ * Macro: PROFILER_SCOPE
+ * Time the current scope, until the end of the enclosing block.
+ */
+#define PROFILER_SCOPE(name) \
+    __attribute__((cleanup(profiler_scope_end), unused)) \
+    const int PROFILER_CONCAT_(profiler_scope_, __LINE__) = \
+        profiler_scope_begin(name)
+
+#define PROFILER_CONCAT_(a, b) PROFILER_CONCAT2_(a, b)
+#define PROFILER_CONCAT2_(a, b) a ## b
+
+#endif // PROFILER_H
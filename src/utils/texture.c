@@ -85,6 +85,31 @@ void texture_set_data(texture_t *tex,
         GL(glGenerateMipmap(GL_TEXTURE_2D));
 }
 
+void texture_set_sub_data(texture_t *tex, const uint8_t *data, int w,
+                          int bpp, const int rect[4])
+{
+    uint8_t *buf = NULL;
+    int i;
+
+    assert(tex->tex);
+    data += (rect[1] * w + rect[0]) * bpp;
+    // Pack the rows if the rectangle is narrower than the image.
+    if (rect[2] != w) {
+        buf = malloc(rect[2] * rect[3] * bpp);
+        for (i = 0; i < rect[3]; i++) {
+            memcpy(&buf[i * rect[2] * bpp], &data[i * w * bpp],
+                   rect[2] * bpp);
+        }
+        data = buf;
+    }
+    GL(glBindTexture(GL_TEXTURE_2D, tex->tex));
+    GL(glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], rect[2], rect[3],
+                       tex->format, GL_UNSIGNED_BYTE, data));
+    free(buf);
+    if (tex->flags & TF_MIPMAP)
+        GL(glGenerateMipmap(GL_TEXTURE_2D));
+}
+
 texture_t *texture_new_from_buf(const uint8_t *data,
                                 int w, int h, int bpp, int flags)
 {
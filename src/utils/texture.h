@@ -63,4 +63,18 @@ void texture_delete(texture_t *tex);
 void texture_set_data(texture_t *tex,
                       const uint8_t *data, int w, int h, int bpp);
 
+/*
+ * Function: texture_set_sub_data
+ * Update a rectangle of a texture.
+ *
+ * Parameters:
+ *   tex  - The texture.
+ *   data - The full image data, with rows of w pixels.
+ *   w    - Width of the image data.
+ *   bpp  - Bytes per pixel of the image data.
+ *   rect - The rectangle to update, as x, y, w, h.
+ */
+void texture_set_sub_data(texture_t *tex, const uint8_t *data, int w,
+                          int bpp, const int rect[4]);
+
 #endif // TEXTURE_H